@@ -7,6 +7,26 @@
 #include "../platform/llvm/llvm_include.hpp"
 #include "../platform/typedefs/typedefs.hpp"
 #include "../debugging/debuginfo.cpp"
+#include "../lexer/lexer.cpp"
+#include "../memory/arena.cpp"
+#include "./flat_ast.cpp"
+#include "./types.cpp"
+
+// NOTE(srp): Expression nodes live in ASTArena and point at each other with
+// plain pointers. The driver resets the arena once it's done with a top-level
+// definition or expression, so no node outlives its item. Prototypes are
+// still heap allocated, FunctionProtos holds on to them.
+
+/// ASTArena - Holds every ExprAST parsed for the current top-level item.
+global_variable thread_local MemoryArena ASTArena;
+
+/// NewAST - Allocate an expression node in ASTArena.
+template <typename T, typename... ArgTypes>
+internal T *
+NewAST(ArgTypes&&... Args)
+{
+    return PushNew<T>(&ASTArena, std::forward<ArgTypes>(Args)...);
+}
 
 llvm::raw_ostream &
 indent(llvm::raw_ostream &O, int32 size)
@@ -19,12 +39,23 @@ class ExprAST
 {
     SourceLocation Loc;
 
-    // TODO(srp): Add a type field
     public:
         ExprAST(SourceLocation Loc = CurLoc) : Loc(Loc) {}
         virtual ~ExprAST() {}
         virtual llvm::Value *codegen() = 0;
 
+        /// simplify - Fold the node and its children, see simplify.cpp. Returns
+        /// what should take the node's place, which may be the node itself.
+        virtual ExprAST *simplify() { return this; }
+
+        /// isConstant - Whether this is a literal, and its value if so.
+        virtual bool32 isConstant(Literal *) const { return false; }
+
+        /// codegenAssign - Store what Value emits into this node, the
+        /// destination of an '='. Only variables and indexing can be one.
+        virtual llvm::Value *codegenAssign(SourceLocation Loc, llvm::function_ref<llvm::Value*()> Value);
+
+        SourceLocation getLoc() const { return Loc; }
         int32 getLine() const { return Loc.Line; }
         int32 getCol() const { return Loc.Col; }
 
@@ -38,57 +69,109 @@ class ExprAST
 /// NumberExprAST - Expression class for numeric literals like "1.0"
 class NumberExprAST : public ExprAST
 {
-    real64 Val;
+    Literal Val;
 
     public:
-        NumberExprAST(real64 Val) : Val(Val) {}
+        NumberExprAST(Literal Val) : Val(Val) {}
+        NumberExprAST(SourceLocation Loc, Literal Val) : ExprAST(Loc), Val(Val) {}
         llvm::Value *codegen() override;
 
+        bool32
+        isConstant(Literal *Result) const override
+        {
+            *Result = Val;
+            return true;
+        }
+
         llvm::raw_ostream &
         dump(llvm::raw_ostream &out, int32 ind) override
         {
-            return ExprAST::dump(out << Val, ind);
+            return ExprAST::dump(out << Val.Val, ind);
         }
 };
 
 /// VariableExprAST - Expression class for referencing a variable, like "a".
 class VariableExprAST : public ExprAST
 {
-    std::string Name;
+    Symbol Name;
 
     public:
-        VariableExprAST(SourceLocation Loc, const std::string &Name) 
+        VariableExprAST(SourceLocation Loc, Symbol Name) 
             : ExprAST(Loc), Name(Name) {}
         llvm::Value *codegen() override;
-        const std::string &getName() const { return Name; }
+        llvm::Value *codegenAssign(SourceLocation Loc, llvm::function_ref<llvm::Value*()> Value) override;
+        Symbol getName() const { return Name; }
 
         llvm::raw_ostream &
         dump(llvm::raw_ostream &out, int32 ind) override
         {
-            return ExprAST::dump(out << Name, ind);
+            return ExprAST::dump(out << SymbolName(Name), ind);
         }
 };
 
+/// IndexExprAST - Expression class for an array element, like "a[i]".
+class IndexExprAST : public ExprAST
+{
+    Symbol Array;
+    ExprAST *Index;
+
+    public:
+        IndexExprAST(SourceLocation Loc, Symbol Array, ExprAST *Index)
+            : ExprAST(Loc), Array(Array), Index(Index) {}
+        llvm::Value *codegen() override;
+        llvm::Value *codegenAssign(SourceLocation Loc, llvm::function_ref<llvm::Value*()> Value) override;
+        ExprAST *simplify() override;
+
+        llvm::raw_ostream &
+        dump(llvm::raw_ostream &out, int32 ind) override
+        {
+            ExprAST::dump(out << "index " << SymbolName(Array), ind);
+            Index->dump(indent(out, ind) << "Index:", ind + 1);
+            return out;
+        }
+};
+
+/// VarBinding - One variable of a var/in. Init is null when it has no
+/// initializer, Type is Type_Inferred when it has no annotation.
+struct VarBinding
+{
+    Symbol Name;
+    ValueType Type;
+    ExprAST *Init;
+};
+
 /// VarExprAST - Expression class for var/in (variable creation)
 class VarExprAST : public ExprAST
 {
-    std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames; // Local mutable variable list
-    std::unique_ptr<ExprAST> Body; // Scope of the variable list
+    std::vector<VarBinding> VarNames; // Local mutable variable list
+    ExprAST *Body; // Scope of the variable list
 
     public:
-        VarExprAST(std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames,
-                std::unique_ptr<ExprAST> Body)
-            : VarNames(std::move(VarNames)), Body(std::move(Body)) {}
+        VarExprAST(std::vector<VarBinding> VarNames, ExprAST *Body)
+            : VarNames(std::move(VarNames)), Body(Body) {}
 
         llvm::Value *codegen() override;
+        ExprAST *simplify() override;
 
         llvm::raw_ostream &
         dump(llvm::raw_ostream &out, int32 ind) override
         {
             ExprAST::dump(out << "var", ind);
-            for (const auto &NamedVar : VarNames)
+            for (const VarBinding &Var : VarNames)
             {
-                NamedVar.second->dump(indent(out, ind) << NamedVar.first << ':', ind + 1);
+                indent(out, ind) << SymbolName(Var.Name) << ':';
+                if (Var.Type != Type_Inferred)
+                {
+                    out << TypeName(Var.Type) << ':';
+                }
+                if (Var.Init)
+                {
+                    Var.Init->dump(out, ind + 1);
+                }
+                else
+                {
+                    out << "null\n";
+                }
             }
             Body->dump(indent(out, ind) << "Body:", ind + 1);
             return out;
@@ -99,18 +182,19 @@ class VarExprAST : public ExprAST
 class UnaryExprAST : public ExprAST
 {
     char Opcode;
-    std::unique_ptr<ExprAST> Operand;
+    ExprAST *Operand;
 
     public:
-        UnaryExprAST(char Opcode, std::unique_ptr<ExprAST> Operand)
-            : Opcode(Opcode), Operand(std::move(Operand)) {}
+        UnaryExprAST(char Opcode, ExprAST *Operand)
+            : Opcode(Opcode), Operand(Operand) {}
 
         llvm::Value *codegen() override;
+        ExprAST *simplify() override;
 
         llvm::raw_ostream &
         dump(llvm::raw_ostream &out, int32 ind) override
         {
-            ExprAST::dump(out << "{unary" << Opcode << "}", ind);
+            ExprAST::dump(out << "{unary" << OperatorSpelling(Opcode) << "}", ind);
             Operand->dump(out, ind+1);
             return out;
         }
@@ -120,17 +204,18 @@ class UnaryExprAST : public ExprAST
 class BinaryExprAST : public ExprAST
 {
     char Op;
-    std::unique_ptr<ExprAST> LHS, RHS;
+    ExprAST *LHS, *RHS;
 
     public:
-        BinaryExprAST(SourceLocation Loc, char Op, std::unique_ptr<ExprAST> LHS, std::unique_ptr<ExprAST> RHS)
-            : ExprAST(Loc), Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+        BinaryExprAST(SourceLocation Loc, char Op, ExprAST *LHS, ExprAST *RHS)
+            : ExprAST(Loc), Op(Op), LHS(LHS), RHS(RHS) {}
         llvm::Value *codegen() override;
+        ExprAST *simplify() override;
 
         llvm::raw_ostream &
         dump(llvm::raw_ostream &out, int32 ind) override
         {
-            ExprAST::dump(out << "{binary" << Op << "}", ind);
+            ExprAST::dump(out << "{binary" << OperatorSpelling(Op) << "}", ind);
             LHS->dump(indent(out, ind) << "LHS:", ind + 1);
             RHS->dump(indent(out, ind) << "RHS:", ind + 1);
             return out;
@@ -140,18 +225,19 @@ class BinaryExprAST : public ExprAST
 /// CallExprAST - Expression class for function calls.
 class CallExprAST : public ExprAST
 {
-    std::string Callee;
-    std::vector<std::unique_ptr<ExprAST>> Args;
+    Symbol Callee;
+    llvm::MutableArrayRef<ExprAST*> Args;
 
     public:
-        CallExprAST(SourceLocation Loc, const std::string &Callee, std::vector<std::unique_ptr<ExprAST>> Args)
-            : ExprAST(Loc), Callee(Callee), Args(std::move(Args)) {}
+        CallExprAST(SourceLocation Loc, Symbol Callee, llvm::MutableArrayRef<ExprAST*> Args)
+            : ExprAST(Loc), Callee(Callee), Args(Args) {}
         llvm::Value *codegen() override;
+        ExprAST *simplify() override;
 
         llvm::raw_ostream &
         dump(llvm::raw_ostream &out, int32 ind) override
         {
-            ExprAST::dump(out << "call " << Callee, ind);
+            ExprAST::dump(out << "call " << SymbolName(Callee), ind);
             for (const auto &Arg : Args)
             {
                 Arg->dump(indent(out, ind + 1), ind + 1);
@@ -163,13 +249,14 @@ class CallExprAST : public ExprAST
 /// IfExprAST - Expression class for if/then/else
 class IfExprAST : public ExprAST
 {
-    std::unique_ptr<ExprAST> Cond, Then, Else;
+    ExprAST *Cond, *Then, *Else;
 
     public:
-        IfExprAST(SourceLocation Loc, std::unique_ptr<ExprAST> Cond, std::unique_ptr<ExprAST> Then, std::unique_ptr<ExprAST> Else)
-            : ExprAST(Loc), Cond(std::move(Cond)), Then(std::move(Then)), Else(std::move(Else)) {}
+        IfExprAST(SourceLocation Loc, ExprAST *Cond, ExprAST *Then, ExprAST *Else)
+            : ExprAST(Loc), Cond(Cond), Then(Then), Else(Else) {}
 
         llvm::Value *codegen() override;
+        ExprAST *simplify() override;
 
         llvm::raw_ostream &
         dump(llvm::raw_ostream &out, int32 ind) override
@@ -185,17 +272,15 @@ class IfExprAST : public ExprAST
 /// ForExprAST - Expression class for for/in
 class ForExprAST : public ExprAST
 {
-    std::string VarName;
-    std::unique_ptr<ExprAST> Start, End, Step, Body;
+    Symbol VarName;
+    ExprAST *Start, *End, *Step, *Body;
 
     public:
-        ForExprAST(const std::string &VarName, std::unique_ptr<ExprAST> Start,
-                std::unique_ptr<ExprAST> End, std::unique_ptr<ExprAST> Step,
-                std::unique_ptr<ExprAST> Body)
-            : VarName(VarName), Start(std::move(Start)), End(std::move(End)), Step(std::move(Step)), 
-                Body(std::move(Body)) {}
+        ForExprAST(SourceLocation Loc, Symbol VarName, ExprAST *Start, ExprAST *End, ExprAST *Step, ExprAST *Body)
+            : ExprAST(Loc), VarName(VarName), Start(Start), End(End), Step(Step), Body(Body) {}
 
         llvm::Value *codegen() override;
+        ExprAST *simplify() override;
 
         llvm::raw_ostream &
         dump(llvm::raw_ostream &out, int32 ind) override
@@ -209,25 +294,49 @@ class ForExprAST : public ExprAST
         }
 };
 
+/// FunctionQualifier - Flags for the words that can come before a prototype,
+/// 'def pure f(x)'. See the note on them in ast_codegen.cpp.
+enum FunctionQualifier
+{
+    Qualifier_Pure = 1 << 0, // No side effects, always returns
+    Qualifier_Memo = 1 << 1, // Pure body, and every result is kept for next time
+};
+
 /// PrototypeAST - This class represents the "prototype" for a function,
 /// which captures its name and its argument names (thus, the number of args too)
 /// as well as if it is an operator.
 class PrototypeAST
 {
-    std::string Name;
-    std::vector<std::string> Args;
+    Symbol Name;
+    std::vector<Symbol> Args;
+    std::vector<ValueType> ArgTypes; // Empty when they're all doubles
+    ValueType ReturnType;
 
     bool32 IsOperator;
     unsigned Precedence; // Precedence if a binop
+    uint32 Qualifiers;   // FunctionQualifier flags
     int32 Line;
 
     public:
-        PrototypeAST(SourceLocation Loc, const std::string &Name, std::vector<std::string> Args,
-                bool32 IsOperator = false, unsigned Prec = 0)
-            : Name(Name), Args(std::move(Args)), IsOperator(IsOperator), Precedence(Prec), Line(Loc.Line) {}
+        PrototypeAST(SourceLocation Loc, Symbol Name, std::vector<Symbol> Args,
+                bool32 IsOperator = false, unsigned Prec = 0,
+                std::vector<ValueType> ArgTypes = {}, ValueType ReturnType = Type_Double,
+                uint32 Qualifiers = 0)
+            : Name(Name), Args(std::move(Args)), ArgTypes(std::move(ArgTypes)), ReturnType(ReturnType),
+              IsOperator(IsOperator), Precedence(Prec), Qualifiers(Qualifiers), Line(Loc.Line) {}
 
         llvm::Function *codegen();
-        const std::string &getName() const { return Name; }
+        llvm::FunctionType *getFunctionType() const;
+        Symbol getName() const { return Name; }
+        Symbol getArg(uint32 Index) const { return Args[Index]; }
+        uint32 getNumArgs() const { return (uint32)Args.size(); }
+
+        ValueType getArgType(uint32 Index) const { return ArgTypes.empty() ? Type_Double : ArgTypes[Index]; }
+        ValueType getReturnType() const { return ReturnType; }
+
+        /// isPure - Whether the body keeps to the pure rules, memo ones do too.
+        bool32 isPure() const { return Qualifiers != 0; }
+        bool32 isMemo() const { return (Qualifiers & Qualifier_Memo) != 0; }
 
         bool32 isUnaryOp() const { return IsOperator && Args.size() == 1; }
         bool32 isBinaryOp() const { return IsOperator && Args.size() == 2; }
@@ -235,32 +344,74 @@ class PrototypeAST
         char getOperatorName() const
         {
             assert(isUnaryOp() || isBinaryOp());
-            return Name[Name.size() - 2]; // since the names are '{unary:}' we
-                                          // want the second to last char
+            llvm::StringRef OpName = SymbolName(Name);
+            return OpName[OpName.size() - 2]; // since the names are '{unary:}' we
+                                              // want the second to last char
         }
 
         unsigned getBinaryPrecedence() const { return Precedence; }
         int32 getLine() const { return Line; }
 };
 
+/// ExprRef - A parsed expression in whichever form the parser is building, an
+/// ExprAST tree or a node in TheFlatAST.
+struct ExprRef
+{
+    ExprAST *Tree;
+    uint32 Flat;
+
+    ExprRef(ExprAST *Tree = nullptr) : Tree(Tree), Flat(FlatNone) {}
+    explicit ExprRef(uint32 Flat) : Tree(nullptr), Flat(Flat) {}
+
+    explicit operator bool() const { return Tree || Flat != FlatNone; }
+};
+
 /// FunctionAST - This class represents a function definition itself.
 class FunctionAST
 {
     std::unique_ptr<PrototypeAST> Proto;
-    std::unique_ptr<ExprAST> Body;
+    PrototypeAST *Installed = nullptr; // Proto once it's in FunctionProtos
+    ExprRef Body;
+
+    // installPrototype() hands Proto over to FunctionProtos, these outlive that.
+    Symbol Name;
+    uint32 NumArgs;
+
+    uint64 Hash;                 // Of the definition's tokens, see getNextToken
+    std::vector<Symbol> Callees; // Every function the body calls
 
     public:
-        FunctionAST(std::unique_ptr<PrototypeAST> Proto, std::unique_ptr<ExprAST> Body)
-            : Proto(std::move(Proto)), Body(std::move(Body)) {}
+        FunctionAST(std::unique_ptr<PrototypeAST> Proto, ExprRef Body, uint64 Hash = 0,
+                std::vector<Symbol> Callees = {})
+            : Proto(std::move(Proto)), Body(Body), Name(this->Proto->getName()),
+              NumArgs(this->Proto->getNumArgs()), Hash(Hash), Callees(std::move(Callees)) {}
         llvm::Function *codegen();
 
+        /// simplify - Run the AST simplifier over the body.
+        void simplify();
+
+        /// installPrototype - Move the prototype into FunctionProtos so calls to
+        /// this function can be generated. codegen() does it if nobody has.
+        PrototypeAST &installPrototype();
+
+        const PrototypeAST &getProto() const { return Proto ? *Proto : *Installed; }
+        Symbol getName() const { return Name; }
+        uint32 getNumArgs() const { return NumArgs; }
+
+        uint64 getHash() const { return Hash; }
+        const std::vector<Symbol> &getCallees() const { return Callees; }
+
         llvm::raw_ostream &
         dump(llvm::raw_ostream &out, int32 ind)
         {
             indent(out, ind) << "FunctionAST\n";
             ++ind;
             indent(out, ind) << "Body:";
-            return Body ? Body->dump(out, ind) : out << "null\n";
+            if (Body.Tree)
+            {
+                return Body.Tree->dump(out, ind);
+            }
+            return Body ? FlatDump(Body.Flat, out, ind) : out << "null\n";
         }
 };
 
@@ -0,0 +1,149 @@
+#pragma once
+// NOTE(srp): Still not final platform-independent code
+
+#include <utility>
+#include <vector>
+#include "../platform/llvm/llvm_include.hpp"
+#include "../platform/typedefs/typedefs.hpp"
+#include "./ast.cpp"
+#include "./flat_ast.cpp"
+
+// NOTE(srp): The parser builds expressions through these, so it doesn't care
+// whether it's making ExprAST trees or flat nodes (--flat-ast). Nodes take
+// their location the same way in both: the ones without a Loc argument are at
+// CurLoc when they're made.
+
+internal ExprRef
+MakeNumberExpr(Literal Val)
+{
+    if (!FlatASTMode)
+    {
+        return NewAST<NumberExprAST>(Val);
+    }
+
+    uint32 Index = AddFlatNode(FlatKind_Number, 0, CurLoc);
+    SetFlatNumber(&TheFlatAST.Nodes[Index], Val);
+    return ExprRef(Index);
+}
+
+internal ExprRef
+MakeVariableExpr(SourceLocation Loc, Symbol Name)
+{
+    if (!FlatASTMode)
+    {
+        return NewAST<VariableExprAST>(Loc, Name);
+    }
+    return ExprRef(AddFlatNode(FlatKind_Variable, 0, Loc, Name));
+}
+
+internal ExprRef
+MakeIndexExpr(SourceLocation Loc, Symbol Array, ExprRef Index)
+{
+    if (!FlatASTMode)
+    {
+        return NewAST<IndexExprAST>(Loc, Array, Index.Tree);
+    }
+    return ExprRef(AddFlatNode(FlatKind_Index, 0, Loc, Array, Index.Flat));
+}
+
+internal ExprRef
+MakeUnaryExpr(char Opcode, ExprRef Operand)
+{
+    if (!FlatASTMode)
+    {
+        return NewAST<UnaryExprAST>(Opcode, Operand.Tree);
+    }
+    return ExprRef(AddFlatNode(FlatKind_Unary, Opcode, CurLoc, Operand.Flat));
+}
+
+internal ExprRef
+MakeBinaryExpr(SourceLocation Loc, char Op, ExprRef LHS, ExprRef RHS)
+{
+    if (!FlatASTMode)
+    {
+        return NewAST<BinaryExprAST>(Loc, Op, LHS.Tree, RHS.Tree);
+    }
+    return ExprRef(AddFlatNode(FlatKind_Binary, Op, Loc, LHS.Flat, RHS.Flat));
+}
+
+internal ExprRef
+MakeCallExpr(SourceLocation Loc, Symbol Callee, llvm::ArrayRef<ExprRef> Args)
+{
+    if (!FlatASTMode)
+    {
+        // The node only keeps a view of the arguments, so they go in the arena too.
+        ExprAST **ArgNodes = (ExprAST **)PushSize(&ASTArena, sizeof(ExprAST*) * Args.size(), alignof(ExprAST*));
+        for (size_t Arg = 0; Arg < Args.size(); ++Arg)
+        {
+            ArgNodes[Arg] = Args[Arg].Tree;
+        }
+        return NewAST<CallExprAST>(Loc, Callee, llvm::MutableArrayRef<ExprAST*>(ArgNodes, Args.size()));
+    }
+
+    uint32 FirstArg = (uint32)TheFlatAST.Extra.size();
+    for (const ExprRef &Arg : Args)
+    {
+        TheFlatAST.Extra.push_back(Arg.Flat);
+    }
+    return ExprRef(AddFlatNode(FlatKind_Call, 0, Loc, Callee, FirstArg, (uint32)Args.size()));
+}
+
+internal ExprRef
+MakeIfExpr(SourceLocation Loc, ExprRef Cond, ExprRef Then, ExprRef Else)
+{
+    if (!FlatASTMode)
+    {
+        return NewAST<IfExprAST>(Loc, Cond.Tree, Then.Tree, Else.Tree);
+    }
+    return ExprRef(AddFlatNode(FlatKind_If, 0, Loc, Cond.Flat, Then.Flat, Else.Flat));
+}
+
+/// MakeForExpr - Step is optional.
+internal ExprRef
+MakeForExpr(SourceLocation Loc, Symbol VarName, ExprRef Start, ExprRef End, ExprRef Step, ExprRef Body)
+{
+    if (!FlatASTMode)
+    {
+        return NewAST<ForExprAST>(Loc, VarName, Start.Tree, End.Tree, Step.Tree, Body.Tree);
+    }
+
+    uint32 Rest = (uint32)TheFlatAST.Extra.size();
+    TheFlatAST.Extra.push_back(End.Flat);
+    TheFlatAST.Extra.push_back(Step.Flat);
+    TheFlatAST.Extra.push_back(Body.Flat);
+    return ExprRef(AddFlatNode(FlatKind_For, 0, Loc, VarName, Start.Flat, Rest));
+}
+
+/// ParsedVar - A var binding as the parser reads it, see VarBinding.
+struct ParsedVar
+{
+    Symbol Name;
+    ValueType Type;
+    ExprRef Init;
+};
+
+/// MakeVarExpr - Initializers and types are optional.
+internal ExprRef
+MakeVarExpr(std::vector<ParsedVar> VarNames, ExprRef Body)
+{
+    if (!FlatASTMode)
+    {
+        std::vector<VarBinding> TreeVarNames;
+        TreeVarNames.reserve(VarNames.size());
+        for (const ParsedVar &Var : VarNames)
+        {
+            TreeVarNames.push_back({Var.Name, Var.Type, Var.Init.Tree});
+        }
+        return NewAST<VarExprAST>(std::move(TreeVarNames), Body.Tree);
+    }
+
+    uint32 List = (uint32)TheFlatAST.Extra.size();
+    TheFlatAST.Extra.push_back((uint32)VarNames.size());
+    for (const ParsedVar &Var : VarNames)
+    {
+        TheFlatAST.Extra.push_back(Var.Name);
+        TheFlatAST.Extra.push_back(Var.Type);
+        TheFlatAST.Extra.push_back(Var.Init.Flat);
+    }
+    return ExprRef(AddFlatNode(FlatKind_Var, 0, CurLoc, List, Body.Flat));
+}
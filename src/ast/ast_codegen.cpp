@@ -4,27 +4,29 @@
 #include "../platform/typedefs/typedefs.hpp"
 
 #include "./ast.cpp"
+#include "./simplify.cpp"
 #include "../logging/ast_err.cpp"
 #include "../debugging/debuginfo.cpp"
 #include "../debugging/debuggen.cpp"
+#include "../optimizer/optimizer.cpp"
+#include "../optimizer/operator_registry.cpp"
 
 #include <string>
 
 llvm::Function *
-getFunction(std::string Name)
+getFunction(Symbol Name)
 {
     // First, see if the function has already been added to the current module.
-    if (auto *F = TheModule->getFunction(Name))
+    if (llvm::Function **F = ModuleFunctions.find(Name))
     {
-        return F;
+        return *F;
     }
 
     // If not, check whether we can codegen the declaration from some existing
     // prototype.
-    auto FI = FunctionProtos.find(Name);
-    if (FI != FunctionProtos.end())
+    if (std::unique_ptr<PrototypeAST> *Proto = FunctionProtos.find(Name))
     {
-        return FI->second->codegen();
+        return (*Proto)->codegen();
     }
 
     // If no existing prototype exists, return null.
@@ -34,37 +36,306 @@ getFunction(std::string Name)
 /// CreateEntryBlockAlloca - Create an alloca instruction in the entry block of
 /// the function. This is used for mutable variables etc.
 internal llvm::AllocaInst *
-CreateEntryBlockAlloca(llvm::Function *TheFunction, llvm::StringRef VarName)
+CreateEntryBlockAlloca(llvm::Function *TheFunction, llvm::StringRef VarName, llvm::Type *Type)
 {
     llvm::IRBuilder<> TmpB(&TheFunction->getEntryBlock(), TheFunction->getEntryBlock().begin());
-    return TmpB.CreateAlloca(llvm::Type::getDoubleTy(*TheContext), 0, VarName);
+    return TmpB.CreateAlloca(Type, 0, VarName);
 }
 
-llvm::Value*
-NumberExprAST::codegen()
+// NOTE(srp): Types. Every value is an i64, a double, a vector of doubles or
+// a pointer to an array's doubles, see types.cpp. The helpers below convert between them where the rules say
+// so, and return null after logging an error where they don't.
+
+internal llvm::Type *
+GetLLVMType(ValueType Type)
 {
-    KSDbgInfo.emitLocation(this);
-    return llvm::ConstantFP::get(*TheContext, llvm::APFloat(Val));
+    switch (Type)
+    {
+        case Type_Int:
+            return llvm::Type::getInt64Ty(*TheContext);
+        case Type_Vec4:
+            return llvm::FixedVectorType::get(llvm::Type::getDoubleTy(*TheContext), 4);
+        case Type_Vec8:
+            return llvm::FixedVectorType::get(llvm::Type::getDoubleTy(*TheContext), 8);
+        case Type_Array:
+            return llvm::Type::getDoublePtrTy(*TheContext);
+        default:
+            return llvm::Type::getDoubleTy(*TheContext);
+    }
 }
 
-llvm::Value*
-VariableExprAST::codegen()
+internal bool32
+IsIntValue(llvm::Value *V)
+{
+    return V->getType()->isIntegerTy();
+}
+
+internal bool32
+IsVectorValue(llvm::Value *V)
+{
+    return V->getType()->isVectorTy();
+}
+
+internal bool32
+IsArrayValue(llvm::Value *V)
+{
+    return V->getType()->isPointerTy();
+}
+
+/// ConvertValue - V as a value of Type. Doubles become ints rounding toward
+/// zero and saturating, NaN becomes 0. Scalars become vectors with V in every
+/// lane.
+internal llvm::Value *
+ConvertValue(llvm::Value *V, llvm::Type *Type)
+{
+    if (V->getType() == Type)
+    {
+        return V;
+    }
+
+    if (Type->isPointerTy())
+    {
+        return LogErrorV("Only array() makes an array");
+    }
+    if (IsArrayValue(V))
+    {
+        return LogErrorV("An array can't be used as a number, index it with []");
+    }
+
+    if (llvm::FixedVectorType *VecTy = llvm::dyn_cast<llvm::FixedVectorType>(Type))
+    {
+        if (IsVectorValue(V))
+        {
+            return LogErrorV("Vectors of different widths can't be mixed");
+        }
+        V = ConvertValue(V, VecTy->getElementType());
+        return Builder->CreateVectorSplat(VecTy->getNumElements(), V, "splat");
+    }
+    if (IsVectorValue(V))
+    {
+        return LogErrorV("A vector can't be used as a scalar, see lane() and hsum()");
+    }
+
+    if (Type->isIntegerTy())
+    {
+        // NOTE(srp): A plain fptosi of a NaN or an out of range double is
+        // poison, an array index could slip right past its bounds check.
+        return Builder->CreateIntrinsic(llvm::Intrinsic::fptosi_sat, {Type, V->getType()}, {V}, nullptr, "toint");
+    }
+    return Builder->CreateSIToFP(V, Type, "todouble");
+}
+
+/// EmitTruthTest - The i1 for a condition: true when it's unequal to zero, a
+/// NaN isn't true. For a vector mask it's a vector of i1.
+internal llvm::Value *
+EmitTruthTest(llvm::Value *V, const llvm::Twine &Name)
+{
+    if (IsArrayValue(V))
+    {
+        return LogErrorV("An array can't be a condition");
+    }
+    if (IsIntValue(V))
+    {
+        return Builder->CreateICmpNE(V, llvm::ConstantInt::get(V->getType(), 0), Name);
+    }
+    return Builder->CreateFCmpONE(V, llvm::ConstantFP::get(V->getType(), 0.0), Name);
+}
+
+/// EmitCondition - EmitTruthTest for a branch, which needs a single i1. A
+/// comparison is branched on as it is, not through the 0.0 or 1.0 EmitBool
+/// made of it, so a loop's exit test stays one the optimizer can count.
+internal llvm::Value *
+EmitCondition(llvm::Value *V, const llvm::Twine &Name)
+{
+    if (IsVectorValue(V))
+    {
+        return LogErrorV("A vector can't be a condition, reduce it with hmax() or hmin()");
+    }
+
+    llvm::UIToFPInst *Bool = llvm::dyn_cast<llvm::UIToFPInst>(V);
+    if (Bool && Bool->getSrcTy()->isIntegerTy(1))
+    {
+        llvm::Value *Test = Bool->getOperand(0);
+        if (Bool->use_empty())
+        {
+            Bool->eraseFromParent();
+        }
+        return Test;
+    }
+    return EmitTruthTest(V, Name);
+}
+
+/// EmitBool - Convert bool 0/1 to double 0.0 or 1.0, lane by lane for a
+/// vector of them.
+internal llvm::Value *
+EmitBool(llvm::Value *V)
+{
+    llvm::Type *Type = llvm::Type::getDoubleTy(*TheContext);
+    if (llvm::FixedVectorType *VecTy = llvm::dyn_cast<llvm::FixedVectorType>(V->getType()))
+    {
+        Type = llvm::FixedVectorType::get(Type, VecTy->getNumElements());
+    }
+    return Builder->CreateUIToFP(V, Type, "booltmp");
+}
+
+/// UnifiedType - The type an operator on A and B works on: two ints stay
+/// ints, an int next to a double becomes a double and a scalar next to a
+/// vector goes to every lane. Null for vectors of different widths.
+internal llvm::Type *
+UnifiedType(llvm::Type *A, llvm::Type *B)
+{
+    if (A == B)
+    {
+        return A;
+    }
+    if (A->isVectorTy() && B->isVectorTy())
+    {
+        return nullptr;
+    }
+    if (A->isVectorTy())
+    {
+        return A;
+    }
+    if (B->isVectorTy())
+    {
+        return B;
+    }
+    return llvm::Type::getDoubleTy(*TheContext);
+}
+
+/// UnifyOperands - Convert both operands of an arithmetic operator to their
+/// UnifiedType, which is returned. Null after an error.
+internal llvm::Type *
+UnifyOperands(llvm::Value **L, llvm::Value **R)
+{
+    llvm::Type *Type = UnifiedType((*L)->getType(), (*R)->getType());
+    if (!Type)
+    {
+        LogError("Vectors of different widths can't be mixed");
+        return nullptr;
+    }
+    if (Type->isPointerTy())
+    {
+        LogError("Arrays have no operators, index them with []");
+        return nullptr;
+    }
+
+    *L = ConvertValue(*L, Type);
+    *R = ConvertValue(*R, Type);
+    return (*L && *R) ? Type : nullptr;
+}
+
+// NOTE(srp): A var or for variable without an annotation takes the type of its
+// initial value. Storing a double into one that came out an int doesn't round
+// the double. It demotes the variable to a double instead and the whole
+// function is generated again, since everything computed from the variable may
+// change type too. Bindings are numbered in the order codegen meets them,
+// which is the same every time around, so the demotions carry over.
+
+/// TypeInference - The state of the current function's inference.
+struct TypeInference
+{
+    uint32 NextBinding;                                   // Number of the next var or for binding
+    llvm::DenseSet<uint32> Demoted;                       // Bindings that have to be doubles
+    llvm::DenseMap<llvm::AllocaInst*, uint32> IntBindings; // Int allocas that could be demoted
+    bool32 Retry;                                         // Something was demoted this time around
+};
+
+global_variable thread_local TypeInference TheInference;
+
+/// CreateBindingAlloca - The alloca for a var or for variable whose initial
+/// value is Init. Type_Inferred uses Init's type, unless the binding was
+/// demoted.
+internal llvm::AllocaInst *
+CreateBindingAlloca(llvm::Function *TheFunction, Symbol Name, ValueType Type, llvm::Value *Init)
+{
+    uint32 Binding = TheInference.NextBinding++;
+
+    llvm::Type *AllocaType = GetLLVMType(Type);
+    bool32 Inferred = (Type == Type_Inferred) && IsIntValue(Init) && !TheInference.Demoted.count(Binding);
+    if (Inferred || (Type == Type_Inferred && !IsIntValue(Init)))
+    {
+        AllocaType = Init->getType();
+    }
+
+    llvm::AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, SymbolName(Name), AllocaType);
+    if (Inferred)
+    {
+        TheInference.IntBindings[Alloca] = Binding;
+    }
+    return Alloca;
+}
+
+/// EmitStore - Store V into a variable, converted to its type. Returns what
+/// was stored, null if it can't be converted.
+internal llvm::Value *
+EmitStore(llvm::Value *V, llvm::AllocaInst *Alloca)
+{
+    llvm::Type *Type = Alloca->getAllocatedType();
+    if (Type->isIntegerTy() && V->getType()->isDoubleTy())
+    {
+        auto Binding = TheInference.IntBindings.find(Alloca);
+        if (Binding != TheInference.IntBindings.end())
+        {
+            // The code still has to be valid until it's regenerated, so
+            // convert anyway.
+            TheInference.Demoted.insert(Binding->second);
+            TheInference.Retry = true;
+        }
+    }
+
+    V = ConvertValue(V, Type);
+    if (!V)
+    {
+        return nullptr;
+    }
+    Builder->CreateStore(V, Alloca);
+    return V;
+}
+
+// NOTE(srp): The Emit* helpers hold the IR for each kind of expression. Both
+// AST forms use them, ExprAST::codegen() and FlatCodegen() only find the
+// operands and hand over callbacks that generate the children.
+
+/// ExprEmitter - Generates a child expression, returns null on error.
+typedef llvm::function_ref<llvm::Value*()> ExprEmitter;
+
+internal llvm::Value *
+EmitNumber(SourceLocation Loc, Literal Val)
+{
+    KSDbgInfo.emitLocation(Loc);
+    if (Val.IsInteger)
+    {
+        return llvm::ConstantInt::get(llvm::Type::getInt64Ty(*TheContext), (uint64)(int64)Val.Val, true);
+    }
+    return llvm::ConstantFP::get(*TheContext, llvm::APFloat(Val.Val));
+}
+
+internal llvm::Value *
+EmitVariable(SourceLocation Loc, Symbol Name)
 {
     // Look this variable up in the function
-    llvm::AllocaInst *A = NamedValues[Name];
+    llvm::AllocaInst **A = NamedValues.find(Name);
     if (!A)
     {
         return LogErrorV("Unknown variable name");
     }
 
-    KSDbgInfo.emitLocation(this);
+    KSDbgInfo.emitLocation(Loc);
 
     // Load the value
-    return Builder->CreateLoad(A->getAllocatedType(), A, Name.c_str());
+    return Builder->CreateLoad((*A)->getAllocatedType(), *A, SymbolName(Name));
 }
 
-llvm::Value*
-VarExprAST::codegen()
+/// EmitVar - Count variables, GetName(i) names the i'th, GetType(i) is its
+/// annotation and EmitInit(i) emits its initializer, or returns 0.0 if it has
+/// none.
+internal llvm::Value *
+EmitVar(SourceLocation Loc, uint32 Count,
+        llvm::function_ref<Symbol(uint32)> GetName,
+        llvm::function_ref<ValueType(uint32)> GetType,
+        llvm::function_ref<llvm::Value*(uint32)> EmitInit,
+        ExprEmitter Body)
 {
     // Variables getting shadowed
     std::vector<llvm::AllocaInst*> OldBindings;
@@ -72,282 +343,1234 @@ VarExprAST::codegen()
     llvm::Function *TheFunction = Builder->GetInsertBlock()->getParent();
 
     // Register all variables and emit their initializer
-    for (unsigned i = 0, e = VarNames.size(); i != e; ++i)
+    for (uint32 i = 0; i != Count; ++i)
     {
-        const std::string &VarName = VarNames[i].first;
-        ExprAST *Init = VarNames[i].second.get();
+        Symbol VarName = GetName(i);
 
         // Emit the initializer before adding the variable to scope, this prevents
         // the initializer from referencing the variable itself, and permits stuff
         // like this:
         // var a = 1 in
         //   var a = a in ...  # refers to outer 'a'
-        llvm::Value *InitVal;
-        if (Init)
+        llvm::Value *InitVal = EmitInit(i);
+        if (!InitVal)
         {
-            InitVal = Init->codegen();
-            if (!InitVal)
-            {
-                return nullptr;
-            }
+            return nullptr;
         }
-        else
+
+        llvm::AllocaInst *Alloca = CreateBindingAlloca(TheFunction, VarName, GetType(i), InitVal);
+        if (!EmitStore(InitVal, Alloca))
         {
-            // If no initial value specifier, initialize to zero
-            InitVal = llvm::ConstantFP::get(*TheContext, llvm::APFloat(0.0));
+            return nullptr;
         }
 
-        llvm::AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
-        Builder->CreateStore(InitVal, Alloca);
-
         // Remember the old variable binding so that we can restore the binding when
         // we unrecurse.
-        OldBindings.push_back(NamedValues[VarName]);
+        llvm::AllocaInst *&Binding = NamedValues[VarName];
+        OldBindings.push_back(Binding);
 
         // Remember this binding
-        NamedValues[VarName] = Alloca;
+        Binding = Alloca;
     }
 
-    KSDbgInfo.emitLocation(this);
+    KSDbgInfo.emitLocation(Loc);
 
     // Codegen the body, now that all vars are in scope
-    llvm::Value *BodyVal = Body->codegen();
+    llvm::Value *BodyVal = Body();
     if (!BodyVal)
     {
         return nullptr;
     }
 
     // Pop all our variables from scope
-    for (unsigned i = 0, e = VarNames.size(); i !=e; ++i)
+    for (uint32 i = 0; i != Count; ++i)
     {
-        NamedValues[VarNames[i].first] = OldBindings[i];
+        NamedValues[GetName(i)] = OldBindings[i];
     }
 
     // Return the body computation
     return BodyVal;
 }
 
-llvm::Value *
-UnaryExprAST::codegen()
+/// EmitZero - The value of a var without an initializer.
+internal llvm::Value *
+EmitZero()
 {
-    llvm::Value *OperandV = Operand->codegen();
-    if (!OperandV)
+    // If no initial value specifier, initialize to zero
+    return llvm::ConstantFP::get(*TheContext, llvm::APFloat(0.0));
+}
+
+// NOTE(srp): Pure functions. 'def pure f(x)' promises f has no side effects
+// and always returns, so its calls can be CSE'd, hoisted out of loops and
+// dropped when unused. That's only true if the body keeps the promise, so it
+// may not store into arrays, make or free them or call anything that isn't
+// pure itself. A pure function that takes arrays reads them, but an index out
+// of bounds exits, so LLVM is only told it doesn't unwind: it mustn't drop or
+// hoist the call past anything the exit would have stopped. A memo function
+// keeps the same rules for its body, but it writes its cache, a global, so
+// LLVM is only told it returns. Pure functions can't call it, other memo
+// functions can. See the note on memo functions further down.
+
+/// InPureFunction - Whether the body being generated is a pure or memo
+/// function's, InMemoFunction whether it's a memo function's.
+global_variable thread_local bool32 InPureFunction;
+global_variable thread_local bool32 InMemoFunction;
+
+/// PureAttribute, MemoAttribute - Mark pure and memo functions (and externs),
+/// LLVM's own attributes don't say it for those that take arrays or memo.
+global_variable const char *PureAttribute = "kaleidoscope-pure";
+global_variable const char *MemoAttribute = "kaleidoscope-memo";
+
+/// IsPureCallee - Pure functions and externs declared pure.
+internal bool32
+IsPureCallee(llvm::Function *F)
+{
+    return F->hasFnAttribute(PureAttribute);
+}
+
+/// CheckPureCall - Logs an error and returns false if the body being
+/// generated is pure and can't call F.
+internal bool32
+CheckPureCall(llvm::Function *F)
+{
+    if (!InPureFunction || IsPureCallee(F))
     {
-        return nullptr;
+        return true;
     }
-
-    std::string unaryFuncName = std::string("{unary");
-    unaryFuncName += Opcode;
-    unaryFuncName += '}';
-    llvm::Function *F = getFunction(unaryFuncName);
-    if (!F)
+    if (InMemoFunction && F->hasFnAttribute(MemoAttribute))
     {
-        return LogErrorV("Unknown unary operator");
+        return true;
     }
 
-    KSDbgInfo.emitLocation(this);
-    return Builder->CreateCall(F, OperandV, "unop");
+    LogErrorV(InMemoFunction ? "A memo function can only call pure and memo functions"
+                             : "A pure function can only call pure functions");
+    return false;
 }
 
-llvm::Value*
-BinaryExprAST::codegen()
+/// SetQualifierAttributes - What the qualifiers promise LLVM.
+internal void
+SetQualifierAttributes(const PrototypeAST &P, llvm::Function *F)
 {
-    KSDbgInfo.emitLocation(this);
+    local_persist const llvm::Attribute::AttrKind Promises[] = {
+        llvm::Attribute::ReadNone, llvm::Attribute::ReadOnly, llvm::Attribute::ArgMemOnly,
+        llvm::Attribute::NoUnwind, llvm::Attribute::WillReturn,
+    };
+    for (llvm::Attribute::AttrKind Kind : Promises)
+    {
+        F->removeFnAttr(Kind);
+    }
+    F->removeFnAttr(PureAttribute);
+    F->removeFnAttr(MemoAttribute);
 
-    // Special case '=' because we don't want to emit the LHS as an expression
-    if (Op == '=')
+    if (!P.isPure())
     {
-        // Assignment requires the LHS to be an identifier
-        // This assumes we're building without RTTI because LLVM builds that way by
-        // default. If you build LLVM with RTTI this can be changed to a
-        // dynamic_cast for automatic error checking.
-        VariableExprAST *LHSE = static_cast<VariableExprAST*>(LHS.get());
-        if (!LHSE)
-        {
-            return LogErrorV("destination of '=' must be a variable");
-        }
+        return;
+    }
 
-        // Codegen the RHS
-        llvm::Value *Val = RHS->codegen();
-        if (!Val)
-        {
-            return nullptr;
-        }
+    F->addFnAttr(llvm::Attribute::NoUnwind);
+    F->addFnAttr(P.isMemo() ? MemoAttribute : PureAttribute);
 
-        // Look up the name
-        llvm::Value *Variable = NamedValues[LHSE->getName()];
-        if (!Variable)
+    // Indexing may exit instead of returning.
+    for (uint32 Arg = 0; Arg < P.getNumArgs(); ++Arg)
+    {
+        if (P.getArgType(Arg) == Type_Array)
         {
-            return LogErrorV("Unknown variable name");
+            return;
         }
+    }
 
-        Builder->CreateStore(Val, Variable);
-        return Val;
+    F->addFnAttr(llvm::Attribute::WillReturn);
+    if (!P.isMemo())
+    {
+        F->addFnAttr(llvm::Attribute::ReadNone);
     }
+}
 
-    llvm::Value *L = LHS->codegen();
-    llvm::Value *R = RHS->codegen();
-    if (!L || !R)
+internal llvm::Value *
+EmitUnary(SourceLocation Loc, char Opcode, ExprEmitter Operand)
+{
+    llvm::Value *OperandV = Operand();
+    if (!OperandV)
     {
         return nullptr;
     }
 
-    switch (Op)
+    if ((Opcode == '!' || Opcode == '-') && IsArrayValue(OperandV))
     {
-        case '+':
-            return Builder->CreateFAdd(L, R, "addtmp");
+        return LogErrorV("Arrays have no operators, index them with []");
+    }
+
+    switch (Opcode)
+    {
+        case '!':
+            // Same truth test as 'if': only a value unequal to 0.0 is true.
+            KSDbgInfo.emitLocation(Loc);
+            if (IsIntValue(OperandV))
+            {
+                OperandV = Builder->CreateICmpEQ(OperandV, llvm::ConstantInt::get(OperandV->getType(), 0), "nottmp");
+            }
+            else
+            {
+                OperandV = Builder->CreateFCmpUEQ(OperandV, llvm::ConstantFP::get(OperandV->getType(), 0.0), "nottmp");
+            }
+            return EmitBool(OperandV);
         case '-':
-            return Builder->CreateFSub(L, R, "subtmp");
-        case '*':
-            return Builder->CreateFMul(L, R, "multmp");
-        case '<':
-            L = Builder->CreateFCmpULT(L, R, "cmptmp");
-            // Convert bool 0/1 to double 0.0 or 1.0
-            return Builder->CreateUIToFP(L, llvm::Type::getDoubleTy(*TheContext), "booltmp");
+            KSDbgInfo.emitLocation(Loc);
+            if (IsIntValue(OperandV))
+            {
+                return Builder->CreateNeg(OperandV, "negtmp");
+            }
+            return Builder->CreateFNeg(OperandV, "negtmp");
         default:
             break;
     }
 
-    // If it wasn't a builtin binary operator, it must be a user defined one. Emit
-    // a call to it.
-    llvm::Function *F = getFunction((std::string("{binary") + Op) + "}");
-    assert(F && "binary operator not found!");
+    // If it wasn't a builtin unary operator, it must be a user defined one.
+    llvm::Function *F = getOperatorFunction(false, Opcode);
+    if (!F)
+    {
+        return LogErrorV("Unknown unary operator");
+    }
+    if (!CheckPureCall(F))
+    {
+        return nullptr;
+    }
 
-    llvm::Value *Ops[] = {L, R};
-    return Builder->CreateCall(F, Ops, "binop");
+    KSDbgInfo.emitLocation(Loc);
+    OperandV = ConvertValue(OperandV, F->getArg(0)->getType());
+    if (!OperandV)
+    {
+        return nullptr;
+    }
+    return Builder->CreateCall(F, OperandV, "unop");
 }
 
-llvm::Value *
-CallExprAST::codegen()
+/// EmitAssign - '=' is special because we don't want to emit the LHS as an
+/// expression. Name is NoSymbol when the LHS isn't a variable.
+internal llvm::Value *
+EmitAssign(SourceLocation Loc, Symbol Name, ExprEmitter RHS)
 {
-    KSDbgInfo.emitLocation(this);
+    KSDbgInfo.emitLocation(Loc);
 
-    // Look up the name in the global module table.
-    llvm::Function *CalleeF = getFunction(Callee);
-    if (!CalleeF)
+    // Assignment requires the LHS to be an identifier, see EmitIndexAssign for
+    // array elements
+    if (Name == NoSymbol)
     {
-        return LogErrorV("Unknown function referenced");
+        return LogErrorV("destination of '=' must be a variable or an array element");
     }
 
-    // If argument mismatch error.
-    if (CalleeF->arg_size() != Args.size())
+    // Codegen the RHS
+    llvm::Value *Val = RHS();
+    if (!Val)
     {
-        return LogErrorV("Incorrect # arguments passed");
+        return nullptr;
+    }
+
+    // Look up the name
+    llvm::AllocaInst **Variable = NamedValues.find(Name);
+    if (!Variable)
+    {
+        return LogErrorV("Unknown variable name");
     }
 
-    std::vector<llvm::Value*> ArgsV;
-    for (unsigned i = 0, e = Args.size(); i != e; ++i)
+    return EmitStore(Val, *Variable);
+}
+
+// NOTE(srp): Arrays. The runtime side is in platform/externs, the generated
+// code calls it to make and free them and when an index is out of bounds.
+// Everything else, the length included, is done inline.
+
+/// GetArrayRuntime - Declare one of the runtime's array functions in TheModule.
+internal llvm::FunctionCallee
+GetArrayRuntime(const char *Name, llvm::Type *Result, llvm::ArrayRef<llvm::Type*> Params)
+{
+    return TheModule->getOrInsertFunction(Name, llvm::FunctionType::get(Result, Params, false));
+}
+
+/// EmitArrayLength - The length, stored right before the first element. It
+/// never changes, so the load is marked invariant and LLVM is free to hoist it.
+internal llvm::Value *
+EmitArrayLength(llvm::Value *Array)
+{
+    llvm::Type *IntTy = llvm::Type::getInt64Ty(*TheContext);
+    llvm::Value *Header = Builder->CreateBitCast(Array, IntTy->getPointerTo(), "header");
+    Header = Builder->CreateConstInBoundsGEP1_64(IntTy, Header, (uint64)-1, "lenptr");
+
+    llvm::LoadInst *Length = Builder->CreateLoad(IntTy, Header, "len");
+    Length->setMetadata(llvm::LLVMContext::MD_invariant_load, llvm::MDNode::get(*TheContext, {}));
+    return Length;
+}
+
+/// MaxCheckOffset - How far from a for variable an index may be and still have
+/// its bounds check versioned, see VersionBoundsChecks. Keeps the arithmetic on
+/// the bounds from overflowing.
+inline_variable int64 MaxCheckOffset = 1 << 20;
+
+/// BoundsCheck - A check on an index that counts with a variable, Counter +
+/// Offset. EmitFor may be able to drop it, see VersionBoundsChecks.
+struct BoundsCheck
+{
+    llvm::BranchInst *Branch; // To the error when the index is out of bounds
+    llvm::AllocaInst *Array;
+    llvm::AllocaInst *Counter;
+    int64 Offset;
+};
+
+/// TheBoundsChecks - The checks in the current function, in the order they
+/// were emitted.
+global_variable thread_local std::vector<BoundsCheck> TheBoundsChecks;
+
+/// MatchCounterIndex - Whether Index is an int variable plus a constant.
+internal bool32
+MatchCounterIndex(llvm::Value *Index, llvm::AllocaInst **Counter, int64 *Offset)
+{
+    *Offset = 0;
+    if (llvm::BinaryOperator *Op = llvm::dyn_cast<llvm::BinaryOperator>(Index))
     {
-        ArgsV.push_back(Args[i]->codegen());
-        if (!ArgsV.back())
+        llvm::Value *Var = Op->getOperand(0);
+        llvm::ConstantInt *C = llvm::dyn_cast<llvm::ConstantInt>(Op->getOperand(1));
+        if (!C && Op->getOpcode() == llvm::Instruction::Add)
         {
-            return nullptr;
+            Var = Op->getOperand(1);
+            C = llvm::dyn_cast<llvm::ConstantInt>(Op->getOperand(0));
+        }
+        if (!C || (Op->getOpcode() != llvm::Instruction::Add && Op->getOpcode() != llvm::Instruction::Sub) ||
+            C->getSExtValue() < -MaxCheckOffset || C->getSExtValue() > MaxCheckOffset)
+        {
+            return false;
         }
+
+        *Offset = (Op->getOpcode() == llvm::Instruction::Add) ? C->getSExtValue() : -C->getSExtValue();
+        Index = Var;
     }
 
-    return Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+    llvm::LoadInst *Load = llvm::dyn_cast<llvm::LoadInst>(Index);
+    *Counter = Load ? llvm::dyn_cast<llvm::AllocaInst>(Load->getPointerOperand()) : nullptr;
+    return *Counter != nullptr;
 }
 
-llvm::Value *
-IfExprAST::codegen()
+/// EmitElementAddress - Where Index is in the array variable Name, after
+/// checking it's in bounds. Doubles are rounded toward zero to get the index.
+internal llvm::Value *
+EmitElementAddress(Symbol Name, llvm::Value *Index)
 {
-    KSDbgInfo.emitLocation(this);
+    llvm::AllocaInst **A = NamedValues.find(Name);
+    if (!A)
+    {
+        return LogErrorV("Unknown variable name");
+    }
+    if (!(*A)->getAllocatedType()->isPointerTy())
+    {
+        return LogErrorV("Only arrays can be indexed");
+    }
 
-    llvm::Value *CondV = Cond->codegen();
-    if (!CondV)
+    Index = ConvertValue(Index, llvm::Type::getInt64Ty(*TheContext));
+    if (!Index)
     {
         return nullptr;
     }
 
-    // Convert condition to a bool by comparing non-equal to 0.0
-    CondV = Builder->CreateFCmpONE(CondV, llvm::ConstantFP::get(*TheContext, llvm::APFloat(0.0)), "ifcond");
+    llvm::Value *Array = Builder->CreateLoad((*A)->getAllocatedType(), *A, SymbolName(Name));
+    llvm::Value *Length = EmitArrayLength(Array);
 
+    // Unsigned, a negative index is out of bounds too.
     llvm::Function *TheFunction = Builder->GetInsertBlock()->getParent();
+    llvm::BasicBlock *FailBB = llvm::BasicBlock::Create(*TheContext, "outofbounds", TheFunction);
+    llvm::BasicBlock *InBoundsBB = llvm::BasicBlock::Create(*TheContext, "inbounds", TheFunction);
+    llvm::BranchInst *Check = Builder->CreateCondBr(
+            Builder->CreateICmpULT(Index, Length, "boundscheck"), InBoundsBB, FailBB,
+            llvm::MDBuilder(*TheContext).createBranchWeights(2000, 1)
+        );
 
-    // Create blocks for the then and else cases. Insert the 'then' block at the
-    // end of the function.
-    llvm::BasicBlock *ThenBB = llvm::BasicBlock::Create(*TheContext, "then", TheFunction);
-    llvm::BasicBlock *ElseBB = llvm::BasicBlock::Create(*TheContext, "else");
-    llvm::BasicBlock *MergeBB = llvm::BasicBlock::Create(*TheContext, "ifcont");
+    Builder->SetInsertPoint(FailBB);
+    llvm::Type *IntTy = Index->getType();
+    llvm::FunctionCallee Error = GetArrayRuntime("ks_array_index_error", Builder->getVoidTy(), {IntTy, IntTy});
+    llvm::CallInst *Call = Builder->CreateCall(Error, {Index, Length});
+    Call->setDoesNotReturn();
+    Builder->CreateUnreachable();
 
-    Builder->CreateCondBr(CondV, ThenBB, ElseBB);
+    Builder->SetInsertPoint(InBoundsBB);
 
-    // Emit then value
-    Builder->SetInsertPoint(ThenBB);
+    llvm::AllocaInst *Counter;
+    int64 Offset;
+    if (MatchCounterIndex(Index, &Counter, &Offset))
+    {
+        TheBoundsChecks.push_back({Check, *A, Counter, Offset});
+    }
 
-    llvm::Value *ThenV = Then->codegen();
-    if (!ThenV)
+    return Builder->CreateInBoundsGEP(Builder->getDoubleTy(), Array, Index, "eltptr");
+}
+
+/// EmitIndex - Read an array element.
+internal llvm::Value *
+EmitIndex(SourceLocation Loc, Symbol Name, ExprEmitter Index)
+{
+    llvm::Value *IndexV = Index();
+    if (!IndexV)
     {
         return nullptr;
     }
 
-    Builder->CreateBr(MergeBB);
-    // Codegen of 'Then' can change the current block, update ThenBB for the PHI
-    ThenBB = Builder->GetInsertBlock();
+    KSDbgInfo.emitLocation(Loc);
+    llvm::Value *Element = EmitElementAddress(Name, IndexV);
+    if (!Element)
+    {
+        return nullptr;
+    }
+    return Builder->CreateLoad(Builder->getDoubleTy(), Element, "elt");
+}
 
-    // Emit else block
-    llvm_Function_insert(TheFunction, TheFunction->end(), ElseBB);
-    Builder->SetInsertPoint(ElseBB);
+/// EmitIndexAssign - 'a[i] = x'. The index is emitted before the value, the
+/// bounds are checked once both are known.
+internal llvm::Value *
+EmitIndexAssign(SourceLocation Loc, Symbol Name, ExprEmitter Index, ExprEmitter RHS)
+{
+    llvm::Value *IndexV = Index();
+    if (!IndexV)
+    {
+        return nullptr;
+    }
 
-    llvm::Value *ElseV = Else->codegen();
-    if (!ElseV)
+    llvm::Value *Val = RHS();
+    if (!Val)
     {
         return nullptr;
     }
+    Val = ConvertValue(Val, Builder->getDoubleTy());
+    if (!Val)
+    {
+        return nullptr;
+    }
+
+    if (InPureFunction)
+    {
+        return LogErrorV("A pure function can't store into an array");
+    }
+
+    KSDbgInfo.emitLocation(Loc);
+    llvm::Value *Element = EmitElementAddress(Name, IndexV);
+    if (!Element)
+    {
+        return nullptr;
+    }
+    Builder->CreateStore(Val, Element);
+    return Val;
+}
+
+/// EmitShortCircuit - '&&' and '||' only evaluate RHS when LHS doesn't decide
+/// the result. Both give 1.0 or 0.0.
+internal llvm::Value *
+EmitShortCircuit(SourceLocation Loc, char Op, ExprEmitter LHS, ExprEmitter RHS)
+{
+    KSDbgInfo.emitLocation(Loc);
+
+    llvm::Value *L = LHS();
+    if (!L)
+    {
+        return nullptr;
+    }
+    L = EmitCondition(L, "lhscond");
+    if (!L)
+    {
+        return nullptr;
+    }
+
+    llvm::Function *TheFunction = Builder->GetInsertBlock()->getParent();
+    llvm::BasicBlock *LHSBB = Builder->GetInsertBlock();
+    llvm::BasicBlock *RHSBB = llvm::BasicBlock::Create(*TheContext, "rhs", TheFunction);
+    llvm::BasicBlock *MergeBB = llvm::BasicBlock::Create(*TheContext, "logicalcont");
+
+    // A false LHS decides '&&', a true one decides '||'.
+    bool32 IsAnd = (Op == tok_and);
+    Builder->CreateCondBr(L, IsAnd ? RHSBB : MergeBB, IsAnd ? MergeBB : RHSBB);
+
+    Builder->SetInsertPoint(RHSBB);
+    llvm::Value *R = RHS();
+    if (!R)
+    {
+        return nullptr;
+    }
+    R = EmitCondition(R, "rhscond");
+    if (!R)
+    {
+        return nullptr;
+    }
+
+    Builder->CreateBr(MergeBB);
+    // Codegen of RHS can change the current block, update RHSBB for the PHI
+    RHSBB = Builder->GetInsertBlock();
+
+    llvm_Function_insert(TheFunction, TheFunction->end(), MergeBB);
+    Builder->SetInsertPoint(MergeBB);
+    llvm::PHINode *PN = Builder->CreatePHI(llvm::Type::getInt1Ty(*TheContext), 2, "logicaltmp");
+    PN->addIncoming(IsAnd ? Builder->getFalse() : Builder->getTrue(), LHSBB);
+    PN->addIncoming(R, RHSBB);
+
+    return EmitBool(PN);
+}
+
+/// IsBuiltinBinary - Whether EmitBinary generates Op itself, instead of calling
+/// a user defined operator. '=', '&&' and '||' are handled before that.
+internal bool32
+IsBuiltinBinary(char Op)
+{
+    switch (Op)
+    {
+        case '+':
+        case '-':
+        case '*':
+        case '/':
+        case '<':
+        case '>':
+        case tok_less_equal:
+        case tok_greater_equal:
+        case tok_equal:
+        case tok_not_equal:
+            return true;
+    }
+    return false;
+}
+
+internal llvm::Value *
+EmitBinary(SourceLocation Loc, char Op, ExprEmitter LHS, ExprEmitter RHS)
+{
+    if (Op == tok_and || Op == tok_or)
+    {
+        return EmitShortCircuit(Loc, Op, LHS, RHS);
+    }
+
+    KSDbgInfo.emitLocation(Loc);
+
+    llvm::Value *L = LHS();
+    llvm::Value *R = RHS();
+    if (!L || !R)
+    {
+        return nullptr;
+    }
+
+    if (!IsBuiltinBinary(Op))
+    {
+        // If it wasn't a builtin binary operator, it must be a user defined
+        // one. Emit a call to it.
+        llvm::Function *F = getOperatorFunction(true, Op);
+        assert(F && "binary operator not found!");
+        if (!CheckPureCall(F))
+        {
+            return nullptr;
+        }
+
+        llvm::Value *Ops[] = {ConvertValue(L, F->getArg(0)->getType()), ConvertValue(R, F->getArg(1)->getType())};
+        if (!Ops[0] || !Ops[1])
+        {
+            return nullptr;
+        }
+        return Builder->CreateCall(F, Ops, "binop");
+    }
+
+    llvm::Type *Type = UnifyOperands(&L, &R);
+    if (!Type)
+    {
+        return nullptr;
+    }
+
+    // '/' is always a double one, 1/2 is 0.5.
+    if (Op == '/')
+    {
+        llvm::Type *DoubleTy = llvm::Type::getDoubleTy(*TheContext);
+        if (Type->isIntegerTy())
+        {
+            L = ConvertValue(L, DoubleTy);
+            R = ConvertValue(R, DoubleTy);
+        }
+        return Builder->CreateFDiv(L, R, "divtmp");
+    }
+
+    if (Type->isIntegerTy())
+    {
+        // Ints wrap around, there's no nsw. The comparisons are signed.
+        switch (Op)
+        {
+            case '+':
+                return Builder->CreateAdd(L, R, "addtmp");
+            case '-':
+                return Builder->CreateSub(L, R, "subtmp");
+            case '*':
+                return Builder->CreateMul(L, R, "multmp");
+            case '<':
+                return EmitBool(Builder->CreateICmpSLT(L, R, "cmptmp"));
+            case '>':
+                return EmitBool(Builder->CreateICmpSGT(L, R, "cmptmp"));
+            case tok_less_equal:
+                return EmitBool(Builder->CreateICmpSLE(L, R, "cmptmp"));
+            case tok_greater_equal:
+                return EmitBool(Builder->CreateICmpSGE(L, R, "cmptmp"));
+            case tok_equal:
+                return EmitBool(Builder->CreateICmpEQ(L, R, "cmptmp"));
+            case tok_not_equal:
+                return EmitBool(Builder->CreateICmpNE(L, R, "cmptmp"));
+        }
+    }
+
+    switch (Op)
+    {
+        case '+':
+            return Builder->CreateFAdd(L, R, "addtmp");
+        case '-':
+            return Builder->CreateFSub(L, R, "subtmp");
+        case '*':
+            return Builder->CreateFMul(L, R, "multmp");
+        // The comparisons that used to be user defined ('>' as 'R < L') are
+        // true when unordered, like '<'. '==' is ordered, NaN equals nothing.
+        case '<':
+            L = Builder->CreateFCmpULT(L, R, "cmptmp");
+            break;
+        case '>':
+            L = Builder->CreateFCmpUGT(L, R, "cmptmp");
+            break;
+        case tok_less_equal:
+            L = Builder->CreateFCmpULE(L, R, "cmptmp");
+            break;
+        case tok_greater_equal:
+            L = Builder->CreateFCmpUGE(L, R, "cmptmp");
+            break;
+        case tok_equal:
+            L = Builder->CreateFCmpOEQ(L, R, "cmptmp");
+            break;
+        case tok_not_equal:
+            L = Builder->CreateFCmpUNE(L, R, "cmptmp");
+            break;
+    }
+
+    return EmitBool(L);
+}
+
+/// Builtin - Functions generated inline, for working with vectors and arrays.
+/// A user defined function of the same name wins.
+enum Builtin
+{
+    Builtin_None,
+    Builtin_Vec4,   // vec4(x) puts x in every lane, vec4(a, b, c, d) one per lane
+    Builtin_Vec8,
+    Builtin_Lane,   // lane(v, i), i is taken modulo the width
+    Builtin_Select, // select(mask, a, b), a where the mask is true, lane by lane
+    Builtin_HSum,   // hsum(v), the lanes added in order
+    Builtin_HMin,   // hmin(v)/hmax(v), NaN lanes are skipped
+    Builtin_HMax,
+    Builtin_Array,  // array(n), n zeroed doubles
+    Builtin_Len,    // len(a), an int
+    Builtin_Free,   // free(a), a can't be used after
+
+    Builtin_Count,
+};
+
+internal Builtin
+LookupBuiltin(Symbol Name)
+{
+    local_persist Symbol Names[Builtin_Count] = {
+        NoSymbol,
+        Intern(llvm::StringRef("vec4")),
+        Intern(llvm::StringRef("vec8")),
+        Intern(llvm::StringRef("lane")),
+        Intern(llvm::StringRef("select")),
+        Intern(llvm::StringRef("hsum")),
+        Intern(llvm::StringRef("hmin")),
+        Intern(llvm::StringRef("hmax")),
+        Intern(llvm::StringRef("array")),
+        Intern(llvm::StringRef("len")),
+        Intern(llvm::StringRef("free")),
+    };
+
+    for (uint32 Which = Builtin_None + 1; Which < Builtin_Count; ++Which)
+    {
+        if (Names[Which] == Name)
+        {
+            return (Builtin)Which;
+        }
+    }
+    return Builtin_None;
+}
+
+/// EmitBuiltinCall - The arguments are emitted left to right, like a call's.
+internal llvm::Value *
+EmitBuiltinCall(Builtin Which, uint32 NumArgs, llvm::function_ref<llvm::Value*(uint32)> EmitArg)
+{
+    local_persist const uint32 Arity[Builtin_Count] = {0, 0, 0, 2, 3, 1, 1, 1, 1, 1, 1};
+    if (Arity[Which] && NumArgs != Arity[Which])
+    {
+        return LogErrorV("Incorrect # arguments passed");
+    }
+    if (InPureFunction && (Which == Builtin_Array || Which == Builtin_Free))
+    {
+        return LogErrorV("A pure function can't make or free arrays");
+    }
+
+    llvm::SmallVector<llvm::Value*, 8> Args;
+    for (uint32 i = 0; i != NumArgs; ++i)
+    {
+        Args.push_back(EmitArg(i));
+        if (!Args.back())
+        {
+            return nullptr;
+        }
+    }
+
+    llvm::Type *DoubleTy = llvm::Type::getDoubleTy(*TheContext);
+    switch (Which)
+    {
+        case Builtin_Vec4:
+        case Builtin_Vec8:
+        {
+            llvm::Type *VecTy = GetLLVMType((Which == Builtin_Vec4) ? Type_Vec4 : Type_Vec8);
+            uint32 Lanes = llvm::cast<llvm::FixedVectorType>(VecTy)->getNumElements();
+            if (NumArgs == 1)
+            {
+                return ConvertValue(Args[0], VecTy);
+            }
+            if (NumArgs != Lanes)
+            {
+                return LogErrorV("A vector takes one value or one per lane");
+            }
+
+            llvm::Value *Vec = llvm::PoisonValue::get(VecTy);
+            for (uint32 i = 0; i != Lanes; ++i)
+            {
+                llvm::Value *Elt = ConvertValue(Args[i], DoubleTy);
+                if (!Elt)
+                {
+                    return nullptr;
+                }
+                Vec = Builder->CreateInsertElement(Vec, Elt, (uint64)i, "vec");
+            }
+            return Vec;
+        }
+        case Builtin_Select:
+        {
+            llvm::Value *Mask = Args[0];
+            llvm::Type *Type = UnifiedType(Args[1]->getType(), Args[2]->getType());
+            if (Type && IsVectorValue(Mask))
+            {
+                Type = UnifiedType(Type, Mask->getType());
+            }
+            if (!Type)
+            {
+                return LogErrorV("Vectors of different widths can't be mixed");
+            }
+
+            llvm::Value *A = ConvertValue(Args[1], Type);
+            llvm::Value *B = ConvertValue(Args[2], Type);
+            if (!A || !B)
+            {
+                return nullptr;
+            }
+            llvm::Value *Cond = EmitTruthTest(Mask, "selectcond");
+            if (!Cond)
+            {
+                return nullptr;
+            }
+            return Builder->CreateSelect(Cond, A, B, "select");
+        }
+        case Builtin_Array:
+        {
+            llvm::Value *Length = ConvertValue(Args[0], llvm::Type::getInt64Ty(*TheContext));
+            if (!Length)
+            {
+                return nullptr;
+            }
+
+            llvm::Type *ArrayTy = GetLLVMType(Type_Array);
+            return Builder->CreateCall(GetArrayRuntime("ks_array_new", ArrayTy, {Length->getType()}), Length, "array");
+        }
+        case Builtin_Len:
+        case Builtin_Free:
+        {
+            if (!IsArrayValue(Args[0]))
+            {
+                return LogErrorV("len() and free() take an array");
+            }
+            if (Which == Builtin_Len)
+            {
+                return EmitArrayLength(Args[0]);
+            }
+            return Builder->CreateCall(GetArrayRuntime("ks_array_free", DoubleTy, {Args[0]->getType()}), Args[0], "free");
+        }
+        default:
+            break;
+    }
+
+    // The rest take a vector apart.
+    llvm::FixedVectorType *VecTy = llvm::dyn_cast<llvm::FixedVectorType>(Args[0]->getType());
+    if (!VecTy)
+    {
+        return LogErrorV("lane(), hsum(), hmin() and hmax() take a vector");
+    }
+
+    switch (Which)
+    {
+        case Builtin_Lane:
+        {
+            llvm::Value *Index = ConvertValue(Args[1], llvm::Type::getInt64Ty(*TheContext));
+            if (!Index)
+            {
+                return nullptr;
+            }
+
+            // The widths are powers of two, out of range wraps around instead
+            // of reading garbage.
+            Index = Builder->CreateAnd(Index, VecTy->getNumElements() - 1, "laneidx");
+            return Builder->CreateExtractElement(Args[0], Index, "lane");
+        }
+        case Builtin_HSum:
+            // -0.0 is the identity, starting from 0.0 would turn a -0.0 sum
+            // into +0.0.
+            return Builder->CreateFAddReduce(llvm::ConstantFP::getNegativeZero(DoubleTy), Args[0]);
+        case Builtin_HMin:
+            return Builder->CreateFPMinReduce(Args[0]);
+        case Builtin_HMax:
+            return Builder->CreateFPMaxReduce(Args[0]);
+        default:
+            return nullptr;
+    }
+}
+
+internal llvm::Value *
+EmitCall(SourceLocation Loc, Symbol Callee, uint32 NumArgs,
+         llvm::function_ref<llvm::Value*(uint32)> EmitArg)
+{
+    KSDbgInfo.emitLocation(Loc);
+
+    // Look up the name in the global module table.
+    llvm::Function *CalleeF = getFunction(Callee);
+    if (!CalleeF)
+    {
+        Builtin Which = LookupBuiltin(Callee);
+        if (Which != Builtin_None)
+        {
+            return EmitBuiltinCall(Which, NumArgs, EmitArg);
+        }
+        return LogErrorV("Unknown function referenced");
+    }
+
+    // If argument mismatch error.
+    if (CalleeF->arg_size() != NumArgs)
+    {
+        return LogErrorV("Incorrect # arguments passed");
+    }
+    if (!CheckPureCall(CalleeF))
+    {
+        return nullptr;
+    }
+
+    llvm::SmallVector<llvm::Value*, 8> ArgsV;
+    for (uint32 i = 0; i != NumArgs; ++i)
+    {
+        llvm::Value *Arg = EmitArg(i);
+        if (!Arg)
+        {
+            return nullptr;
+        }
+        Arg = ConvertValue(Arg, CalleeF->getArg(i)->getType());
+        if (!Arg)
+        {
+            return nullptr;
+        }
+        ArgsV.push_back(Arg);
+    }
+
+    return Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+}
+
+internal llvm::Value *
+EmitIf(SourceLocation Loc, ExprEmitter Cond, ExprEmitter Then, ExprEmitter Else)
+{
+    KSDbgInfo.emitLocation(Loc);
+
+    llvm::Value *CondV = Cond();
+    if (!CondV)
+    {
+        return nullptr;
+    }
+
+    // Convert condition to a bool by comparing non-equal to 0.0
+    CondV = EmitCondition(CondV, "ifcond");
+    if (!CondV)
+    {
+        return nullptr;
+    }
+
+    llvm::Function *TheFunction = Builder->GetInsertBlock()->getParent();
+
+    // Create blocks for the then and else cases. Insert the 'then' block at the
+    // end of the function.
+    llvm::BasicBlock *ThenBB = llvm::BasicBlock::Create(*TheContext, "then", TheFunction);
+    llvm::BasicBlock *ElseBB = llvm::BasicBlock::Create(*TheContext, "else");
+    llvm::BasicBlock *MergeBB = llvm::BasicBlock::Create(*TheContext, "ifcont");
+
+    Builder->CreateCondBr(CondV, ThenBB, ElseBB);
+
+    // Emit then value
+    Builder->SetInsertPoint(ThenBB);
+
+    llvm::Value *ThenV = Then();
+    if (!ThenV)
+    {
+        return nullptr;
+    }
+
+    Builder->CreateBr(MergeBB);
+    // Codegen of 'Then' can change the current block, update ThenBB for the PHI
+    ThenBB = Builder->GetInsertBlock();
+
+    // Emit else block
+    llvm_Function_insert(TheFunction, TheFunction->end(), ElseBB);
+    Builder->SetInsertPoint(ElseBB);
+
+    llvm::Value *ElseV = Else();
+    if (!ElseV)
+    {
+        return nullptr;
+    }
+
+    // Both sides have to give the same type, like the operands of a binary
+    // operator. The 'then' side converts at the end of its block.
+    llvm::Type *Type = UnifiedType(ThenV->getType(), ElseV->getType());
+    if (!Type)
+    {
+        return LogErrorV("Vectors of different widths can't be mixed");
+    }
+    ElseV = ConvertValue(ElseV, Type);
+    if (ThenV->getType() != Type)
+    {
+        llvm::IRBuilderBase::InsertPointGuard Guard(*Builder);
+        Builder->SetInsertPoint(ThenBB->getTerminator());
+        ThenV = ConvertValue(ThenV, Type);
+    }
+
+    Builder->CreateBr(MergeBB);
+    // codegen of 'Else' can change the current block, update ElseBB for the PHI
+    ElseBB = Builder->GetInsertBlock();
+
+    // Emit merge block
+    llvm_Function_insert(TheFunction, TheFunction->end(), MergeBB);
+    Builder->SetInsertPoint(MergeBB);
+    llvm::PHINode *PN = Builder->CreatePHI(ThenV->getType(), 2, "iftmp");
+
+    PN->addIncoming(ThenV, ThenBB);
+    PN->addIncoming(ElseV, ElseBB);
+    return PN;
+}
+
+// NOTE(srp): Loops. EmitFor lowers a for loop to the shape LLVM's loop passes
+// look for: the end condition is tested once on the start value, before the
+// loop, and the loop proper only has the one back-edge, from the block that
+// tests it again after the body. An int variable compared with an int limit
+// makes an integer exit test, which LLVM can turn into a trip count, and that
+// is what the vectorizer and the unroller need. The back-edge carries the
+// loop's own llvm.loop node, which names the source line in the optimizer's
+// remarks (--vectorize) and is where the loop passes record what they did.
+
+/// MakeLoopID - A new llvm.loop node with the given properties. Every loop
+/// needs a distinct one, the first operand is the node itself.
+internal llvm::MDNode *
+MakeLoopID(llvm::ArrayRef<llvm::Metadata*> Properties)
+{
+    llvm::SmallVector<llvm::Metadata*, 4> Operands;
+    Operands.push_back(nullptr);
+    Operands.append(Properties.begin(), Properties.end());
+
+    llvm::MDNode *LoopID = llvm::MDNode::getDistinct(*TheContext, Operands);
+    LoopID->replaceOperandWith(0, LoopID);
+    return LoopID;
+}
+
+// NOTE(srp): Bounds check versioning. A for loop that counts up by a constant
+// and stops on 'i < limit' or 'i <= limit', with i and the limit left alone by
+// the body, visits a range of i that's known before it starts: from the start
+// value up to limit + step - 1, one more for '<=', since a start value that
+// already fails the test never enters the loop. Every check on
+// a[i + k], with a left alone too, passes if that whole range shifted by k is
+// inside a. So the loop is emitted twice, the copy without those checks runs
+// when one test before the loop says the range fits, the original when it
+// doesn't. A bad index still fails at the same element it always did.
+
+/// MaxVersionedLoopSize - Instructions in a loop past which it isn't copied.
+/// Nested loops are each versioned, so the outer ones grow fast.
+inline_variable uint32 MaxVersionedLoopSize = 2000;
+
+/// IsLoopInvariant - Whether V, computed in the blocks InLoop, is the same
+/// every time around. Only loads of variables nobody in the loop stores to,
+/// array lengths and arithmetic on those qualify.
+internal bool32
+IsLoopInvariant(llvm::Value *V, const llvm::SmallPtrSetImpl<llvm::BasicBlock*> &InLoop,
+                const llvm::SmallPtrSetImpl<llvm::Value*> &Stored)
+{
+    llvm::Instruction *I = llvm::dyn_cast<llvm::Instruction>(V);
+    if (!I || !InLoop.count(I->getParent()))
+    {
+        return true;
+    }
+
+    if (llvm::LoadInst *Load = llvm::dyn_cast<llvm::LoadInst>(I))
+    {
+        llvm::Value *Ptr = Load->getPointerOperand();
+        if (llvm::isa<llvm::AllocaInst>(Ptr))
+        {
+            return !Stored.count(Ptr);
+        }
+        return Load->hasMetadata(llvm::LLVMContext::MD_invariant_load) && IsLoopInvariant(Ptr, InLoop, Stored);
+    }
+
+    bool32 Pure = (llvm::isa<llvm::BinaryOperator>(I) && !I->isIntDivRem()) || llvm::isa<llvm::CastInst>(I) ||
+                  llvm::isa<llvm::GetElementPtrInst>(I) || llvm::isa<llvm::CmpInst>(I);
+    if (!Pure)
+    {
+        return false;
+    }
+    for (llvm::Value *Operand : I->operands())
+    {
+        if (!IsLoopInvariant(Operand, InLoop, Stored))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// HoistInvariant - Move V, which IsLoopInvariant, and whatever it's computed
+/// from out of the loop to right before Before.
+internal void
+HoistInvariant(llvm::Value *V, const llvm::SmallPtrSetImpl<llvm::BasicBlock*> &InLoop, llvm::Instruction *Before)
+{
+    llvm::Instruction *I = llvm::dyn_cast<llvm::Instruction>(V);
+    if (!I || !InLoop.count(I->getParent()))
+    {
+        return;
+    }
+
+    for (llvm::Value *Operand : I->operands())
+    {
+        HoistInvariant(Operand, InLoop, Before);
+    }
+    I->moveBefore(Before);
+}
+
+/// VersionBoundsChecks - Called by EmitFor once the loop is complete. Entry is
+/// the branch into the loop, only taken once the start value passed the end
+/// condition. EndCond is that condition as the back-edge tests it and Next
+/// the value the increment stores.
+internal void
+VersionBoundsChecks(llvm::BranchInst *Entry, llvm::BasicBlock *AfterBB, llvm::AllocaInst *Counter,
+                    llvm::Value *Start, llvm::Value *Step, llvm::Value *EndCond, llvm::Value *Next)
+{
+    llvm::ConstantInt *StepC = llvm::dyn_cast<llvm::ConstantInt>(Step);
+    if (!Counter->getAllocatedType()->isIntegerTy() || !StepC ||
+        StepC->getSExtValue() < 1 || StepC->getSExtValue() > MaxCheckOffset)
+    {
+        return;
+    }
+
+    // Codegen only ever appends blocks, the loop is everything from its header
+    // up to the block after it.
+    llvm::BasicBlock *LoopBB = Entry->getSuccessor(0);
+    llvm::Function *TheFunction = LoopBB->getParent();
+    llvm::SmallVector<llvm::BasicBlock*, 16> Blocks;
+    llvm::SmallPtrSet<llvm::BasicBlock*, 16> InLoop;
+    uint32 Size = 0;
+    for (auto BB = LoopBB->getIterator(); &*BB != AfterBB; ++BB)
+    {
+        Blocks.push_back(&*BB);
+        InLoop.insert(&*BB);
+        Size += (uint32)BB->size();
+    }
+    if (Size > MaxVersionedLoopSize)
+    {
+        return;
+    }
+
+    // Only this function can see its variables, calls don't change them. The
+    // counter may only be stored to by the increment.
+    llvm::SmallPtrSet<llvm::Value*, 8> Stored;
+    for (llvm::BasicBlock *BB : Blocks)
+    {
+        for (llvm::Instruction &I : *BB)
+        {
+            if (llvm::StoreInst *Store = llvm::dyn_cast<llvm::StoreInst>(&I))
+            {
+                if (Store->getPointerOperand() == Counter && Store->getValueOperand() != Next)
+                {
+                    return;
+                }
+                Stored.insert(Store->getPointerOperand());
+            }
+        }
+    }
+
+    // The end condition, as EmitBinary makes it.
+    llvm::ICmpInst *Cmp = llvm::dyn_cast<llvm::ICmpInst>(EndCond);
+    if (!Cmp || (Cmp->getPredicate() != llvm::ICmpInst::ICMP_SLT && Cmp->getPredicate() != llvm::ICmpInst::ICMP_SLE))
+    {
+        return;
+    }
+    llvm::LoadInst *CounterLoad = llvm::dyn_cast<llvm::LoadInst>(Cmp->getOperand(0));
+    llvm::Value *Limit = Cmp->getOperand(1);
+    if (!CounterLoad || CounterLoad->getPointerOperand() != Counter || !IsLoopInvariant(Limit, InLoop, Stored))
+    {
+        return;
+    }
+
+    llvm::SmallVector<BoundsCheck, 8> Checks;
+    for (const BoundsCheck &Check : TheBoundsChecks)
+    {
+        if (Check.Counter == Counter && InLoop.count(Check.Branch->getParent()) && !Stored.count(Check.Array))
+        {
+            Checks.push_back(Check);
+        }
+    }
+    if (Checks.empty())
+    {
+        return;
+    }
+
+    // The test, before the loop. Past the limit the counter goes at most
+    // Last - 1 further.
+    HoistInvariant(Limit, InLoop, Entry);
+    int64 Last = StepC->getSExtValue() + ((Cmp->getPredicate() == llvm::ICmpInst::ICMP_SLE) ? 1 : 0);
+
+    llvm::Value *Fits = Builder->getTrue();
+    {
+        llvm::IRBuilderBase::InsertPointGuard Guard(*Builder);
+        Builder->SetInsertPoint(Entry);
+
+        llvm::SmallDenseSet<std::pair<llvm::AllocaInst*, int64>, 8> Tested;
+        for (const BoundsCheck &Check : Checks)
+        {
+            if (!Tested.insert({Check.Array, Check.Offset}).second)
+            {
+                continue;
+            }
+
+            llvm::Value *Array = Builder->CreateLoad(Check.Array->getAllocatedType(), Check.Array, "array");
+            llvm::Value *Room = Builder->CreateSub(EmitArrayLength(Array), Builder->getInt64(Check.Offset), "room");
+            Fits = Builder->CreateAnd(Fits, Builder->CreateICmpSGE(Start, Builder->getInt64(-Check.Offset)), "fits");
+            Fits = Builder->CreateAnd(Fits, Builder->CreateICmpSLE(Limit, Builder->CreateSub(Room, Builder->getInt64(Last))), "fits");
+        }
+    }
+
+    // The copy, with the checks gone.
+    llvm::ValueToValueMapTy VMap;
+    llvm::SmallVector<llvm::BasicBlock*, 16> FastBlocks;
+    for (llvm::BasicBlock *BB : Blocks)
+    {
+        llvm::BasicBlock *Fast = llvm::CloneBasicBlock(BB, VMap, ".nocheck", TheFunction);
+        VMap[BB] = Fast;
+        FastBlocks.push_back(Fast);
+    }
+    llvm::remapInstructionsInBlocks(FastBlocks, VMap);
+
+    // The copies of this loop and the ones inside it are loops of their own.
+    for (llvm::BasicBlock *Fast : FastBlocks)
+    {
+        llvm::Instruction *Latch = Fast->getTerminator();
+        if (llvm::MDNode *LoopID = Latch->getMetadata(llvm::LLVMContext::MD_loop))
+        {
+            llvm::SmallVector<llvm::Metadata*, 4> Properties(LoopID->op_begin() + 1, LoopID->op_end());
+            Latch->setMetadata(llvm::LLVMContext::MD_loop, MakeLoopID(Properties));
+        }
+    }
+
+    for (const BoundsCheck &Check : Checks)
+    {
+        llvm::BranchInst *Fast = llvm::cast<llvm::BranchInst>(VMap[Check.Branch]);
+        llvm::BasicBlock *FailBB = Fast->getSuccessor(1);
+        llvm::Value *InBounds = Fast->getCondition();
+        llvm::BranchInst::Create(Fast->getSuccessor(0), Fast);
+        Fast->eraseFromParent();
+        // Every check has an error block of its own.
+        FailBB->eraseFromParent();
+        llvm::RecursivelyDeleteTriviallyDeadInstructions(InBounds);
+    }
 
-    Builder->CreateBr(MergeBB);
-    // codegen of 'Else' can change the current block, update ElseBB for the PHI
-    ElseBB = Builder->GetInsertBlock();
-
-    // Emit merge block
-    llvm_Function_insert(TheFunction, TheFunction->end(), MergeBB);
-    Builder->SetInsertPoint(MergeBB);
-    llvm::PHINode *PN = Builder->CreatePHI(llvm::Type::getDoubleTy(*TheContext), 2, "iftmp");
+    // Checks on the counters of loops around this one are in both copies now.
+    size_t Count = TheBoundsChecks.size();
+    for (size_t Index = 0; Index < Count; ++Index)
+    {
+        BoundsCheck Check = TheBoundsChecks[Index];
+        if (Check.Counter != Counter && InLoop.count(Check.Branch->getParent()))
+        {
+            Check.Branch = llvm::cast<llvm::BranchInst>(VMap[Check.Branch]);
+            TheBoundsChecks.push_back(Check);
+        }
+    }
 
-    PN->addIncoming(ThenV, ThenBB);
-    PN->addIncoming(ElseV, ElseBB);
-    return PN;
+    llvm::BranchInst *Choose = llvm::BranchInst::Create(llvm::cast<llvm::BasicBlock>(VMap[LoopBB]), LoopBB, Fits, Entry);
+    Choose->setDebugLoc(Entry->getDebugLoc());
+    Entry->eraseFromParent();
 }
 
-llvm::Value *
-ForExprAST::codegen()
+/// EmitFor - Step can be empty, the loop then counts by 1. The variable is an
+/// int when Start is one, unless a double step demotes it. End is emitted
+/// twice, once for the test before the loop and once for the back-edge.
+internal llvm::Value *
+EmitFor(SourceLocation Loc, Symbol VarName, ExprEmitter Start, ExprEmitter End,
+        ExprEmitter Step, ExprEmitter Body)
 {
     llvm::Function *TheFunction = Builder->GetInsertBlock()->getParent();
 
-    // Create an alloca for the variable in the entry block
-    llvm::AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
-
-    KSDbgInfo.emitLocation(this);
+    KSDbgInfo.emitLocation(Loc);
+    llvm::DebugLoc LoopLoc = Builder->getCurrentDebugLocation();
 
     // Emit the start code first, without 'variable' in scope
-    llvm::Value *StartVal = Start->codegen();
+    llvm::Value *StartVal = Start();
     if (!StartVal)
     {
         return nullptr;
     }
 
+    // Create an alloca for the variable in the entry block
+    llvm::AllocaInst *Alloca = CreateBindingAlloca(TheFunction, VarName, Type_Inferred, StartVal);
+
     // Store the value into the alloca
-    Builder->CreateStore(StartVal, Alloca);
+    StartVal = EmitStore(StartVal, Alloca);
+    if (!StartVal)
+    {
+        return nullptr;
+    }
+
+    // If it shadows an existing variable, we have to restore it, so save the
+    // shadowed value now.
+    llvm::AllocaInst *&Binding = NamedValues[VarName];
+    llvm::AllocaInst *OldVal = Binding;
+    Binding = Alloca;
+
+    // Test the start value, a loop that's over before it begins skips the body.
+    llvm::Value *EntryCond = End();
+    if (!EntryCond)
+    {
+        return nullptr;
+    }
+    EntryCond = EmitCondition(EntryCond, "entrycond");
+    if (!EntryCond)
+    {
+        return nullptr;
+    }
 
-    // Make the new basic block for the loop header, inserting after current
-    // block.
+    // The preheader is the loop's only way in, the loop header follows it.
+    // The "after loop" block goes in once the loop is done.
+    llvm::BasicBlock *PreheaderBB = llvm::BasicBlock::Create(*TheContext, "preloop", TheFunction);
     llvm::BasicBlock *LoopBB = llvm::BasicBlock::Create(*TheContext, "loop", TheFunction);
+    llvm::BasicBlock *AfterBB = llvm::BasicBlock::Create(*TheContext, "afterloop");
 
-    // Insert an explicit fall through from the current block to the LoopBB
-    Builder->CreateBr(LoopBB);
+    Builder->CreateCondBr(EntryCond, PreheaderBB, AfterBB);
+
+    Builder->SetInsertPoint(PreheaderBB);
+    llvm::BranchInst *Entry = Builder->CreateBr(LoopBB);
 
     // Start insertion in LoopBB
     Builder->SetInsertPoint(LoopBB);
 
-    // If it shadows an existing variable, we have to restore it, so save the
-    // shadowed value now.
-    llvm::AllocaInst *OldVal = NamedValues[VarName];
-    NamedValues[VarName] = Alloca;
-
     // Emit the body of the loop. This, like any other expr, can change the
     // current BB. Note that we ignore the value computed by the body, but don't
     // allow an error.
-    if (!Body->codegen())
+    if (!Body())
     {
         return nullptr;
     }
@@ -356,7 +1579,7 @@ ForExprAST::codegen()
     llvm::Value *StepVal = nullptr;
     if (Step)
     {
-        StepVal = Step->codegen();
+        StepVal = Step();
         if (!StepVal)
         {
             return nullptr;
@@ -364,31 +1587,60 @@ ForExprAST::codegen()
     }
     else
     {
-        // If not specified, use 1.0.
-        StepVal = llvm::ConstantFP::get(*TheContext, llvm::APFloat(1.0));
+        // If not specified, use 1.
+        StepVal = EmitNumber(Loc, {1.0, true});
     }
 
     // Compute the end condition.
-    llvm::Value *EndCond = End->codegen();
-    if (!EndCond)
+    llvm::Value *EndVal = End();
+    if (!EndVal)
     {
         return nullptr;
     }
 
     // Reload, increment, and restore the alloca. This handles the case where
     // the body of the loop mutates the variable
-    llvm::Value *CurVar = Builder->CreateLoad(Alloca->getAllocatedType(), Alloca, VarName.c_str());
-    llvm::Value *NextVar = Builder->CreateFAdd(CurVar, StepVal, "nextvar");
-    Builder->CreateStore(NextVar, Alloca);
+    llvm::Value *CurVar = Builder->CreateLoad(Alloca->getAllocatedType(), Alloca, SymbolName(VarName));
+    llvm::Type *Type = UnifyOperands(&CurVar, &StepVal);
+    if (!Type)
+    {
+        return nullptr;
+    }
+
+    llvm::Value *NextVar;
+    if (Type->isIntegerTy())
+    {
+        NextVar = Builder->CreateAdd(CurVar, StepVal, "nextvar");
+    }
+    else
+    {
+        NextVar = Builder->CreateFAdd(CurVar, StepVal, "nextvar");
+    }
+    NextVar = EmitStore(NextVar, Alloca);
+    if (!NextVar)
+    {
+        return nullptr;
+    }
 
     // Convert condition to a bool by comparing non-equal to 0.0
-    EndCond = Builder->CreateFCmpONE(EndCond, llvm::ConstantFP::get(*TheContext, llvm::APFloat(0.0)), "loopcond");
+    llvm::Value *EndCond = EmitCondition(EndVal, "loopcond");
+    if (!EndCond)
+    {
+        return nullptr;
+    }
 
-    // Create the "after loop" block and insert it
-    llvm::BasicBlock *AfterBB = llvm::BasicBlock::Create(*TheContext, "afterloop", TheFunction);
+    // Insert the conditional branch into the end of LoopEndBB, the back-edge
+    // names the loop.
+    llvm_Function_insert(TheFunction, TheFunction->end(), AfterBB);
+    llvm::BranchInst *Latch = Builder->CreateCondBr(EndCond, LoopBB, AfterBB);
+    llvm::SmallVector<llvm::Metadata*, 1> Properties;
+    if (LoopLoc)
+    {
+        Properties.push_back(LoopLoc.get());
+    }
+    Latch->setMetadata(llvm::LLVMContext::MD_loop, MakeLoopID(Properties));
 
-    // Insert the conditional branch into the end of LoopEndBB
-    Builder->CreateCondBr(EndCond, LoopBB, AfterBB);
+    VersionBoundsChecks(Entry, AfterBB, Alloca, StartVal, StepVal, EndCond, NextVar);
 
     // Any new code will be inserted in AfterBB
     Builder->SetInsertPoint(AfterBB);
@@ -405,60 +1657,433 @@ ForExprAST::codegen()
 
     // for expr always returns 0.0
     return llvm::Constant::getNullValue(llvm::Type::getDoubleTy(*TheContext));
-} // TODO(srp): ```for n=1, n<0, 1 in putchard(48+n);``` should print nothing, but it prints ```1```.
-  // loopcond should also be checked at entry BB
+}
+
+// NOTE(srp): Tree codegen
+
+llvm::Value*
+NumberExprAST::codegen()
+{
+    return EmitNumber(getLoc(), Val);
+}
+
+llvm::Value*
+VariableExprAST::codegen()
+{
+    return EmitVariable(getLoc(), Name);
+}
+
+llvm::Value *
+ExprAST::codegenAssign(SourceLocation Loc, ExprEmitter Value)
+{
+    return EmitAssign(Loc, NoSymbol, Value);
+}
+
+llvm::Value *
+VariableExprAST::codegenAssign(SourceLocation Loc, ExprEmitter Value)
+{
+    return EmitAssign(Loc, Name, Value);
+}
+
+llvm::Value *
+IndexExprAST::codegen()
+{
+    return EmitIndex(getLoc(), Array, [&] { return Index->codegen(); });
+}
+
+llvm::Value *
+IndexExprAST::codegenAssign(SourceLocation Loc, ExprEmitter Value)
+{
+    return EmitIndexAssign(Loc, Array, [&] { return Index->codegen(); }, Value);
+}
+
+llvm::Value*
+VarExprAST::codegen()
+{
+    return EmitVar(getLoc(), (uint32)VarNames.size(),
+                   [&](uint32 i) { return VarNames[i].Name; },
+                   [&](uint32 i) { return VarNames[i].Type; },
+                   [&](uint32 i) { return VarNames[i].Init ? VarNames[i].Init->codegen() : EmitZero(); },
+                   [&] { return Body->codegen(); });
+}
+
+llvm::Value *
+UnaryExprAST::codegen()
+{
+    return EmitUnary(getLoc(), Opcode, [&] { return Operand->codegen(); });
+}
+
+llvm::Value*
+BinaryExprAST::codegen()
+{
+    if (Op == '=')
+    {
+        // The destination knows whether it can be assigned to, there's no RTTI
+        // to ask it what it is.
+        return LHS->codegenAssign(getLoc(), [&] { return RHS->codegen(); });
+    }
+
+    return EmitBinary(getLoc(), Op, [&] { return LHS->codegen(); }, [&] { return RHS->codegen(); });
+}
+
+llvm::Value *
+CallExprAST::codegen()
+{
+    return EmitCall(getLoc(), Callee, (uint32)Args.size(), [&](uint32 i) { return Args[i]->codegen(); });
+}
+
+llvm::Value *
+IfExprAST::codegen()
+{
+    return EmitIf(getLoc(), [&] { return Cond->codegen(); }, [&] { return Then->codegen(); },
+                  [&] { return Else->codegen(); });
+}
+
+llvm::Value *
+ForExprAST::codegen()
+{
+    auto EmitStep = [&] { return Step->codegen(); };
+    return EmitFor(getLoc(), VarName, [&] { return Start->codegen(); }, [&] { return End->codegen(); },
+                   Step ? ExprEmitter(EmitStep) : ExprEmitter(), [&] { return Body->codegen(); });
+}
+
+// NOTE(srp): Flat codegen, one switch over the node kinds
+
+internal llvm::Value *
+FlatCodegen(uint32 Index)
+{
+    // Nothing gets added to TheFlatAST while generating code, so these stay put.
+    const FlatNode &Node = TheFlatAST.Nodes[Index];
+    const uint32 *Extra = TheFlatAST.Extra.data();
+    SourceLocation Loc = UnpackFlatLoc(Node.Loc);
+
+    switch (Node.Kind)
+    {
+        case FlatKind_Number:
+            return EmitNumber(Loc, GetFlatNumber(Node));
+        case FlatKind_Variable:
+            return EmitVariable(Loc, Node.A);
+        case FlatKind_Unary:
+            return EmitUnary(Loc, Node.Op, [&] { return FlatCodegen(Node.A); });
+        case FlatKind_Binary:
+        {
+            if (Node.Op == '=')
+            {
+                const FlatNode &LHS = TheFlatAST.Nodes[Node.A];
+                if (LHS.Kind == FlatKind_Index)
+                {
+                    return EmitIndexAssign(Loc, LHS.A, [&] { return FlatCodegen(LHS.B); },
+                                           [&] { return FlatCodegen(Node.B); });
+                }
+                Symbol Name = (LHS.Kind == FlatKind_Variable) ? LHS.A : NoSymbol;
+                return EmitAssign(Loc, Name, [&] { return FlatCodegen(Node.B); });
+            }
+            return EmitBinary(Loc, Node.Op, [&] { return FlatCodegen(Node.A); }, [&] { return FlatCodegen(Node.B); });
+        }
+        case FlatKind_Call:
+            return EmitCall(Loc, Node.A, Node.C, [&](uint32 i) { return FlatCodegen(Extra[Node.B + i]); });
+        case FlatKind_If:
+            return EmitIf(Loc, [&] { return FlatCodegen(Node.A); }, [&] { return FlatCodegen(Node.B); },
+                          [&] { return FlatCodegen(Node.C); });
+        case FlatKind_For:
+        {
+            uint32 End = Extra[Node.C];
+            uint32 Step = Extra[Node.C + 1];
+            uint32 Body = Extra[Node.C + 2];
+            auto EmitStep = [&] { return FlatCodegen(Step); };
+            return EmitFor(Loc, Node.A, [&] { return FlatCodegen(Node.B); }, [&] { return FlatCodegen(End); },
+                           (Step != FlatNone) ? ExprEmitter(EmitStep) : ExprEmitter(), [&] { return FlatCodegen(Body); });
+        }
+        case FlatKind_Var:
+        {
+            const uint32 *Vars = &Extra[Node.A + 1];
+            return EmitVar(Loc, Extra[Node.A],
+                           [&](uint32 i) { return Vars[3 * i]; },
+                           [&](uint32 i) { return (ValueType)Vars[3 * i + 1]; },
+                           [&](uint32 i) { return (Vars[3 * i + 2] != FlatNone) ? FlatCodegen(Vars[3 * i + 2]) : EmitZero(); },
+                           [&] { return FlatCodegen(Node.B); });
+        }
+        case FlatKind_Index:
+            return EmitIndex(Loc, Node.A, [&] { return FlatCodegen(Node.B); });
+    }
+    return nullptr;
+}
+
+/// CodegenExpr - Generate code for an expression in either form.
+internal llvm::Value *
+CodegenExpr(ExprRef E)
+{
+    return E.Tree ? E.Tree->codegen() : FlatCodegen(E.Flat);
+}
+
+/// getFunctionType - double(double, double) etc, or whatever is annotated.
+llvm::FunctionType *
+PrototypeAST::getFunctionType() const
+{
+    std::vector<llvm::Type*> Params;
+    for (uint32 Arg = 0; Arg < getNumArgs(); ++Arg)
+    {
+        Params.push_back(GetLLVMType(getArgType(Arg)));
+    }
+    return llvm::FunctionType::get(GetLLVMType(ReturnType), Params, false);
+}
 
 llvm::Function *
 PrototypeAST::codegen()
 {
-    // Make the function type: double(double, double) etc.
-    std::vector<llvm::Type*> Doubles(Args.size(), llvm::Type::getDoubleTy(*TheContext));
-
-    llvm::FunctionType *FT = llvm::FunctionType::get(llvm::Type::getDoubleTy(*TheContext), Doubles, false);
+    // Make the function type
+    llvm::FunctionType *FT = getFunctionType();
 
-    llvm::Function *F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, Name, TheModule.get());
+    llvm::Function *F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, SymbolName(Name), TheModule.get());
+    ModuleFunctions[Name] = F;
+    SetQualifierAttributes(*this, F);
 
     unsigned Idx = 0;
     for (auto &Arg : F->args())
     {
-        Arg.setName(Args[Idx++]);
+        Arg.setName(SymbolName(Args[Idx++]));
     }
 
     return F;
 }
 
+PrototypeAST &
+FunctionAST::installPrototype()
+{
+    if (Proto)
+    {
+        // Transfer ownership of the prototype to the FunctionProtos map, but keep a
+        // reference to it for use below.
+        Installed = Proto.get();
+        // NOTE(srp): insert() would keep a stale prototype and destroy this one,
+        // leaving Installed dangling, so overwrite instead.
+        FunctionProtos[Name] = std::move(Proto);
+    }
+    return *Installed;
+}
+
+// NOTE(srp): Tail calls. A call whose value is returned as it is, through any
+// number of if merges, is in tail position. Codegen only sees that once the
+// function is done: the 'ret' is folded back into the block with the call, so
+// the call comes right before a 'ret' of its own. Nothing takes the address of
+// a variable, so every such call can be a tail call. Calls to a function with
+// the same prototype are 'musttail', which makes even -O0 code jump instead of
+// call, and mutual recursion runs in constant stack. A function calling itself
+// is left 'tail' for TailCallElimPass, which every -O level runs (see
+// InitializeFunctionOptimizer) and turns the recursion into a loop.
+
+/// IsReturnMerge - Whether BB does nothing but pick the value for its 'ret'.
+internal bool32
+IsReturnMerge(llvm::BasicBlock *BB)
+{
+    return llvm::isa<llvm::ReturnInst>(BB->getFirstNonPHI()) && !BB->isEntryBlock();
+}
+
+/// MarkTailCalls - Called once F is complete, see the note above.
+internal void
+MarkTailCalls(llvm::Function &F)
+{
+    llvm::SmallVector<llvm::ReturnInst*, 8> Returns;
+    for (llvm::BasicBlock &BB : F)
+    {
+        if (llvm::ReturnInst *Ret = llvm::dyn_cast<llvm::ReturnInst>(BB.getTerminator()))
+        {
+            Returns.push_back(Ret);
+        }
+    }
+
+    // Fold a 'ret' into each predecessor whose incoming value is a call it ends
+    // with, or another merge's PHI, which gets the same treatment in turn.
+    llvm::SmallVector<llvm::ReturnInst*, 8> Worklist(Returns.begin(), Returns.end());
+    while (!Worklist.empty())
+    {
+        llvm::ReturnInst *Ret = Worklist.pop_back_val();
+        llvm::BasicBlock *BB = Ret->getParent();
+        llvm::PHINode *PN = llvm::dyn_cast_or_null<llvm::PHINode>(Ret->getReturnValue());
+        if (!PN || PN->getParent() != BB || !IsReturnMerge(BB))
+        {
+            continue;
+        }
+
+        // Folding can take PN down to one incoming value, which deletes it.
+        llvm::SmallVector<llvm::BasicBlock*, 4> Folds;
+        for (llvm::BasicBlock *Pred : llvm::predecessors(BB))
+        {
+            llvm::BranchInst *Br = llvm::dyn_cast<llvm::BranchInst>(Pred->getTerminator());
+            if (!Br || Br->isConditional())
+            {
+                continue;
+            }
+
+            llvm::Value *Incoming = PN->getIncomingValueForBlock(Pred);
+            llvm::CallInst *Call = llvm::dyn_cast<llvm::CallInst>(Incoming);
+            llvm::PHINode *Merge = llvm::dyn_cast<llvm::PHINode>(Incoming);
+            if ((Call && Call->getNextNode() == Br) ||
+                (Merge && Merge->getParent() == Pred && Pred->getFirstNonPHI() == Br))
+            {
+                Folds.push_back(Pred);
+            }
+        }
+
+        for (llvm::BasicBlock *Pred : Folds)
+        {
+            llvm::ReturnInst *NewRet = llvm::FoldReturnIntoUncondBranch(Ret, BB, Pred);
+            Returns.push_back(NewRet);
+            Worklist.push_back(NewRet);
+        }
+
+        if (llvm::pred_empty(BB))
+        {
+            llvm::erase_value(Returns, Ret);
+            BB->eraseFromParent();
+        }
+    }
+
+    for (llvm::ReturnInst *Ret : Returns)
+    {
+        llvm::CallInst *Call = llvm::dyn_cast_or_null<llvm::CallInst>(Ret->getReturnValue());
+        llvm::Function *Callee = Call ? Call->getCalledFunction() : nullptr;
+        if (!Callee || Callee->isIntrinsic() || Call->getNextNode() != Ret)
+        {
+            continue;
+        }
+
+        bool32 SamePrototype = (Callee->getFunctionType() == F.getFunctionType() &&
+                                Callee->getCallingConv() == F.getCallingConv());
+        if (Callee != &F && SamePrototype)
+        {
+            Call->setTailCallKind(llvm::CallInst::TCK_MustTail);
+        }
+        else
+        {
+            Call->setTailCall();
+        }
+    }
+}
+
+// NOTE(srp): Memo functions. 'def memo f(x)' keeps every result in a hash
+// table keyed on the bits of its arguments and returns it straight away when
+// the same ones come again, which makes naive recursion like fib linear. The
+// table is the runtime's (platform/externs/linux_memo.cpp), the generated code
+// keeps the pointer to it in a weak global named after the def's hash. Every
+// module holding the same def, the tier up's included, shares one table, and
+// a def that changed starts with an empty one.
+
+/// MemoKey - What EmitMemoLookup leaves for EmitMemoStore.
+struct MemoKey
+{
+    llvm::GlobalVariable *Table;
+    llvm::AllocaInst *Key; // [N x i64], the argument bits
+};
+
+/// EmitMemoBits - A number's bits as an i64, or back.
+internal llvm::Value *
+EmitMemoBits(llvm::Value *V, llvm::Type *Type)
+{
+    return (V->getType() == Type) ? V : Builder->CreateBitCast(V, Type, "memobits");
+}
+
+/// EmitMemoLookup - Return the cached result if there is one, continue in a
+/// new block if there isn't.
+internal MemoKey
+EmitMemoLookup(llvm::Function *TheFunction, Symbol Name, uint64 Hash)
+{
+    llvm::Type *IntTy = Builder->getInt64Ty();
+    llvm::PointerType *PtrTy = Builder->getInt8PtrTy();
+
+    MemoKey Memo;
+    std::string TableName = SymbolName(Name).str() + ".memo." + llvm::utohexstr(Hash);
+    Memo.Table = TheModule->getNamedGlobal(TableName);
+    if (!Memo.Table)
+    {
+        Memo.Table = new llvm::GlobalVariable(*TheModule, PtrTy, false, llvm::GlobalValue::WeakAnyLinkage,
+                                              llvm::ConstantPointerNull::get(PtrTy), TableName);
+    }
+
+    llvm::ArrayType *KeyTy = llvm::ArrayType::get(IntTy, TheFunction->arg_size());
+    Memo.Key = CreateEntryBlockAlloca(TheFunction, "memokey", KeyTy);
+    for (llvm::Argument &Arg : TheFunction->args())
+    {
+        Builder->CreateStore(EmitMemoBits(&Arg, IntTy), Builder->CreateConstInBoundsGEP2_32(KeyTy, Memo.Key, 0, Arg.getArgNo()));
+    }
+
+    llvm::Value *KeyPtr = Builder->CreateConstInBoundsGEP2_32(KeyTy, Memo.Key, 0, 0);
+    llvm::AllocaInst *Cached = CreateEntryBlockAlloca(TheFunction, "memocached", IntTy);
+    llvm::FunctionCallee Lookup = TheModule->getOrInsertFunction(
+            "ks_memo_lookup", llvm::FunctionType::get(IntTy, {Memo.Table->getType(), KeyPtr->getType(), Cached->getType()}, false));
+    llvm::Value *Found = Builder->CreateCall(Lookup, {Memo.Table, KeyPtr, Cached}, "memofound");
+
+    llvm::BasicBlock *HitBB = llvm::BasicBlock::Create(*TheContext, "memohit", TheFunction);
+    llvm::BasicBlock *MissBB = llvm::BasicBlock::Create(*TheContext, "memomiss", TheFunction);
+    Builder->CreateCondBr(Builder->CreateICmpNE(Found, llvm::ConstantInt::get(IntTy, 0), "memohitcond"), HitBB, MissBB);
+
+    Builder->SetInsertPoint(HitBB);
+    Builder->CreateRet(EmitMemoBits(Builder->CreateLoad(IntTy, Cached, "memoresult"), TheFunction->getReturnType()));
+
+    Builder->SetInsertPoint(MissBB);
+    return Memo;
+}
+
+/// EmitMemoStore - Remember the result on the way out.
+internal void
+EmitMemoStore(const MemoKey &Memo, llvm::Value *RetVal)
+{
+    llvm::Type *IntTy = Builder->getInt64Ty();
+    llvm::ArrayType *KeyTy = llvm::cast<llvm::ArrayType>(Memo.Key->getAllocatedType());
+    llvm::Value *KeyPtr = Builder->CreateConstInBoundsGEP2_32(KeyTy, Memo.Key, 0, 0);
+    llvm::FunctionCallee Store = TheModule->getOrInsertFunction(
+            "ks_memo_store", llvm::FunctionType::get(Builder->getVoidTy(), {Memo.Table->getType(), KeyPtr->getType(), IntTy, IntTy}, false));
+    Builder->CreateCall(Store, {Memo.Table, KeyPtr, llvm::ConstantInt::get(IntTy, KeyTy->getNumElements()), EmitMemoBits(RetVal, IntTy)});
+}
+
 llvm::Function *
 FunctionAST::codegen()
 {
-    // Transfer ownership of the prototype to the FunctionProtos map, but keep a
-    // reference to it for use below.
-    auto &P = *Proto;
-    //FunctionProtos[Proto->getName()] = std::move(Proto);
-    FunctionProtos.insert({ Proto->getName(), std::move(Proto) });
+    if (SimplifyAST)
+    {
+        simplify();
+    }
+
+    auto &P = installPrototype();
     llvm::Function *TheFunction = getFunction(P.getName());
     if (!TheFunction)
     {
         return nullptr;
     }
 
+    if (!TheFunction->empty())
+    {
+        return LogErrorF("Function cannot be redefined in the same module");
+    }
+
+    // The body refers to the arguments by the definition's names, an extern
+    // may have declared it with others.
+    if (TheFunction->arg_size() != P.getNumArgs())
+    {
+        return LogErrorF("Function redefined with a different number of arguments");
+    }
+    if (TheFunction->getFunctionType() != P.getFunctionType())
+    {
+        return LogErrorF("Function redefined with different argument or return types");
+    }
+
+    // An extern may have declared it with other qualifiers, the def's count.
+    SetQualifierAttributes(P, TheFunction);
+
     // If this is an operator, install it
     if (P.isBinaryOp())
     {
         BinopPrecedence[P.getOperatorName()] = P.getBinaryPrecedence();
     }
 
-    // Create a new basic block to start insertion into
-    llvm::BasicBlock *BB = llvm::BasicBlock::Create(*TheContext, "entry", TheFunction);
-    Builder->SetInsertPoint(BB);
-
     // Create a subrpogram DIE for this function
-    llvm::DIFile *Unit = DBuilder->createFile(KSDbgInfo.TheCU->getFilename(), KSDbgInfo.TheCU->getDirectory());
+    llvm::DIFile *Unit = KSDbgInfo.getFile();
     llvm::DIScope *FContext = Unit;
     unsigned LineNo = P.getLine();
     unsigned ScopeLine = LineNo;
     llvm::DISubprogram *SP = DBuilder->createFunction(
-            FContext, P.getName(), llvm::StringRef(), Unit, LineNo,
-            CreateFunctionType(TheFunction->arg_size()), ScopeLine,
+            FContext, SymbolName(P.getName()), llvm::StringRef(), Unit, LineNo,
+            CreateFunctionType(TheFunction->getFunctionType()), ScopeLine,
             llvm::DINode::FlagPrototyped, llvm::DISubprogram::SPFlagDefinition
         );
     TheFunction->setSubprogram(SP);
@@ -466,55 +2091,126 @@ FunctionAST::codegen()
     // Push the current scope
     KSDbgInfo.LexicalBlocks.push_back(SP);
 
-    // Unset the location for the prologue emission (leading instructions with no
-    // location in a function are considered part of the prologue and the debugger
-    // will run past them when breaking on a function)
-    KSDbgInfo.emitLocation(nullptr); // TODO(srp): ERROR HERE
-    // TODO(srp): maybe add ```emitLocation(FunctionAST)``` method to KSDbgInfo and use it here as
-    // KSDbgInfo.emitLocation(this);
-
-    // Record the function arguments in the NamedValues map.
-    NamedValues.clear();
-    unsigned ArgIdx = 0;
+    // Create a debug descriptor for each argument. The body may be generated
+    // more than once, these stay.
+    std::vector<llvm::DILocalVariable*> ArgVars;
     for (auto &Arg : TheFunction->args())
     {
-        // Create an alloca for this variable
-        llvm::AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, Arg.getName());
+        ArgVars.push_back(DBuilder->createParameterVariable(
+                SP, Arg.getName(), Arg.getArgNo() + 1, Unit, LineNo, KSDbgInfo.getType(Arg.getType()), true
+            ));
+    }
+
+    TheInference.Demoted.clear();
+    InPureFunction = P.isPure();
+    InMemoFunction = P.isMemo();
+    MemoKey Memo = {};
+    llvm::Value *RetVal;
+    while (true)
+    {
+        TheInference.NextBinding = 0;
+        TheInference.IntBindings.clear();
+        TheInference.Retry = false;
+        TheBoundsChecks.clear();
+
+        // Create a new basic block to start insertion into
+        llvm::BasicBlock *BB = llvm::BasicBlock::Create(*TheContext, "entry", TheFunction);
+        Builder->SetInsertPoint(BB);
+
+        // Unset the location for the prologue emission (leading instructions with no
+        // location in a function are considered part of the prologue and the debugger
+        // will run past them when breaking on a function)
+        KSDbgInfo.emitLocation(nullptr); // TODO(srp): ERROR HERE
+        // TODO(srp): maybe add ```emitLocation(FunctionAST)``` method to KSDbgInfo and use it here as
+        // KSDbgInfo.emitLocation(this);
+
+        // Record the function arguments in the NamedValues map.
+        NamedValues.clear();
+        for (auto &Arg : TheFunction->args())
+        {
+            // Create an alloca for this variable
+            llvm::AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, Arg.getName(), Arg.getType());
+
+            DBuilder->insertDeclare(
+                    Alloca, ArgVars[Arg.getArgNo()], DBuilder->createExpression(),
+                    llvm::DILocation::get(SP->getContext(), LineNo, 0, SP), Builder->GetInsertBlock()
+                );
+
+            // Store the initial value into the alloca
+            Builder->CreateStore(&Arg, Alloca);
+
+            // Add arguments to variable symbol table
+            NamedValues[P.getArg(Arg.getArgNo())] = Alloca;
+        }
 
-        // Create a debug descriptor for this variable
-        llvm::DILocalVariable *D = DBuilder->createParameterVariable(
-                SP, Arg.getName(), ++ArgIdx, Unit, LineNo, KSDbgInfo.getDoubleTy(), true
-            );
+        if (P.isMemo())
+        {
+            Memo = EmitMemoLookup(TheFunction, P.getName(), Hash);
+        }
 
-        DBuilder->insertDeclare(
-                Alloca, D, DBuilder->createExpression(), llvm::DILocation::get(SP->getContext(), LineNo, 0, SP), 
-                Builder->GetInsertBlock()
-            );
+        if (Body.Tree)
+        {
+            KSDbgInfo.emitLocation(Body.Tree);
+        }
+        else
+        {
+            KSDbgInfo.emitLocation(UnpackFlatLoc(TheFlatAST.Nodes[Body.Flat].Loc));
+        }
 
-        // Store the initial value into the alloca
-        Builder->CreateStore(&Arg, Alloca);
+        RetVal = CodegenExpr(Body);
+        if (!RetVal || !TheInference.Retry)
+        {
+            break;
+        }
 
-        // Add arguments to variable symbol table
-        NamedValues[std::string(Arg.getName())] = Alloca;
+        // A variable was demoted to a double, start over with it as one.
+        for (llvm::BasicBlock &Block : *TheFunction)
+        {
+            Block.dropAllReferences();
+        }
+        while (!TheFunction->empty())
+        {
+            TheFunction->begin()->eraseFromParent();
+        }
     }
+    InPureFunction = false;
+    InMemoFunction = false;
 
-    KSDbgInfo.emitLocation(Body.get());
+    if (RetVal)
+    {
+        RetVal = ConvertValue(RetVal, TheFunction->getReturnType());
+    }
 
-    if (llvm::Value *RetVal = Body->codegen())
+    if (RetVal)
     {
         // Finish off the function.
+        if (P.isMemo())
+        {
+            EmitMemoStore(Memo, RetVal);
+        }
         Builder->CreateRet(RetVal);
 
         // Pop off the lexical block for the function
         KSDbgInfo.LexicalBlocks.pop_back();
 
+        MarkTailCalls(*TheFunction);
+
         // Validate the generated code, checking for consistency
         llvm::verifyFunction(*TheFunction);
 
+        // Run the per-function optimizations
+        OptimizeFunction(*TheFunction);
+
+        if (P.isUnaryOp() || P.isBinaryOp())
+        {
+            RegisterOperator(P.getName(), TheFunction);
+        }
+
         return TheFunction;
     }
 
     // Error reading body, remove function.
+    ModuleFunctions.erase(P.getName());
     TheFunction->eraseFromParent();
 
     if (P.isBinaryOp())
@@ -526,14 +2222,6 @@ FunctionAST::codegen()
     KSDbgInfo.LexicalBlocks.pop_back();
 
     return nullptr;
-    // TODO(srp): bug: If the FunctionAST::codegen() method finds an existing 
-    // IR Function, it does not validate its signature against the definition’s 
-    // own prototype. This means that an earlier ‘extern’ declaration will take 
-    // precedence over the function definition’s signature, which can cause codegen 
-    // to fail, for instance if the function arguments are named differently.
-    // TESTCASE:
-    // extern foo(a);
-    // def foo(b) b;
 }
 
 // NOTE(srp): Interesting: https://llvm.org/docs/LangRef.html
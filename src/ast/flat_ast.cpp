@@ -0,0 +1,210 @@
+#pragma once
+// NOTE(srp): Still not final platform-independent code
+
+#include <vector>
+#include "../platform/llvm/llvm_include.hpp"
+#include "../platform/typedefs/typedefs.hpp"
+#include "../debugging/debuginfo.cpp"
+#include "../lexer/lexer.cpp"
+#include "./types.cpp"
+
+// NOTE(srp): Flat AST (--flat-ast). Instead of a tree of heap objects, the
+// expressions of the current top-level item are 20-byte FlatNodes in one
+// array, pointing at each other by index. No vtables, no per-node
+// allocations, and a walk over a big function stays in a few cache lines.
+
+/// FlatKind - What a FlatNode is and how it uses A, B and C. Children are
+/// indices into Nodes, lists live in Extra, names are Symbols.
+enum FlatKind : uint8
+{
+    FlatKind_Number,    // A, B: the bits of the value, Op: 'i' for an int
+    FlatKind_Variable,  // A: name
+    FlatKind_Unary,     // Op, A: operand
+    FlatKind_Binary,    // Op, A: LHS, B: RHS
+    FlatKind_Call,      // A: callee name, B: first argument in Extra, C: argument count
+    FlatKind_If,        // A: condition, B: then, C: else
+    FlatKind_For,       // A: variable name, B: start, C: {end, step, body} in Extra
+    FlatKind_Var,       // A: {count, name, type, init, name, type, init...} in Extra, B: body
+    FlatKind_Index,     // A: array name, B: index
+};
+
+/// FlatNone - A missing optional child (for step, var initializer).
+inline_variable uint32 FlatNone = 0xFFFFFFFF;
+
+struct FlatNode
+{
+    FlatKind Kind;
+    char Op;
+    uint32 Loc; // See PackFlatLoc
+    uint32 A, B, C;
+};
+
+static_assert(sizeof(FlatNode) == 20, "FlatNode should stay small");
+
+/// FlatAST - Everything parsed for the current top-level item. Cleared, not
+/// freed, between items.
+struct FlatAST
+{
+    std::vector<FlatNode> Nodes;
+    std::vector<uint32> Extra;
+};
+
+global_variable thread_local FlatAST TheFlatAST;
+
+/// FlatASTMode - Parse into TheFlatAST instead of building ExprAST trees.
+global_variable bool32 FlatASTMode = false;
+
+/// PackFlatLoc - Line in the top 22 bits, column in the low 10. Columns past
+/// 1023 saturate, they're only used for debug info.
+internal uint32
+PackFlatLoc(SourceLocation Loc)
+{
+    uint32 Col = (Loc.Col > 1023) ? 1023 : (uint32)Loc.Col;
+    return ((uint32)Loc.Line << 10) | Col;
+}
+
+internal SourceLocation
+UnpackFlatLoc(uint32 Loc)
+{
+    return {(int32)(Loc >> 10), (int32)(Loc & 1023)};
+}
+
+internal uint32
+AddFlatNode(FlatKind Kind, char Op, SourceLocation Loc, uint32 A = 0, uint32 B = 0, uint32 C = 0)
+{
+    TheFlatAST.Nodes.push_back({Kind, Op, PackFlatLoc(Loc), A, B, C});
+    return (uint32)TheFlatAST.Nodes.size() - 1;
+}
+
+internal Literal
+GetFlatNumber(const FlatNode &Node)
+{
+    uint64 Bits = ((uint64)Node.B << 32) | Node.A;
+    Literal Val;
+    memcpy(&Val.Val, &Bits, sizeof(Val.Val));
+    Val.IsInteger = (Node.Op == 'i');
+    return Val;
+}
+
+/// SetFlatNumber - Turn Node into a literal.
+internal void
+SetFlatNumber(FlatNode *Node, Literal Val)
+{
+    uint64 Bits;
+    memcpy(&Bits, &Val.Val, sizeof(Bits));
+    Node->Kind = FlatKind_Number;
+    Node->Op = Val.IsInteger ? 'i' : 0;
+    Node->A = (uint32)Bits;
+    Node->B = (uint32)(Bits >> 32);
+    Node->C = 0;
+}
+
+internal void
+ResetFlatAST()
+{
+    TheFlatAST.Nodes.clear();
+    TheFlatAST.Extra.clear();
+}
+
+llvm::raw_ostream &indent(llvm::raw_ostream &O, int32 size);
+
+/// FlatDump - Same output as ExprAST::dump.
+internal llvm::raw_ostream &
+FlatDump(uint32 Index, llvm::raw_ostream &out, int32 ind)
+{
+    const FlatNode &Node = TheFlatAST.Nodes[Index];
+    const uint32 *Extra = TheFlatAST.Extra.data();
+    SourceLocation Loc = UnpackFlatLoc(Node.Loc);
+
+    switch (Node.Kind)
+    {
+        case FlatKind_Number:
+            out << GetFlatNumber(Node).Val;
+            break;
+        case FlatKind_Variable:
+            out << SymbolName(Node.A);
+            break;
+        case FlatKind_Unary:
+            out << "{unary" << OperatorSpelling(Node.Op) << "}";
+            break;
+        case FlatKind_Binary:
+            out << "{binary" << OperatorSpelling(Node.Op) << "}";
+            break;
+        case FlatKind_Call:
+            out << "call " << SymbolName(Node.A);
+            break;
+        case FlatKind_If:
+            out << "if";
+            break;
+        case FlatKind_For:
+            out << "for";
+            break;
+        case FlatKind_Var:
+            out << "var";
+            break;
+        case FlatKind_Index:
+            out << "index " << SymbolName(Node.A);
+            break;
+    }
+    out << ':' << Loc.Line << ':' << Loc.Col << '\n';
+
+    switch (Node.Kind)
+    {
+        case FlatKind_Number:
+        case FlatKind_Variable:
+            break;
+        case FlatKind_Unary:
+            FlatDump(Node.A, out, ind + 1);
+            break;
+        case FlatKind_Binary:
+            FlatDump(Node.A, indent(out, ind) << "LHS:", ind + 1);
+            FlatDump(Node.B, indent(out, ind) << "RHS:", ind + 1);
+            break;
+        case FlatKind_Call:
+            for (uint32 Arg = 0; Arg < Node.C; ++Arg)
+            {
+                FlatDump(Extra[Node.B + Arg], indent(out, ind + 1), ind + 1);
+            }
+            break;
+        case FlatKind_If:
+            FlatDump(Node.A, indent(out, ind) << "Cond:", ind + 1);
+            FlatDump(Node.B, indent(out, ind) << "Then:", ind + 1);
+            FlatDump(Node.C, indent(out, ind) << "Else:", ind + 1);
+            break;
+        case FlatKind_For:
+            FlatDump(Node.B, indent(out, ind) << "Cond:", ind + 1);
+            FlatDump(Extra[Node.C], indent(out, ind) << "End:", ind + 1);
+            if (Extra[Node.C + 1] != FlatNone)
+            {
+                FlatDump(Extra[Node.C + 1], indent(out, ind) << "Step:", ind + 1);
+            }
+            FlatDump(Extra[Node.C + 2], indent(out, ind) << "Body:", ind + 1);
+            break;
+        case FlatKind_Var:
+            for (uint32 Var = 0; Var < Extra[Node.A]; ++Var)
+            {
+                Symbol Name = Extra[Node.A + 1 + 3 * Var];
+                ValueType Type = (ValueType)Extra[Node.A + 2 + 3 * Var];
+                uint32 Init = Extra[Node.A + 3 + 3 * Var];
+                indent(out, ind) << SymbolName(Name) << ':';
+                if (Type != Type_Inferred)
+                {
+                    out << TypeName(Type) << ':';
+                }
+                if (Init != FlatNone)
+                {
+                    FlatDump(Init, out, ind + 1);
+                }
+                else
+                {
+                    out << "null\n";
+                }
+            }
+            FlatDump(Node.B, indent(out, ind) << "Body:", ind + 1);
+            break;
+        case FlatKind_Index:
+            FlatDump(Node.B, indent(out, ind) << "Index:", ind + 1);
+            break;
+    }
+    return out;
+}
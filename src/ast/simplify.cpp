@@ -0,0 +1,439 @@
+#pragma once
+// NOTE(srp): Still not final platform-independent code
+
+#include <cmath>
+#include "../platform/llvm/llvm_include.hpp"
+#include "../platform/typedefs/typedefs.hpp"
+#include "./ast.cpp"
+#include "./flat_ast.cpp"
+
+// NOTE(srp): AST simplifier, run on every body right before codegen. It folds
+// the builtin operators on literals, picks the side of an if on a literal when
+// both sides are literals of one type, and removes the operations that give
+// back their operand unchanged, so LLVM never sees them. That matters most at
+// -O0 and in the baseline tier, where nothing else would clean them up.
+//
+// Everything here is exact under IEEE rules, the result is bit for bit what the
+// unsimplified code computes, and of the same type. So x+0 stays (-0 + 0 is
+// +0) and so does 0-x (0 - 0 is +0, not -0). An operand is only ever dropped
+// for an int literal, x*1.0 would be a double even when x is an int. Ints are
+// folded as long as the result is still exact in the literal. Only literals
+// are ever dropped, they have no side effects.
+
+/// SimplifyAST - Cleared by --no-simplify, to see the code as written.
+global_variable bool32 SimplifyAST = true;
+
+/// BinaryFold - What a binary operator on its (simplified) operands becomes.
+enum BinaryFold
+{
+    BinaryFold_None,     // Keep the operation
+    BinaryFold_Constant, // A literal, the folded value
+    BinaryFold_LHS,      // Just the left operand
+    BinaryFold_RHS,      // Just the right operand
+};
+
+/// MaxExactInteger - Ints in literals are kept in a double, 2^53 is where
+/// they stop being exact.
+inline_variable real64 MaxExactInteger = 9007199254740992.0;
+
+/// IsTrueCondition - How EmitIf tests a condition, fcmp one against 0.0.
+internal bool32
+IsTrueCondition(real64 Cond)
+{
+    return !std::isnan(Cond) && Cond != 0.0;
+}
+
+/// SameLiteralType - Whether an if's sides are literals of the same type. Only
+/// then is the side taken what EmitIf gives: the types of anything else aren't
+/// known before codegen, and EmitIf converts the result to the wider one (or
+/// rejects vectors of different widths).
+internal bool32
+SameLiteralType(bool32 ThenConst, Literal Then, bool32 ElseConst, Literal Else)
+{
+    return ThenConst && ElseConst && Then.IsInteger == Else.IsInteger;
+}
+
+/// SimplifyUnary - Fold a builtin unary operator on a literal. False for the
+/// user defined ones.
+internal bool32
+SimplifyUnary(char Op, Literal Operand, Literal *Folded)
+{
+    switch (Op)
+    {
+        case '!':
+            *Folded = {IsTrueCondition(Operand.Val) ? 0.0 : 1.0, false};
+            return true;
+        case '-':
+            // The int 0 has no sign.
+            *Folded = {Operand.IsInteger ? 0.0 - Operand.Val : -Operand.Val, Operand.IsInteger};
+            return true;
+    }
+    return false;
+}
+
+/// SimplifyIntegers - '+', '-' and '*' on two int literals wrap around like
+/// EmitBinary's, false if the result isn't exact as a literal.
+internal bool32
+SimplifyIntegers(char Op, int64 L, int64 R, Literal *Folded)
+{
+    // Unsigned, so it wraps instead of overflowing.
+    uint64 Result;
+    switch (Op)
+    {
+        case '+':
+            Result = (uint64)L + (uint64)R;
+            break;
+        case '-':
+            Result = (uint64)L - (uint64)R;
+            break;
+        case '*':
+            Result = (uint64)L * (uint64)R;
+            break;
+        default:
+            return false;
+    }
+
+    real64 Val = (real64)(int64)Result;
+    if (std::fabs(Val) >= MaxExactInteger)
+    {
+        return false;
+    }
+    *Folded = {Val, true};
+    return true;
+}
+
+/// SimplifyBinary - L and R are null when that operand isn't a literal. Only the
+/// builtin operators are touched, the rest are calls. Folded gets the value
+/// for BinaryFold_Constant.
+internal BinaryFold
+SimplifyBinary(char Op, const Literal *L, const Literal *R, Literal *Folded)
+{
+    if (L && R)
+    {
+        if (L->IsInteger && R->IsInteger && (Op == '+' || Op == '-' || Op == '*'))
+        {
+            return SimplifyIntegers(Op, (int64)L->Val, (int64)R->Val, Folded) ? BinaryFold_Constant : BinaryFold_None;
+        }
+
+        // Everything else gives a double. Ints are exact in one, so they
+        // compare the same.
+        real64 LVal = L->Val;
+        real64 RVal = R->Val;
+        Folded->IsInteger = false;
+        switch (Op)
+        {
+            case '+':
+                Folded->Val = LVal + RVal;
+                return BinaryFold_Constant;
+            case '-':
+                Folded->Val = LVal - RVal;
+                return BinaryFold_Constant;
+            case '*':
+                Folded->Val = LVal * RVal;
+                return BinaryFold_Constant;
+            case '/':
+                Folded->Val = LVal / RVal;
+                return BinaryFold_Constant;
+            // Same predicates as EmitBinary, only '==' is false when unordered.
+            case '<':
+                Folded->Val = !(LVal >= RVal) ? 1.0 : 0.0;
+                return BinaryFold_Constant;
+            case '>':
+                Folded->Val = !(LVal <= RVal) ? 1.0 : 0.0;
+                return BinaryFold_Constant;
+            case tok_less_equal:
+                Folded->Val = !(LVal > RVal) ? 1.0 : 0.0;
+                return BinaryFold_Constant;
+            case tok_greater_equal:
+                Folded->Val = !(LVal < RVal) ? 1.0 : 0.0;
+                return BinaryFold_Constant;
+            case tok_equal:
+                Folded->Val = (LVal == RVal) ? 1.0 : 0.0;
+                return BinaryFold_Constant;
+            case tok_not_equal:
+                Folded->Val = (LVal != RVal) ? 1.0 : 0.0;
+                return BinaryFold_Constant;
+            case tok_and:
+                Folded->Val = (IsTrueCondition(LVal) && IsTrueCondition(RVal)) ? 1.0 : 0.0;
+                return BinaryFold_Constant;
+            case tok_or:
+                Folded->Val = (IsTrueCondition(LVal) || IsTrueCondition(RVal)) ? 1.0 : 0.0;
+                return BinaryFold_Constant;
+            default:
+                return BinaryFold_None;
+        }
+    }
+
+    // Only int literals can go away, see above.
+    bool32 LInt = L && L->IsInteger;
+    bool32 RInt = R && R->IsInteger;
+    switch (Op)
+    {
+        case tok_and:
+            // A literal LHS that decides the result, RHS never runs.
+            if (L && !IsTrueCondition(L->Val))
+            {
+                *Folded = {0.0, false};
+                return BinaryFold_Constant;
+            }
+            break;
+        case tok_or:
+            if (L && IsTrueCondition(L->Val))
+            {
+                *Folded = {1.0, false};
+                return BinaryFold_Constant;
+            }
+            break;
+        case '-':
+            // x - 0 is x, -0 included.
+            if (RInt && R->Val == 0.0)
+            {
+                return BinaryFold_LHS;
+            }
+            break;
+        case '*':
+            if (RInt && R->Val == 1.0)
+            {
+                return BinaryFold_LHS;
+            }
+            if (LInt && L->Val == 1.0)
+            {
+                return BinaryFold_RHS;
+            }
+            break;
+        default:
+            break;
+    }
+    return BinaryFold_None;
+}
+
+// NOTE(srp): Tree simplifier
+
+/// SimplifyTree - Simplify E, which may be null (a missing step or initializer).
+internal ExprAST *
+SimplifyTree(ExprAST *E)
+{
+    return E ? E->simplify() : nullptr;
+}
+
+ExprAST *
+VarExprAST::simplify()
+{
+    for (VarBinding &Var : VarNames)
+    {
+        Var.Init = SimplifyTree(Var.Init);
+    }
+    Body = Body->simplify();
+    return this;
+}
+
+ExprAST *
+IndexExprAST::simplify()
+{
+    Index = Index->simplify();
+    return this;
+}
+
+ExprAST *
+UnaryExprAST::simplify()
+{
+    Operand = Operand->simplify();
+
+    Literal Val, Folded;
+    if (Operand->isConstant(&Val) && SimplifyUnary(Opcode, Val, &Folded))
+    {
+        return NewAST<NumberExprAST>(getLoc(), Folded);
+    }
+    return this;
+}
+
+ExprAST *
+BinaryExprAST::simplify()
+{
+    // The destination of '=' has to stay what it is, only the index in an
+    // array element gets simplified.
+    ExprAST *SimpleLHS = LHS->simplify();
+    if (Op != '=')
+    {
+        LHS = SimpleLHS;
+    }
+    RHS = RHS->simplify();
+
+    Literal L, R, Folded;
+    bool32 LConst = LHS->isConstant(&L);
+    bool32 RConst = RHS->isConstant(&R);
+    switch (SimplifyBinary(Op, LConst ? &L : nullptr, RConst ? &R : nullptr, &Folded))
+    {
+        case BinaryFold_Constant:
+            return NewAST<NumberExprAST>(getLoc(), Folded);
+        case BinaryFold_LHS:
+            return LHS;
+        case BinaryFold_RHS:
+            return RHS;
+        case BinaryFold_None:
+            break;
+    }
+    return this;
+}
+
+ExprAST *
+CallExprAST::simplify()
+{
+    for (ExprAST *&Arg : Args)
+    {
+        Arg = Arg->simplify();
+    }
+    return this;
+}
+
+ExprAST *
+IfExprAST::simplify()
+{
+    Cond = Cond->simplify();
+    Then = Then->simplify();
+    Else = Else->simplify();
+
+    Literal CondVal, ThenVal = {}, ElseVal = {};
+    if (Cond->isConstant(&CondVal) &&
+        SameLiteralType(Then->isConstant(&ThenVal), ThenVal, Else->isConstant(&ElseVal), ElseVal))
+    {
+        return IsTrueCondition(CondVal.Val) ? Then : Else;
+    }
+    return this;
+}
+
+ExprAST *
+ForExprAST::simplify()
+{
+    // A literal false end condition skips the body (see EmitFor), but the
+    // start value is still evaluated, so the branch on it is left to LLVM.
+    Start = Start->simplify();
+    End = End->simplify();
+    Step = SimplifyTree(Step);
+    Body = Body->simplify();
+    return this;
+}
+
+// NOTE(srp): Flat simplifier, one switch over the node kinds
+
+/// FlatSimplify - Simplify the node at Index in place. Returns the index that
+/// should take its place, which is Index unless the node became one of its
+/// children.
+internal uint32
+FlatSimplify(uint32 Index)
+{
+    if (Index == FlatNone)
+    {
+        return FlatNone;
+    }
+
+    // Nothing gets added to TheFlatAST while simplifying, so these stay put.
+    FlatNode &Node = TheFlatAST.Nodes[Index];
+    uint32 *Extra = TheFlatAST.Extra.data();
+
+    switch (Node.Kind)
+    {
+        case FlatKind_Number:
+        case FlatKind_Variable:
+            break;
+        case FlatKind_Unary:
+        {
+            Node.A = FlatSimplify(Node.A);
+
+            const FlatNode &Operand = TheFlatAST.Nodes[Node.A];
+            Literal Folded;
+            if (Operand.Kind == FlatKind_Number && SimplifyUnary(Node.Op, GetFlatNumber(Operand), &Folded))
+            {
+                SetFlatNumber(&Node, Folded);
+            }
+            break;
+        }
+        case FlatKind_Binary:
+        {
+            uint32 SimpleLHS = FlatSimplify(Node.A);
+            if (Node.Op != '=')
+            {
+                Node.A = SimpleLHS;
+            }
+            Node.B = FlatSimplify(Node.B);
+
+            const FlatNode &LHS = TheFlatAST.Nodes[Node.A];
+            const FlatNode &RHS = TheFlatAST.Nodes[Node.B];
+            Literal L = GetFlatNumber(LHS);
+            Literal R = GetFlatNumber(RHS);
+            Literal Folded;
+            switch (SimplifyBinary(Node.Op, (LHS.Kind == FlatKind_Number) ? &L : nullptr,
+                                   (RHS.Kind == FlatKind_Number) ? &R : nullptr, &Folded))
+            {
+                case BinaryFold_Constant:
+                    SetFlatNumber(&Node, Folded);
+                    break;
+                case BinaryFold_LHS:
+                    return Node.A;
+                case BinaryFold_RHS:
+                    return Node.B;
+                case BinaryFold_None:
+                    break;
+            }
+            break;
+        }
+        case FlatKind_Call:
+            for (uint32 Arg = 0; Arg < Node.C; ++Arg)
+            {
+                Extra[Node.B + Arg] = FlatSimplify(Extra[Node.B + Arg]);
+            }
+            break;
+        case FlatKind_If:
+        {
+            Node.A = FlatSimplify(Node.A);
+            Node.B = FlatSimplify(Node.B);
+            Node.C = FlatSimplify(Node.C);
+
+            const FlatNode &Cond = TheFlatAST.Nodes[Node.A];
+            const FlatNode &Then = TheFlatAST.Nodes[Node.B];
+            const FlatNode &Else = TheFlatAST.Nodes[Node.C];
+            bool32 ThenConst = (Then.Kind == FlatKind_Number);
+            bool32 ElseConst = (Else.Kind == FlatKind_Number);
+            if (Cond.Kind == FlatKind_Number &&
+                SameLiteralType(ThenConst, ThenConst ? GetFlatNumber(Then) : Literal{},
+                                ElseConst, ElseConst ? GetFlatNumber(Else) : Literal{}))
+            {
+                return IsTrueCondition(GetFlatNumber(Cond).Val) ? Node.B : Node.C;
+            }
+            break;
+        }
+        case FlatKind_For:
+            Node.B = FlatSimplify(Node.B);
+            Extra[Node.C] = FlatSimplify(Extra[Node.C]);
+            Extra[Node.C + 1] = FlatSimplify(Extra[Node.C + 1]);
+            Extra[Node.C + 2] = FlatSimplify(Extra[Node.C + 2]);
+            break;
+        case FlatKind_Var:
+        {
+            uint32 *Vars = &Extra[Node.A + 1];
+            for (uint32 Var = 0; Var < Extra[Node.A]; ++Var)
+            {
+                Vars[3 * Var + 2] = FlatSimplify(Vars[3 * Var + 2]);
+            }
+            Node.B = FlatSimplify(Node.B);
+            break;
+        }
+        case FlatKind_Index:
+            Node.B = FlatSimplify(Node.B);
+            break;
+    }
+    return Index;
+}
+
+void
+FunctionAST::simplify()
+{
+    if (Body.Tree)
+    {
+        Body.Tree = Body.Tree->simplify();
+    }
+    else
+    {
+        Body.Flat = FlatSimplify(Body.Flat);
+    }
+}
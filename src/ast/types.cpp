@@ -0,0 +1,96 @@
+#pragma once
+// NOTE(srp): Still not final platform-independent code
+
+#include "../platform/typedefs/typedefs.hpp"
+#include "../lexer/symbols.cpp"
+
+// NOTE(srp): Values are doubles or 64-bit integers. Arguments and return
+// values are doubles unless annotated ('def f(n:int):int'), a var or a for
+// variable is whatever its initial value is unless annotated. Integer
+// literals are ints, so are +, - and * on two ints. Anything mixed, '/' and
+// the comparisons are doubles. Codegen finds the types on the values it
+// makes, the AST only holds the annotations.
+//
+// vec4 and vec8 are 4 and 8 doubles, one per SIMD lane. The operators work
+// lane by lane, a scalar next to a vector is copied to every lane, and a
+// comparison gives a mask of 1.0/0.0 lanes. Vectors are made with
+// vec4(...)/vec8(...) and taken apart with lane() and the reductions, see
+// EmitBuiltinCall. They never silently become scalars.
+//
+// An array is a run of doubles on the heap, made with array(n) and handed
+// around by reference. a[i] reads an element and a[i] = x writes one, the
+// index is checked against len(a) every time unless a for loop proves it
+// can't be out of range, see VersionBoundsChecks. Arrays have no operators
+// and stay alive until they're given to free().
+
+enum ValueType : uint8
+{
+    Type_Inferred, // No annotation, from the initial value
+    Type_Double,
+    Type_Int,
+    Type_Vec4,
+    Type_Vec8,
+    Type_Array,
+};
+
+/// Literal - A number as written. Integer literals are ints, anything with a
+/// '.' in it is a double.
+struct Literal
+{
+    real64 Val;
+    bool32 IsInteger;
+};
+
+/// LookupTypeName - The type an annotation names, Type_Inferred if it's not one.
+internal ValueType
+LookupTypeName(Symbol Name)
+{
+    local_persist Symbol IntName = Intern(llvm::StringRef("int"));
+    local_persist Symbol DoubleName = Intern(llvm::StringRef("double"));
+    local_persist Symbol Vec4Name = Intern(llvm::StringRef("vec4"));
+    local_persist Symbol Vec8Name = Intern(llvm::StringRef("vec8"));
+    local_persist Symbol ArrayName = Intern(llvm::StringRef("array"));
+
+    if (Name == IntName)
+    {
+        return Type_Int;
+    }
+    if (Name == DoubleName)
+    {
+        return Type_Double;
+    }
+    if (Name == Vec4Name)
+    {
+        return Type_Vec4;
+    }
+    if (Name == Vec8Name)
+    {
+        return Type_Vec8;
+    }
+    if (Name == ArrayName)
+    {
+        return Type_Array;
+    }
+    return Type_Inferred;
+}
+
+internal const char *
+TypeName(ValueType Type)
+{
+    switch (Type)
+    {
+        case Type_Inferred:
+            return "inferred";
+        case Type_Double:
+            return "double";
+        case Type_Int:
+            return "int";
+        case Type_Vec4:
+            return "vec4";
+        case Type_Vec8:
+            return "vec8";
+        case Type_Array:
+            return "array";
+    }
+    return "?";
+}
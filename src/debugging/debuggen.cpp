@@ -14,6 +14,12 @@ DebugInfo::emitLocation(ExprAST *AST)
         return Builder->SetCurrentDebugLocation(llvm::DebugLoc());
     }
 
+    emitLocation(AST->getLoc());
+}
+
+void
+DebugInfo::emitLocation(SourceLocation Loc)
+{
     llvm::DIScope *Scope;
     if (LexicalBlocks.empty())
     {
@@ -24,21 +30,20 @@ DebugInfo::emitLocation(ExprAST *AST)
         Scope = LexicalBlocks.back();
     }
 
-    Builder->SetCurrentDebugLocation(llvm::DILocation::get(Scope->getContext(), AST->getLine(), AST->getCol(), Scope));
+    Builder->SetCurrentDebugLocation(llvm::DILocation::get(Scope->getContext(), Loc.Line, Loc.Col, Scope));
 }
 
 internal llvm::DISubroutineType *
-CreateFunctionType(unsigned NumArgs)
+CreateFunctionType(llvm::FunctionType *FT)
 {
     llvm::SmallVector<llvm::Metadata *, 8> EltTys;
-    llvm::DIType *DblTy = KSDbgInfo.getDoubleTy();
 
     // Add the result type
-    EltTys.push_back(DblTy);
+    EltTys.push_back(KSDbgInfo.getType(FT->getReturnType()));
 
-    for (unsigned i = 0, e = NumArgs; i != e; ++i)
+    for (llvm::Type *Param : FT->params())
     {
-        EltTys.push_back(DblTy);
+        EltTys.push_back(KSDbgInfo.getType(Param));
     }
     
     return DBuilder->createSubroutineType(DBuilder->getOrCreateTypeArray(EltTys));
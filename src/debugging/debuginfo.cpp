@@ -12,11 +12,20 @@ struct DebugInfo
 {
     llvm::DICompileUnit *TheCU;
     llvm::DIType *DblTy;
+    llvm::DIType *IntTy;
+    llvm::SmallDenseMap<uint32, llvm::DIType*> VecTys; // By lane count
+    llvm::DIType *ArrayTy;
     std::vector<llvm::DIScope*> LexicalBlocks;
 
     void emitLocation(ExprAST *AST);
+    void emitLocation(struct SourceLocation Loc);
     llvm::DIType *getDoubleTy();
-} KSDbgInfo;
+    llvm::DIType *getIntTy();
+    llvm::DIType *getType(llvm::Type *Type);
+    llvm::DIFile *getFile();
+};
+
+global_variable thread_local DebugInfo KSDbgInfo;
 
 llvm::DIType *
 DebugInfo::getDoubleTy()
@@ -30,30 +39,74 @@ DebugInfo::getDoubleTy()
     return DblTy;
 }
 
-struct SourceLocation
+llvm::DIType *
+DebugInfo::getIntTy()
 {
-    int32 Line;
-    int32 Col;
-};
+    if (IntTy)
+    {
+        return IntTy;
+    }
 
-global_variable SourceLocation CurLoc;
-global_variable SourceLocation LexLoc = {1, 0};
+    IntTy = DBuilder->createBasicType("int", 64, llvm::dwarf::DW_ATE_signed);
+    return IntTy;
+}
 
-internal int32
-advance()
+/// getType - The debug type of a Kaleidoscope value, i64, double, a vector
+/// of doubles or an array, which is a pointer to its first double.
+llvm::DIType *
+DebugInfo::getType(llvm::Type *Type)
 {
-    int32 LastChar = getchar();
-    
-    // TODO(srp): Test possible bug in CRLF drifting an extra line
-    if (LastChar == '\n' || LastChar == '\r')
+    if (Type->isPointerTy())
+    {
+        if (!ArrayTy)
+        {
+            ArrayTy = DBuilder->createPointerType(getDoubleTy(), 64);
+        }
+        return ArrayTy;
+    }
+
+    llvm::FixedVectorType *VecTy = llvm::dyn_cast<llvm::FixedVectorType>(Type);
+    if (!VecTy)
     {
-        LexLoc.Line++;
-        LexLoc.Col = 0;
+        return Type->isIntegerTy() ? getIntTy() : getDoubleTy();
     }
-    else
+
+    uint32 Lanes = VecTy->getNumElements();
+    llvm::DIType *&Ty = VecTys[Lanes];
+    if (!Ty)
     {
-        LexLoc.Col++;
+        llvm::Metadata *Subscript = DBuilder->getOrCreateSubrange(0, Lanes);
+        Ty = DBuilder->createVectorType(64 * Lanes, 0, getDoubleTy(), DBuilder->getOrCreateArray(Subscript));
     }
-    return LastChar;
+    return Ty;
+}
+
+/// SourceBuffer - The source being lexed. Files are lexed straight out of
+/// their mapping, stdin a line at a time out of StdinLine.
+struct SourceBuffer
+{
+    const char *Path;
+    const char *At;
+    const char *End;
+    const char *LineStart; // For columns
+    bool32 IsStdin;
+};
+
+global_variable thread_local SourceBuffer CurSource = {"<stdin>", nullptr, nullptr, nullptr, true};
+
+/// getFile - The file the code being generated right now comes from.
+llvm::DIFile *
+DebugInfo::getFile()
+{
+    llvm::StringRef Dir = llvm::sys::path::parent_path(CurSource.Path);
+    return DBuilder->createFile(llvm::sys::path::filename(CurSource.Path), Dir.empty() ? "." : Dir);
 }
 
+struct SourceLocation
+{
+    int32 Line;
+    int32 Col;
+};
+
+global_variable thread_local SourceLocation CurLoc;
+global_variable thread_local SourceLocation LexLoc = {1, 0};
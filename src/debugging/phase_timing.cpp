@@ -0,0 +1,99 @@
+#pragma once
+// NOTE(srp): Still not final platform-independent code
+
+#include <atomic>
+#include <chrono>
+#include "../platform/typedefs/typedefs.hpp"
+
+/// CompilerPhase - The stages the time to run a program is split into.
+enum CompilerPhase
+{
+    Phase_Lex,
+    Phase_Parse,
+    Phase_Codegen,
+    Phase_Optimize,
+    Phase_JIT,      // Handing modules to the JIT and materializing them
+    Phase_Execute,  // Running top-level expressions
+
+    Phase_Count,
+};
+
+[[maybe_unused]] internal const char *
+GetPhaseName(CompilerPhase Phase)
+{
+    switch (Phase)
+    {
+        case Phase_Lex:
+            return "lex";
+        case Phase_Parse:
+            return "parse";
+        case Phase_Codegen:
+            return "codegen";
+        case Phase_Optimize:
+            return "optimize";
+        case Phase_JIT:
+            return "jit";
+        case Phase_Execute:
+            return "execute";
+        case Phase_Count:
+            break;
+    }
+    return "unknown";
+}
+
+/// PhaseNanoseconds - Time spent in each phase so far. Modules can be optimized
+/// on the compile threads, hence atomic.
+global_variable std::atomic<uint64> PhaseNanoseconds[Phase_Count];
+
+internal uint64
+GetNanoseconds()
+{
+    return (uint64)std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+[[maybe_unused]] internal void
+ResetPhaseTimes()
+{
+    for (uint32 Phase = 0; Phase < Phase_Count; ++Phase)
+    {
+        PhaseNanoseconds[Phase] = 0;
+    }
+}
+
+/// PhaseTimer - Charges the time until it goes out of scope to Phase. Starting
+/// a timer pauses the one it's nested in, so a phase never counts time spent in
+/// another (codegen doesn't include the per-function optimizations it runs).
+struct PhaseTimer
+{
+    CompilerPhase Phase;
+    uint64 Start;
+    PhaseTimer *Outer;
+
+    PhaseTimer(CompilerPhase Phase);
+    ~PhaseTimer();
+};
+
+global_variable thread_local PhaseTimer *CurrentPhaseTimer;
+
+PhaseTimer::PhaseTimer(CompilerPhase Phase)
+    : Phase(Phase), Outer(CurrentPhaseTimer)
+{
+    Start = GetNanoseconds();
+    if (Outer)
+    {
+        PhaseNanoseconds[Outer->Phase] += Start - Outer->Start;
+    }
+    CurrentPhaseTimer = this;
+}
+
+PhaseTimer::~PhaseTimer()
+{
+    uint64 End = GetNanoseconds();
+    PhaseNanoseconds[Phase] += End - Start;
+    if (Outer)
+    {
+        Outer->Start = End;
+    }
+    CurrentPhaseTimer = Outer;
+}
@@ -14,17 +14,24 @@
 #define LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 
 #include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/JITLink/EHFrameSupport.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/Core.h"
 #include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IRTransformLayer.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
-#include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
-#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
+#include "llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/Support/ThreadPool.h"
+#include "SlabMemoryManager.h"
 #include <memory>
 
 namespace llvm {
@@ -36,36 +43,92 @@ private:
 
   DataLayout DL;
   MangleAndInterner Mangle;
+  JITTargetMachineBuilder JTMB;
 
-  RTDyldObjectLinkingLayer ObjectLayer;
+  ObjectLinkingLayer ObjectLayer;
   IRCompileLayer CompileLayer;
+  IRTransformLayer OptimizeLayer;
+
+  // Resolves a symbol the first time a trampoline to it is called. Lazy mode
+  // emits every function behind one, addLazyStub puts one behind a stub.
+  std::unique_ptr<LazyCallThroughManager> LCTMgr;
+  // Only set up in lazy mode: functions are compiled on their first call.
+  std::unique_ptr<CompileOnDemandLayer> CODLayer;
+
+  // Stubs for functions whose body gets swapped out while the program runs.
+  std::unique_ptr<IndirectStubsManager> StubsMgr;
+
+  // When set, materialization tasks (optimizing, compiling and linking a
+  // module) run here instead of on the thread that asked for the symbol.
+  std::unique_ptr<ThreadPool> CompileThreads;
 
   JITDylib &MainJD;
 
+  static void handleLazyCallThroughError() {
+    errs() << "LazyCallThrough error: Could not find function body\n";
+    exit(1);
+  }
+
 public:
   KaleidoscopeJIT(std::unique_ptr<ExecutionSession> ES,
-                  JITTargetMachineBuilder JTMB, DataLayout DL)
+                  JITTargetMachineBuilder JTMB, DataLayout DL,
+                  std::unique_ptr<jitlink::JITLinkMemoryManager> MemMgr,
+                  std::unique_ptr<LazyCallThroughManager> LCTMgr,
+                  bool Lazy = false, unsigned NumCompileThreads = 0,
+                  ObjectCache *ObjCache = nullptr)
       : ES(std::move(ES)), DL(std::move(DL)), Mangle(*this->ES, this->DL),
-        ObjectLayer(*this->ES,
-                    []() { return std::make_unique<SectionMemoryManager>(); }),
+        JTMB(std::move(JTMB)),
+        ObjectLayer(*this->ES, std::move(MemMgr)),
         CompileLayer(*this->ES, ObjectLayer,
-                     std::make_unique<ConcurrentIRCompiler>(std::move(JTMB))),
+                     std::make_unique<ConcurrentIRCompiler>(this->JTMB,
+                                                            ObjCache)),
+        OptimizeLayer(*this->ES, CompileLayer), LCTMgr(std::move(LCTMgr)),
+        StubsMgr(createLocalIndirectStubsManagerBuilder(
+            this->JTMB.getTargetTriple())()),
         MainJD(this->ES->createBareJITDylib("<main>")) {
+    ObjectLayer.addPlugin(std::make_unique<EHFrameRegistrationPlugin>(
+        *this->ES, std::make_unique<jitlink::InProcessEHFrameRegistrar>()));
+    if (NumCompileThreads > 0) {
+      CompileThreads = std::make_unique<ThreadPool>(
+          hardware_concurrency(NumCompileThreads));
+      this->ES->setDispatchTask([this](std::unique_ptr<Task> T) {
+        // FIXME: ThreadPool::async wants a copyable function, so smuggle the
+        // task through as a raw pointer.
+        auto *UnownedT = T.release();
+        CompileThreads->async([UnownedT]() {
+          std::unique_ptr<Task> T(UnownedT);
+          T->run();
+        });
+      });
+    }
+    if (Lazy) {
+      CODLayer = std::make_unique<CompileOnDemandLayer>(
+          *this->ES, OptimizeLayer, *this->LCTMgr,
+          createLocalIndirectStubsManagerBuilder(
+              this->ES->getExecutorProcessControl().getTargetTriple()));
+      // One function per partition, so only what gets called gets compiled.
+      CODLayer->setPartitionFunction(CompileOnDemandLayer::compileRequested);
+    }
     MainJD.addGenerator(
         cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
             DL.getGlobalPrefix())));
-    if (JTMB.getTargetTriple().isOSBinFormatCOFF()) {
+    if (this->JTMB.getTargetTriple().isOSBinFormatCOFF()) {
       ObjectLayer.setOverrideObjectFlagsWithResponsibilityFlags(true);
       ObjectLayer.setAutoClaimResponsibilityForObjectSymbols(true);
     }
   }
 
   ~KaleidoscopeJIT() {
+    if (CompileThreads)
+      CompileThreads->wait();
     if (auto Err = ES->endSession())
       ES->reportError(std::move(Err));
   }
 
-  static Expected<std::unique_ptr<KaleidoscopeJIT>> Create() {
+  static Expected<std::unique_ptr<KaleidoscopeJIT>>
+  Create(CodeGenOpt::Level CGOptLevel = CodeGenOpt::Default,
+         bool Lazy = false, unsigned NumCompileThreads = 0,
+         ObjectCache *ObjCache = nullptr, bool HugePages = false) {
     auto EPC = SelfExecutorProcessControl::Create();
     if (!EPC)
       return EPC.takeError();
@@ -74,23 +137,111 @@ public:
 
     JITTargetMachineBuilder JTMB(
         ES->getExecutorProcessControl().getTargetTriple());
+    JTMB.setCodeGenOptLevel(CGOptLevel);
+
+    // JITLink places code anywhere in our slabs and reaches other modules and
+    // the host through its own GOT and stubs, so emit small-model PIC.
+    JTMB.setRelocationModel(Reloc::PIC_);
+    JTMB.setCodeModel(CodeModel::Small);
+
+    auto MemMgr = SlabMemoryManager::Create(HugePages);
+    if (!MemMgr)
+      return MemMgr.takeError();
 
     auto DL = JTMB.getDefaultDataLayoutForTarget();
     if (!DL)
       return DL.takeError();
 
+    auto LCTMgr = createLocalLazyCallThroughManager(
+        JTMB.getTargetTriple(), *ES,
+        pointerToJITTargetAddress(&handleLazyCallThroughError));
+    if (!LCTMgr)
+      return LCTMgr.takeError();
+
     return std::make_unique<KaleidoscopeJIT>(std::move(ES), std::move(JTMB),
-                                             std::move(*DL));
+                                             std::move(*DL), std::move(*MemMgr),
+                                             std::move(*LCTMgr), Lazy,
+                                             NumCompileThreads, ObjCache);
   }
 
   const DataLayout &getDataLayout() const { return DL; }
 
   JITDylib &getMainJITDylib() { return MainJD; }
 
-  Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
+  /// The builder the JIT's own compiler was made from. Copy it to compile
+  /// code out of band, e.g. at a different CodeGenOpt level.
+  const JITTargetMachineBuilder &getTargetMachineBuilder() const {
+    return JTMB;
+  }
+
+  /// Modules pass through this layer before being compiled, install the IR
+  /// optimization pipeline here with setTransform.
+  IRTransformLayer &getIRTransformLayer() { return OptimizeLayer; }
+
+  bool isLazy() const { return CODLayer != nullptr; }
+
+  /// Add a module. In lazy mode its functions are compiled on first call,
+  /// unless Eager is set (e.g. for code that is about to be run anyway).
+  Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr,
+                  bool Eager = false) {
     if (!RT)
       RT = MainJD.getDefaultResourceTracker();
-    return CompileLayer.add(RT, std::move(TSM));
+    if (CODLayer && !Eager)
+      return CODLayer->add(RT, std::move(TSM));
+    return OptimizeLayer.add(RT, std::move(TSM));
+  }
+
+  /// Add an already compiled object file, skipping the IR layers.
+  Error addObject(std::unique_ptr<MemoryBuffer> Obj,
+                  ResourceTrackerSP RT = nullptr) {
+    if (!RT)
+      RT = MainJD.getDefaultResourceTracker();
+    return ObjectLayer.add(RT, std::move(Obj));
+  }
+
+  /// Define Name in the main dylib as a fixed address in this process.
+  Error defineAbsolute(StringRef Name, JITTargetAddress Addr) {
+    return MainJD.define(absoluteSymbols(
+        {{Mangle(Name.str()),
+          JITEvaluatedSymbol(Addr, JITSymbolFlags::Exported)}}));
+  }
+
+  /// Define Name in the main dylib as an indirect stub that jumps to Target.
+  /// Callers link against the stub, so updateStub redirects all of them.
+  Error addStub(StringRef Name, JITTargetAddress Target) {
+    if (auto Err = StubsMgr->createStub(Name, Target,
+                                        JITSymbolFlags::Exported |
+                                            JITSymbolFlags::Callable))
+      return Err;
+    auto Stub = StubsMgr->findStub(Name, true);
+    return MainJD.define(absoluteSymbols({{Mangle(Name.str()), Stub}}));
+  }
+
+  /// Point the stub for Name at a trampoline that looks up Body, which
+  /// compiles it, on the first call and then points the stub at Body itself.
+  /// Nothing Body refers to has to exist until then, so functions can call
+  /// ones that are only defined later. Also used to redirect an existing stub.
+  Error addLazyStub(StringRef Name, StringRef Body) {
+    auto Trampoline = LCTMgr->getCallThroughTrampoline(
+        MainJD, Mangle(Body.str()),
+        [this, Name = Name.str()](JITTargetAddress Addr) {
+          return updateStub(Name, Addr);
+        });
+    if (!Trampoline)
+      return Trampoline.takeError();
+    if (hasStub(Name))
+      return updateStub(Name, *Trampoline);
+    return addStub(Name, *Trampoline);
+  }
+
+  /// Point the stub for Name at a new body. The pointer swap is atomic, a
+  /// call in flight finishes in whichever body it entered.
+  Error updateStub(StringRef Name, JITTargetAddress Target) {
+    return StubsMgr->updatePointer(Name, Target);
+  }
+
+  bool hasStub(StringRef Name) {
+    return static_cast<bool>(StubsMgr->findStub(Name, true));
   }
 
   Expected<JITEvaluatedSymbol> lookup(StringRef Name) {
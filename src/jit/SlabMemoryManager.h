@@ -0,0 +1,370 @@
+//===- SlabMemoryManager.h - Pooled JITLink memory for Kaleidoscope -------===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// A JITLinkMemoryManager that packs many small link graphs onto shared pages.
+//
+// Each slab is one shared memory object mapped twice: a read/write "working"
+// view that JITLink writes content into, and an "executor" view where every
+// page carries the final protection of whatever lives on it. Pages are handed
+// out per protection class (code, read-only data, read/write data) and carved
+// up with a first-fit free list, so a REPL's worth of tiny modules shares a
+// handful of code pages instead of getting a fresh mapping each. Code pages
+// never become writable in the executor view, even while new code is linked
+// onto them.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_EXECUTIONENGINE_ORC_SLABMEMORYMANAGER_H
+#define LLVM_EXECUTIONENGINE_ORC_SLABMEMORYMANAGER_H
+
+#include "llvm/ExecutionEngine/JITLink/JITLink.h"
+#include "llvm/ExecutionEngine/JITLink/JITLinkMemoryManager.h"
+#include "llvm/ExecutionEngine/Orc/Shared/AllocationActions.h"
+#include "llvm/Support/Memory.h"
+#include "llvm/Support/Process.h"
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace llvm {
+namespace orc {
+
+class SlabMemoryManager : public jitlink::JITLinkMemoryManager {
+private:
+  static constexpr uint64_t HugePageSize = 2 * 1024 * 1024;
+  static constexpr unsigned NumProtClasses = 8; // All R/W/X combinations.
+
+  struct Slab {
+    int FD = -1;
+    char *WorkingBase = nullptr;
+    char *ExecBase = nullptr;
+    uint64_t Size = 0;
+    uint64_t NextFreshPage = 0;
+    // Free ranges (offset -> size) of pages already given to each class.
+    std::map<uint64_t, uint64_t> Free[NumProtClasses];
+  };
+
+  struct Range {
+    Slab *S;
+    unsigned Prot;
+    uint64_t Offset;
+    uint64_t Size;
+  };
+
+  struct FinalizedAllocInfo {
+    std::vector<Range> Ranges;
+    std::vector<shared::WrapperFunctionCall> DeallocActions;
+  };
+
+  class SlabInFlightAlloc : public InFlightAlloc {
+  public:
+    SlabInFlightAlloc(SlabMemoryManager &MemMgr, jitlink::LinkGraph &G,
+                      jitlink::BasicLayout BL, std::vector<Range> Standard,
+                      std::vector<Range> Finalize)
+        : MemMgr(MemMgr), G(G), BL(std::move(BL)),
+          Standard(std::move(Standard)), Finalize(std::move(Finalize)) {}
+
+    void finalize(OnFinalizedFunction OnFinalized) override {
+      // Content is already in place: both views share the same pages.
+      for (auto &R : Standard)
+        if (R.Prot & unsigned(jitlink::MemProt::Exec))
+          sys::Memory::InvalidateInstructionCache(R.S->ExecBase + R.Offset,
+                                                  R.Size);
+
+      auto DeallocActions = shared::runFinalizeActions(G.allocActions());
+      if (!DeallocActions) {
+        OnFinalized(DeallocActions.takeError());
+        return;
+      }
+
+      MemMgr.release(Finalize);
+
+      auto *Info = new FinalizedAllocInfo();
+      Info->Ranges = std::move(Standard);
+      Info->DeallocActions = std::move(*DeallocActions);
+      OnFinalized(FinalizedAlloc(ExecutorAddr::fromPtr(Info)));
+    }
+
+    void abandon(OnAbandonedFunction OnAbandoned) override {
+      MemMgr.release(Standard);
+      MemMgr.release(Finalize);
+      OnAbandoned(Error::success());
+    }
+
+  private:
+    SlabMemoryManager &MemMgr;
+    jitlink::LinkGraph &G;
+    jitlink::BasicLayout BL;
+    std::vector<Range> Standard;
+    std::vector<Range> Finalize;
+  };
+
+  std::mutex SlabsMutex;
+  std::vector<std::unique_ptr<Slab>> Slabs;
+  uint64_t PageSize;
+  uint64_t SlabSize;
+  bool HugeTLB;
+
+  SlabMemoryManager(uint64_t PageSize, uint64_t SlabSize, bool HugeTLB)
+      : PageSize(PageSize), SlabSize(SlabSize), HugeTLB(HugeTLB) {}
+
+  Expected<Slab *> createSlab(uint64_t MinSize) {
+    auto S = std::make_unique<Slab>();
+    S->Size = alignTo(std::max(SlabSize, MinSize), PageSize);
+
+    unsigned Flags = MFD_CLOEXEC;
+    if (HugeTLB)
+      Flags |= MFD_HUGETLB;
+    S->FD = memfd_create("kaleidoscope-jit", Flags);
+    if (S->FD < 0)
+      return errorCodeToError(std::error_code(errno, std::generic_category()));
+    if (ftruncate(S->FD, S->Size) != 0) {
+      std::error_code EC(errno, std::generic_category());
+      close(S->FD);
+      return errorCodeToError(EC);
+    }
+
+    void *Working = mmap(nullptr, S->Size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         S->FD, 0);
+    void *Exec = mmap(nullptr, S->Size, PROT_NONE, MAP_SHARED, S->FD, 0);
+    if (Working == MAP_FAILED || Exec == MAP_FAILED) {
+      std::error_code EC(errno, std::generic_category());
+      if (Working != MAP_FAILED)
+        munmap(Working, S->Size);
+      if (Exec != MAP_FAILED)
+        munmap(Exec, S->Size);
+      close(S->FD);
+      return errorCodeToError(EC);
+    }
+
+    // Without hugetlbfs, ask for transparent huge pages instead. Best effort.
+    if (PageSize == HugePageSize && !HugeTLB) {
+      madvise(Working, S->Size, MADV_HUGEPAGE);
+      madvise(Exec, S->Size, MADV_HUGEPAGE);
+    }
+
+    S->WorkingBase = static_cast<char *>(Working);
+    S->ExecBase = static_cast<char *>(Exec);
+    Slabs.push_back(std::move(S));
+    return Slabs.back().get();
+  }
+
+  static void insertFree(std::map<uint64_t, uint64_t> &Free, uint64_t Offset,
+                         uint64_t Size) {
+    auto Next = Free.lower_bound(Offset);
+    if (Next != Free.end() && Offset + Size == Next->first) {
+      Size += Next->second;
+      Next = Free.erase(Next);
+    }
+    if (Next != Free.begin()) {
+      auto Prev = std::prev(Next);
+      if (Prev->first + Prev->second == Offset) {
+        Prev->second += Size;
+        return;
+      }
+    }
+    Free[Offset] = Size;
+  }
+
+  static bool takeFree(std::map<uint64_t, uint64_t> &Free, uint64_t Size,
+                       uint64_t Alignment, uint64_t &Offset) {
+    for (auto It = Free.begin(); It != Free.end(); ++It) {
+      uint64_t Start = alignTo(It->first, Alignment);
+      uint64_t End = It->first + It->second;
+      if (Start + Size > End)
+        continue;
+
+      uint64_t FreeStart = It->first;
+      Free.erase(It);
+      if (Start > FreeStart)
+        insertFree(Free, FreeStart, Start - FreeStart);
+      if (Start + Size < End)
+        insertFree(Free, Start + Size, End - (Start + Size));
+      Offset = Start;
+      return true;
+    }
+    return false;
+  }
+
+  // Carve Size bytes for Prot out of S, handing fresh pages to the class when
+  // its free list can't satisfy the request.
+  bool allocFromSlab(Slab &S, unsigned Prot, uint64_t Size, uint64_t Alignment,
+                     uint64_t &Offset) {
+    auto &Free = S.Free[Prot];
+    if (takeFree(Free, Size, Alignment, Offset))
+      return true;
+
+    uint64_t FreshSize = alignTo(Size + Alignment, PageSize);
+    if (S.NextFreshPage + FreshSize > S.Size)
+      return false;
+
+    auto SysProt = jitlink::toSysMemoryProtectionFlags(jitlink::MemProt(Prot));
+    if (mprotect(S.ExecBase + S.NextFreshPage, FreshSize,
+                 ((SysProt & sys::Memory::MF_READ) ? PROT_READ : 0) |
+                     ((SysProt & sys::Memory::MF_WRITE) ? PROT_WRITE : 0) |
+                     ((SysProt & sys::Memory::MF_EXEC) ? PROT_EXEC : 0)) != 0)
+      return false;
+
+    insertFree(Free, S.NextFreshPage, FreshSize);
+    S.NextFreshPage += FreshSize;
+    return takeFree(Free, Size, Alignment, Offset);
+  }
+
+  void release(std::vector<Range> &Ranges) {
+    std::lock_guard<std::mutex> Lock(SlabsMutex);
+    for (auto &R : Ranges)
+      insertFree(R.S->Free[R.Prot], R.Offset, R.Size);
+    Ranges.clear();
+  }
+
+public:
+  /// Create a memory manager. With HugePages, pages are handed out in 2Mb
+  /// chunks backed by hugetlbfs if possible, transparent huge pages otherwise.
+  static Expected<std::unique_ptr<SlabMemoryManager>>
+  Create(bool HugePages = false, uint64_t SlabSize = 1ULL << 30) {
+    uint64_t PageSize = sys::Process::getPageSizeEstimate();
+    bool HugeTLB = false;
+
+    if (HugePages) {
+      PageSize = HugePageSize;
+      // hugetlbfs pages are reserved up front, so keep those slabs small.
+      int FD = memfd_create("kaleidoscope-jit-probe", MFD_CLOEXEC | MFD_HUGETLB);
+      if (FD >= 0) {
+        if (ftruncate(FD, HugePageSize) == 0) {
+          void *Probe = mmap(nullptr, HugePageSize, PROT_READ | PROT_WRITE,
+                             MAP_SHARED, FD, 0);
+          if (Probe != MAP_FAILED) {
+            HugeTLB = true;
+            munmap(Probe, HugePageSize);
+          }
+        }
+        close(FD);
+      }
+      if (HugeTLB)
+        SlabSize = 16 * HugePageSize;
+    }
+
+    std::unique_ptr<SlabMemoryManager> MemMgr(
+        new SlabMemoryManager(PageSize, SlabSize, HugeTLB));
+    return MemMgr;
+  }
+
+  ~SlabMemoryManager() {
+    for (auto &S : Slabs) {
+      munmap(S->WorkingBase, S->Size);
+      munmap(S->ExecBase, S->Size);
+      close(S->FD);
+    }
+  }
+
+  using JITLinkMemoryManager::allocate;
+  using JITLinkMemoryManager::deallocate;
+
+  void allocate(const jitlink::JITLinkDylib *, jitlink::LinkGraph &G,
+                OnAllocatedFunction OnAllocated) override {
+    jitlink::BasicLayout BL(G);
+
+    std::vector<Range> Standard, Finalize;
+    {
+      std::lock_guard<std::mutex> Lock(SlabsMutex);
+
+      // Keep the whole graph in one slab so every segment stays in range of
+      // the others.
+      auto TryAllocate = [&](Slab &S) {
+        for (auto &KV : BL.segments()) {
+          auto &AG = KV.first;
+          auto &Seg = KV.second;
+          unsigned Prot = unsigned(AG.getMemProt());
+          uint64_t Size = std::max<uint64_t>(Seg.ContentSize + Seg.ZeroFillSize, 1);
+          uint64_t Offset;
+          if (!allocFromSlab(S, Prot, Size, Seg.Alignment.value(), Offset))
+            return false;
+
+          auto &Ranges =
+              AG.getMemDeallocPolicy() == jitlink::MemDeallocPolicy::Standard
+                  ? Standard
+                  : Finalize;
+          Ranges.push_back({&S, Prot, Offset, Size});
+
+          // Freed ranges get reused, so zero what we hand out.
+          memset(S.WorkingBase + Offset, 0, Size);
+          Seg.WorkingMem = S.WorkingBase + Offset;
+          Seg.Addr = ExecutorAddr::fromPtr(S.ExecBase + Offset);
+        }
+        return true;
+      };
+
+      auto Rollback = [&]() {
+        for (auto *Ranges : {&Standard, &Finalize}) {
+          for (auto &R : *Ranges)
+            insertFree(R.S->Free[R.Prot], R.Offset, R.Size);
+          Ranges->clear();
+        }
+      };
+
+      bool Allocated = false;
+      for (auto &S : Slabs) {
+        if ((Allocated = TryAllocate(*S)))
+          break;
+        Rollback();
+      }
+
+      if (!Allocated) {
+        uint64_t Needed = 0;
+        for (auto &KV : BL.segments())
+          Needed += alignTo(KV.second.ContentSize + KV.second.ZeroFillSize +
+                                KV.second.Alignment.value(),
+                            PageSize);
+        auto S = createSlab(Needed);
+        if (!S) {
+          OnAllocated(S.takeError());
+          return;
+        }
+        if (!TryAllocate(**S)) {
+          Rollback();
+          OnAllocated(make_error<StringError>(
+              "Could not fit link graph in a fresh slab",
+              inconvertibleErrorCode()));
+          return;
+        }
+      }
+    }
+
+    if (auto Err = BL.apply()) {
+      release(Standard);
+      release(Finalize);
+      OnAllocated(std::move(Err));
+      return;
+    }
+
+    OnAllocated(std::make_unique<SlabInFlightAlloc>(
+        *this, G, std::move(BL), std::move(Standard), std::move(Finalize)));
+  }
+
+  void deallocate(std::vector<FinalizedAlloc> Allocs,
+                  OnDeallocatedFunction OnDeallocated) override {
+    Error Err = Error::success();
+    for (auto &Alloc : Allocs) {
+      auto *Info = Alloc.release().toPtr<FinalizedAllocInfo *>();
+      Err = joinErrors(std::move(Err),
+                       shared::runDeallocActions(Info->DeallocActions));
+      release(Info->Ranges);
+      delete Info;
+    }
+    OnDeallocated(std::move(Err));
+  }
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif // LLVM_EXECUTIONENGINE_ORC_SLABMEMORYMANAGER_H
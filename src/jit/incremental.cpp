@@ -0,0 +1,163 @@
+#pragma once
+// NOTE(srp): Still not final platform-independent code
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+#include "../platform/typedefs/typedefs.hpp"
+#include "../platform/llvm/llvm_include.hpp"
+#include "../ast/ast.cpp"
+
+// NOTE(srp): Incremental redefinition. Every function gets its own module and
+// resource tracker, and everyone calls it through a stub named after it. A def
+// that comes again unchanged (same tokens) is skipped before codegen, a
+// changed one is compiled on its own and the stub is pointed at the new body.
+// Callers were linked against the stub, so they pick it up without being
+// recompiled. Unless the signature changed: then they'd pass and read the
+// wrong types, so their stubs are pointed at a body that says they must be
+// redefined.
+
+/// IncrementalJIT - Turned on with --incremental (or --watch).
+global_variable bool32 IncrementalJIT = false;
+
+/// FunctionRecord - What's currently behind the stub for a function.
+struct FunctionRecord
+{
+    uint64 Hash;                 // FunctionAST::getHash of the def, 0 if stale
+    std::string Signature;       // The body's llvm::FunctionType, printed
+    uint32 Version;              // The body is "<name>.v<Version>"
+    std::vector<Symbol> Callees; // Call graph edges out of this function
+    llvmo::ResourceTrackerSP RT;
+};
+
+global_variable SymbolMap<std::unique_ptr<FunctionRecord>> IncrementalFunctions;
+
+/// IsUnchanged - Whether Fn is exactly the definition that's compiled already.
+internal bool32
+IsUnchanged(const FunctionAST &Fn)
+{
+    std::unique_ptr<FunctionRecord> *Record = IncrementalFunctions.find(Fn.getName());
+    return Record && (*Record)->Hash == Fn.getHash();
+}
+
+/// GetSignature - F's type as text, comparable across contexts.
+internal std::string
+GetSignature(llvm::Function *F)
+{
+    std::string Signature;
+    llvm::raw_string_ostream OS(Signature);
+    F->getFunctionType()->print(OS);
+    return OS.str();
+}
+
+/// EmitStaleBody - A module with just BodyName, which reports that Name must
+/// be redefined and exits.
+internal llvmo::ThreadSafeModule
+EmitStaleBody(llvm::StringRef Name, llvm::StringRef BodyName)
+{
+    auto Context = std::make_unique<llvm::LLVMContext>();
+    auto M = std::make_unique<llvm::Module>(BodyName, *Context);
+    M->setDataLayout(TheJIT->getDataLayout());
+
+    llvm::IRBuilder<> B(*Context);
+    llvm::FunctionCallee Error = M->getOrInsertFunction(
+            "ks_stale_function_error", llvm::FunctionType::get(B.getVoidTy(), {B.getInt8PtrTy()}, false));
+
+    // Nothing is passed on or returned, so the signature doesn't matter.
+    llvm::Function *F = llvm::Function::Create(llvm::FunctionType::get(B.getVoidTy(), false),
+                                               llvm::Function::ExternalLinkage, BodyName, *M);
+    B.SetInsertPoint(llvm::BasicBlock::Create(*Context, "entry", F));
+    llvm::CallInst *Call = B.CreateCall(Error, {B.CreateGlobalStringPtr(Name)});
+    Call->setDoesNotReturn();
+    B.CreateUnreachable();
+
+    return llvmo::ThreadSafeModule(std::move(M), std::move(Context));
+}
+
+/// InvalidateCallers - Callers of Name were compiled against its old signature.
+/// Mark them stale so they're recompiled the next time they're defined, even
+/// if their text didn't change, and until then have them report it instead
+/// of running.
+internal void
+InvalidateCallers(Symbol Name)
+{
+    std::string Callers;
+    for (Symbol Caller : IncrementalFunctions.Bound)
+    {
+        FunctionRecord *Record = IncrementalFunctions.find(Caller)->get();
+        if (Caller == Name || Record->Hash == 0 || !llvm::is_contained(Record->Callees, Name))
+        {
+            continue;
+        }
+
+        std::string BodyName = SymbolName(Caller).str() + ".v" + std::to_string(++Record->Version);
+        llvmo::ResourceTrackerSP RT = TheJIT->getMainJITDylib().createResourceTracker();
+        ExitOnErr(TheJIT->addModule(EmitStaleBody(SymbolName(Caller), BodyName), RT, true));
+        ExitOnErr(TheJIT->addLazyStub(SymbolName(Caller), BodyName));
+        ExitOnErr(Record->RT->remove());
+
+        Record->Hash = 0;
+        Record->RT = std::move(RT);
+        Callers += ' ';
+        Callers += SymbolName(Caller).str();
+    }
+
+    if (!Callers.empty())
+    {
+        fprintf(stderr, "Warning: %s changed its signature, these must be redefined:%s\n",
+                SymbolName(Name).str().c_str(), Callers.c_str());
+    }
+}
+
+/// AddIncrementalModule - Hand over the module holding F, the new definition of
+/// Name, and make Name's stub jump to it. The old body is freed, the new one is
+/// compiled on the first call, so it may call functions defined after it.
+internal void
+AddIncrementalModule(llvmo::ThreadSafeModule TSM, llvm::Function *F, const FunctionAST &Fn)
+{
+    Symbol Name = Fn.getName();
+    std::unique_ptr<FunctionRecord> &Record = IncrementalFunctions[Name];
+    bool32 Redefined = (Record != nullptr);
+    if (!Redefined)
+    {
+        Record = std::make_unique<FunctionRecord>();
+        Record->Version = 0;
+    }
+    else
+    {
+        ++Record->Version;
+    }
+
+    // The plain name belongs to the stub, the body gets a versioned one.
+    std::string BodyName = SymbolName(Name).str() + ".v" + std::to_string(Record->Version);
+    std::string Signature;
+    TSM.withModuleDo([&](llvm::Module &)
+    {
+        F->setName(BodyName);
+        Signature = GetSignature(F);
+    });
+
+    llvmo::ResourceTrackerSP RT = TheJIT->getMainJITDylib().createResourceTracker();
+    ExitOnErr(TheJIT->addModule(std::move(TSM), RT, true));
+    ExitOnErr(TheJIT->addLazyStub(SymbolName(Name), BodyName));
+
+    if (Redefined)
+    {
+        // Nothing is running between top-level items, so the old body can go
+        // as soon as nobody jumps to it.
+        ExitOnErr(Record->RT->remove());
+    }
+
+    if (Redefined && Record->Signature != Signature)
+    {
+        InvalidateCallers(Name);
+    }
+
+    Record->Hash = Fn.getHash();
+    Record->Signature = std::move(Signature);
+    Record->Callees = Fn.getCallees();
+    llvm::sort(Record->Callees);
+    Record->Callees.erase(std::unique(Record->Callees.begin(), Record->Callees.end()), Record->Callees.end());
+    Record->RT = std::move(RT);
+}
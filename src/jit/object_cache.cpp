@@ -0,0 +1,149 @@
+#pragma once
+// NOTE(srp): Still not final platform-independent code
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "../platform/typedefs/typedefs.hpp"
+#include "../platform/llvm/llvm_include.hpp"
+
+/// KaleidoscopeObjectCache - Keeps compiled objects on disk so warm runs only
+/// have to link. Objects are named by a hash of the module's bitcode as it was
+/// emitted, before the optimizer, plus a tag naming everything else that
+/// changes the output (target triple, opt levels). So a hit skips optimizing
+/// the module as well as compiling it.
+class KaleidoscopeObjectCache : public llvm::ObjectCache
+{
+    struct Entry
+    {
+        std::string Key;
+        std::unique_ptr<llvm::MemoryBuffer> Object;
+    };
+
+    std::string Dir;
+    std::string Tag;
+
+    // lookup hashes the module and loads the object, getObject hands it over
+    // or, on a miss, leaves the key for notifyObjectCompiled. Compile threads
+    // can be at all three at once.
+    std::mutex Mutex;
+    std::map<const llvm::Module*, Entry> Entries;
+
+    std::string
+    getKey(const llvm::Module &M)
+    {
+        llvm::SmallVector<char, 0> Bitcode;
+        llvm::raw_svector_ostream OS(Bitcode);
+        llvm::WriteBitcodeToFile(M, OS);
+
+        llvm::SHA1 Hash;
+        Hash.update(Tag);
+        Hash.update(llvm::StringRef(Bitcode.data(), Bitcode.size()));
+        return llvm::toHex(Hash.final(), true);
+    }
+
+    std::string
+    getPath(const std::string &Key)
+    {
+        return Dir + "/" + Key + ".o";
+    }
+
+    public:
+        KaleidoscopeObjectCache(const std::string &Dir, const std::string &Tag)
+            : Dir(Dir), Tag(Tag) {}
+
+        /// lookup - Called with the module before it's optimized, true if its
+        /// object is cached. Then the optimizer can be skipped, getObject will
+        /// hand over that object when the module gets to the compiler.
+        bool32
+        lookup(const llvm::Module &M)
+        {
+            Entry E;
+            E.Key = getKey(M);
+
+            auto Buffer = llvm::MemoryBuffer::getFile(getPath(E.Key));
+            if (Buffer)
+            {
+                E.Object = std::move(*Buffer);
+            }
+            bool32 Hit = (E.Object != nullptr);
+
+            std::lock_guard<std::mutex> Lock(Mutex);
+            Entries[&M] = std::move(E);
+            return Hit;
+        }
+
+        std::unique_ptr<llvm::MemoryBuffer>
+        getObject(const llvm::Module *M) override
+        {
+            std::lock_guard<std::mutex> Lock(Mutex);
+            auto It = Entries.find(M);
+            if (It == Entries.end() || !It->second.Object)
+            {
+                // Miss (or never looked up, then it isn't stored either), the
+                // compiler will hand us the object once it's done.
+                return nullptr;
+            }
+
+            std::unique_ptr<llvm::MemoryBuffer> Object = std::move(It->second.Object);
+            Entries.erase(It);
+            return Object;
+        }
+
+        void
+        notifyObjectCompiled(const llvm::Module *M, llvm::MemoryBufferRef Obj) override
+        {
+            std::string Key;
+            {
+                std::lock_guard<std::mutex> Lock(Mutex);
+                auto It = Entries.find(M);
+                if (It == Entries.end())
+                {
+                    return;
+                }
+                Key = std::move(It->second.Key);
+                Entries.erase(It);
+            }
+
+            if (std::error_code EC = llvm::sys::fs::create_directories(Dir))
+            {
+                fprintf(stderr, "Object cache: could not create %s: %s\n", Dir.c_str(), EC.message().c_str());
+                return;
+            }
+
+            // Write next to the final name and rename, another run may be
+            // reading the same entry.
+            llvm::SmallString<128> TmpPath;
+            int32 FD;
+            if (llvm::sys::fs::createUniqueFile(getPath(Key) + ".tmp%%%%%%", FD, TmpPath))
+            {
+                return;
+            }
+
+            {
+                llvm::raw_fd_ostream Out(FD, true);
+                Out << Obj.getBuffer();
+            }
+
+            if (llvm::sys::fs::rename(TmpPath, getPath(Key)))
+            {
+                llvm::sys::fs::remove(TmpPath);
+            }
+        }
+};
+
+/// ObjectCacheDir - Where compiled objects are kept (--cache-dir), no caching
+/// when empty.
+global_variable std::string ObjectCacheDir;
+global_variable std::unique_ptr<KaleidoscopeObjectCache> TheObjectCache;
+
+/// GetObjectCacheTag - Everything besides the IR that decides what object a
+/// module compiles to. The JIT always emits small code model PIC.
+internal std::string
+GetObjectCacheTag(llvm::OptimizationLevel Level, llvm::CodeGenOpt::Level CodeGenLevel)
+{
+    return llvm::sys::getProcessTriple() + " pic small" +
+           " -O" + std::to_string(Level.getSpeedupLevel()) +
+           " codegen" + std::to_string((int32)CodeGenLevel);
+}
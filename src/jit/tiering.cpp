@@ -0,0 +1,290 @@
+#pragma once
+// NOTE(srp): Still not final platform-independent code
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "../platform/typedefs/typedefs.hpp"
+#include "../platform/llvm/llvm_include.hpp"
+#include "../optimizer/optimizer.cpp"
+#include "./object_cache.cpp"
+
+// NOTE(srp): Tiered compilation. Every function is compiled at -O0 first and
+// called through an indirect stub. The baseline code counts calls and loop
+// back-edges, once a function gets hot it's recompiled at TierUpOptLevel on a
+// background thread and the stub is pointed at the new body.
+
+/// TieredJIT - Turned on with --tiered.
+global_variable bool32 TieredJIT = false;
+
+/// TierUpThreshold - Calls plus back-edges taken before a function is hot.
+global_variable uint64 TierUpThreshold = 1000;
+
+global_variable llvm::OptimizationLevel TierUpOptLevel = llvm::OptimizationLevel::O3;
+
+/// TierInfo - What the background thread needs to recompile a function. The
+/// baseline code bumps Counter through the "<name>.tier" symbol, so it must
+/// stay the first member.
+struct TierInfo
+{
+    uint64 Counter;
+    std::string Name;
+    llvm::SmallVector<char, 0> Bitcode; // The module before instrumentation
+    llvmo::ResourceTrackerSP BaselineRT;
+    llvmo::ResourceTrackerSP OptimizedRT;
+};
+
+/// TierUpQueue - Hot functions waiting for the background thread.
+struct TierUpQueue
+{
+    std::mutex Mutex;
+    std::condition_variable Wake;
+    std::deque<TierInfo*> Pending;
+    bool32 Quit;
+    std::thread Worker;
+};
+
+global_variable std::map<std::string, std::unique_ptr<TierInfo>> TieredFunctions;
+global_variable TierUpQueue TheTierUpQueue;
+
+// Top tier objects are built at other opt levels than the baseline, so they
+// get their own cache tag.
+global_variable std::unique_ptr<KaleidoscopeObjectCache> TheTierUpObjectCache;
+
+/// __kaleidoscope_tier_up - Called from baseline code the moment its counter
+/// reaches the threshold. Only queues the work, the caller keeps running.
+extern "C" void
+__kaleidoscope_tier_up(void *Info)
+{
+    {
+        std::lock_guard<std::mutex> Lock(TheTierUpQueue.Mutex);
+        TheTierUpQueue.Pending.push_back((TierInfo*)Info);
+    }
+    TheTierUpQueue.Wake.notify_one();
+}
+
+/// EmitTierCounter - Bump the counter right before Before and call into the
+/// runtime when it hits the threshold.
+internal void
+EmitTierCounter(llvm::Instruction *Before, llvm::GlobalVariable *Counter)
+{
+    llvm::Module *M = Before->getModule();
+    llvm::IRBuilder<> B(Before);
+    B.SetCurrentDebugLocation(Before->getDebugLoc());
+
+    llvm::Type *Int64Ty = B.getInt64Ty();
+    llvm::Value *Count = B.CreateAdd(B.CreateLoad(Int64Ty, Counter, "tiercount"), B.getInt64(1), "tiercount");
+    B.CreateStore(Count, Counter);
+
+    // Exactly equal, so each function is queued once.
+    llvm::Value *IsHot = B.CreateICmpEQ(Count, B.getInt64(TierUpThreshold), "tierhot");
+    llvm::Instruction *ThenTerm = llvm::SplitBlockAndInsertIfThen(IsHot, Before, false);
+
+    llvm::FunctionCallee TierUp = M->getOrInsertFunction(
+            "__kaleidoscope_tier_up", B.getVoidTy(), Counter->getType());
+    B.SetInsertPoint(ThenTerm);
+    B.CreateCall(TierUp, {Counter});
+}
+
+/// InstrumentForTiering - Count entries to F and every back-edge inside it.
+internal void
+InstrumentForTiering(llvm::Function &F, llvm::GlobalVariable *Counter)
+{
+    std::vector<llvm::Instruction*> CountBefore;
+
+    // Leave the allocas at the top of the entry block so they can still be
+    // promoted.
+    for (llvm::Instruction &I : F.getEntryBlock())
+    {
+        if (!llvm::isa<llvm::AllocaInst>(I))
+        {
+            CountBefore.push_back(&I);
+            break;
+        }
+    }
+
+    // A back-edge jumps to a block that dominates it. Collect them all before
+    // splitting anything, that invalidates the tree.
+    llvm::DominatorTree DT(F);
+    for (llvm::BasicBlock &BB : F)
+    {
+        for (llvm::BasicBlock *Succ : llvm::successors(&BB))
+        {
+            if (DT.dominates(Succ, &BB))
+            {
+                CountBefore.push_back(BB.getTerminator());
+                break;
+            }
+        }
+    }
+
+    for (llvm::Instruction *I : CountBefore)
+    {
+        EmitTierCounter(I, Counter);
+    }
+}
+
+/// AddTieredModule - Hand over the module holding F and install the stub that
+/// everyone will call it through. The baseline is compiled on the first call,
+/// by then whatever F calls has been defined too.
+internal void
+AddTieredModule(llvmo::ThreadSafeModule TSM, llvm::Function *F)
+{
+    std::string Name = F->getName().str();
+    if (TieredFunctions.count(Name))
+    {
+        fprintf(stderr, "Error: Function cannot be redefined: %s\n", Name.c_str());
+        return;
+    }
+
+    auto Info = std::make_unique<TierInfo>();
+    Info->Counter = 0;
+    Info->Name = Name;
+
+    TSM.withModuleDo([&](llvm::Module &M)
+    {
+        // Keep a clean copy around for the optimizing tier.
+        llvm::raw_svector_ostream OS(Info->Bitcode);
+        llvm::WriteBitcodeToFile(M, OS);
+
+        auto *Counter = new llvm::GlobalVariable(
+                M, llvm::Type::getInt64Ty(M.getContext()), false,
+                llvm::GlobalValue::ExternalLinkage, nullptr, Name + ".tier");
+        InstrumentForTiering(*F, Counter);
+
+        // The plain name belongs to the stub.
+        F->setName(Name + ".tier0");
+    });
+
+    ExitOnErr(TheJIT->defineAbsolute(Name + ".tier", llvm::pointerToJITTargetAddress(Info.get())));
+
+    Info->BaselineRT = TheJIT->getMainJITDylib().createResourceTracker();
+    ExitOnErr(TheJIT->addModule(std::move(TSM), Info->BaselineRT, true));
+    ExitOnErr(TheJIT->addLazyStub(Name, Name + ".tier0"));
+
+    TieredFunctions[Name] = std::move(Info);
+}
+
+/// TierUp - Recompile a hot function from its clean bitcode and swap it in.
+/// Runs on the background thread, so errors are reported, not fatal: the
+/// baseline body simply stays in place.
+internal llvm::Error
+TierUp(TierInfo *Info)
+{
+    llvm::LLVMContext Context;
+    EnableVectorizeRemarks(Context);
+    llvm::MemoryBufferRef Buffer(llvm::StringRef(Info->Bitcode.data(), Info->Bitcode.size()), Info->Name);
+    auto M = llvm::parseBitcodeFile(Buffer, Context);
+    if (!M)
+    {
+        return M.takeError();
+    }
+
+    std::string OptName = Info->Name + ".opt";
+    (*M)->getFunction(Info->Name)->setName(OptName);
+
+    llvmo::JITTargetMachineBuilder JTMB = TheJIT->getTargetMachineBuilder();
+    JTMB.setCodeGenOptLevel(llvm::CodeGenOpt::Aggressive);
+    auto TM = JTMB.createTargetMachine();
+    if (!TM)
+    {
+        return TM.takeError();
+    }
+
+    if (!TheTierUpObjectCache || !TheTierUpObjectCache->lookup(**M))
+    {
+        OptimizeModule(**M, TM->get(), TierUpOptLevel);
+    }
+
+    llvmo::SimpleCompiler Compile(**TM, TheTierUpObjectCache.get());
+    auto Obj = Compile(**M);
+    if (!Obj)
+    {
+        return Obj.takeError();
+    }
+
+    Info->OptimizedRT = TheJIT->getMainJITDylib().createResourceTracker();
+    if (auto Err = TheJIT->addObject(std::move(*Obj), Info->OptimizedRT))
+    {
+        return Err;
+    }
+
+    auto Optimized = TheJIT->lookup(OptName);
+    if (!Optimized)
+    {
+        return Optimized.takeError();
+    }
+
+    return TheJIT->updateStub(Info->Name, Optimized->getAddress());
+}
+
+internal void
+TierUpWorker()
+{
+    while (true)
+    {
+        TierInfo *Info;
+        {
+            std::unique_lock<std::mutex> Lock(TheTierUpQueue.Mutex);
+            TheTierUpQueue.Wake.wait(Lock, []{ return TheTierUpQueue.Quit || !TheTierUpQueue.Pending.empty(); });
+            if (TheTierUpQueue.Quit)
+            {
+                return;
+            }
+            Info = TheTierUpQueue.Pending.front();
+            TheTierUpQueue.Pending.pop_front();
+        }
+
+        if (auto Err = TierUp(Info))
+        {
+            llvm::logAllUnhandledErrors(std::move(Err), llvm::errs(), "Tier-up of " + Info->Name + " failed: ");
+        }
+    }
+}
+
+/// StopTiering - Must run before the JIT goes away. A recompile that's already
+/// running finishes, anything still queued is dropped.
+internal void
+StopTiering()
+{
+    if (!TheTierUpQueue.Worker.joinable())
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> Lock(TheTierUpQueue.Mutex);
+        TheTierUpQueue.Quit = true;
+    }
+    TheTierUpQueue.Wake.notify_one();
+    TheTierUpQueue.Worker.join();
+}
+
+internal void
+StartTiering()
+{
+    ExitOnErr(TheJIT->defineAbsolute("__kaleidoscope_tier_up", llvm::pointerToJITTargetAddress(&__kaleidoscope_tier_up)));
+
+    if (!ObjectCacheDir.empty())
+    {
+        TheTierUpObjectCache = std::make_unique<KaleidoscopeObjectCache>(
+                ObjectCacheDir, GetObjectCacheTag(TierUpOptLevel, llvm::CodeGenOpt::Aggressive));
+    }
+
+    TheTierUpQueue.Quit = false;
+    TheTierUpQueue.Worker = std::thread(TierUpWorker);
+
+    // ExitOnErr and friends exit() from anywhere, a worker that's still
+    // joinable when the queue is destroyed would take the process down with
+    // std::terminate. Handlers registered after it was made run before that.
+    local_persist bool32 StopAtExit = false;
+    if (!StopAtExit)
+    {
+        StopAtExit = true;
+        atexit(StopTiering);
+    }
+}
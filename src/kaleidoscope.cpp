@@ -4,26 +4,134 @@
 #include "kaleidoscope.hpp"
 
 #include "debugging/debuginfo.cpp"
+#include "debugging/phase_timing.cpp"
 #include "lexer/lexer.cpp"
 #include "ast/ast.cpp"
 #include "debugging/debuggen.cpp"
 #include "parser/parser.cpp"
+#include "optimizer/optimizer.cpp"
+#include "jit/object_cache.cpp"
+#include "jit/tiering.cpp"
+#include "jit/incremental.cpp"
 #include "ast/ast_codegen.cpp"
+#include "lexer/prescan.cpp"
+#include <atomic>
+#include <condition_variable>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <system_error>
+#include <thread>
+#include <vector>
 
 // NOTE(srp): Top-level parsing and JIT driver
 
+/// CompileMode - What the driver does with the code it generates.
+enum CompileMode
+{
+    Mode_JIT,           // Evaluate top-level expressions as they are parsed
+    Mode_EmitIR,        // Print the whole module to stderr at the end
+    Mode_EmitObject,    // Write the whole module to output.o at the end
+};
+
+global_variable CompileMode TheMode = Mode_JIT;
+
+/// LazyJIT - Put each function behind a stub and only compile it on its first
+/// call (--lazy). Worth it for big preludes where most functions go unused.
+global_variable bool32 LazyJIT = false;
+
+/// CompileThreads - Size of the JIT's compile thread pool (--threads N). With 0
+/// every module is compiled on the main thread when it's first looked up.
+global_variable uint32 CompileThreads = 0;
+
+/// HugePages - Back JIT'd code and data with 2Mb pages (--huge-pages).
+global_variable bool32 HugePages = false;
+
 internal void
 InitializeModule()
 {
     // Open a new context and module.
     TheContext = std::make_unique<llvm::LLVMContext>();
+    EnableVectorizeRemarks(*TheContext);
     TheModule = std::make_unique<llvm::Module>("my cool jit", *TheContext);
+    ModuleFunctions.clear();
     TheModule->setDataLayout(TheJIT->getDataLayout());
 
     // Create a new builder for the module.
     Builder = std::make_unique<llvm::IRBuilder<>>(*TheContext);
+
+    // Add the current debug info version into the module
+    TheModule->addModuleFlag(llvm::Module::Warning, "Debug Info Version", llvm::DEBUG_METADATA_VERSION);
+
+    // Darwin only supports dwarf2
+    if (llvm::Triple(llvm::sys::getProcessTriple()).isOSDarwin())
+    {
+        TheModule->addModuleFlag(llvm::Module::Warning, "Dwarf Version", 2);
+    }
+
+    // Construct the DIBuilder, we do this here because we need the module.
+    DBuilder = std::make_unique<llvm::DIBuilder>(*TheModule);
+
+    // Debug types belong to the previous module's DIBuilder, forget them.
+    KSDbgInfo.DblTy = nullptr;
+    KSDbgInfo.IntTy = nullptr;
+    KSDbgInfo.VecTys.clear();
+    KSDbgInfo.ArrayTy = nullptr;
+    KSDbgInfo.LexicalBlocks.clear();
+
+    // Create the compile unit for the module, named after the file being read.
+    KSDbgInfo.TheCU = DBuilder->createCompileUnit(
+            llvm::dwarf::DW_LANG_C, KSDbgInfo.getFile(),
+            "Kaleidoscope Compiler", false, "", 0);
+}
+
+/// HandOffModule - Finish the current module, give it to the JIT and open a
+/// fresh one for whatever gets parsed next.
+internal void
+HandOffModule(llvmo::ResourceTrackerSP RT = nullptr, bool32 Eager = false)
+{
+    PhaseTimer Timer(Phase_JIT);
+
+    DBuilder->finalize();
+
+    // NOTE(srp): The DIBuilder keeps tracking references into the module's
+    // context, drop them before the context can be picked up by another thread.
+    DBuilder.reset();
+
+    auto TSM = llvmo::ThreadSafeModule(std::move(TheModule), std::move(TheContext));
+    ExitOnErr(TheJIT->addModule(std::move(TSM), RT, Eager));
+
+    InitializeModule();
+}
+
+/// HandOffTieredModule - Like HandOffModule, but F gets baseline-compiled right
+/// away and is called through a stub from then on.
+internal void
+HandOffTieredModule(llvm::Function *F)
+{
+    PhaseTimer Timer(Phase_JIT);
+
+    DBuilder->finalize();
+    DBuilder.reset();
+
+    AddTieredModule(llvmo::ThreadSafeModule(std::move(TheModule), std::move(TheContext)), F);
+
+    InitializeModule();
+}
+
+/// HandOffIncrementalModule - Like HandOffModule, but F replaces whatever
+/// definition of it came before (--incremental).
+internal void
+HandOffIncrementalModule(llvm::Function *F, const FunctionAST &Fn)
+{
+    PhaseTimer Timer(Phase_JIT);
+
+    DBuilder->finalize();
+    DBuilder.reset();
+
+    AddIncrementalModule(llvmo::ThreadSafeModule(std::move(TheModule), std::move(TheContext)), F, Fn);
+
+    InitializeModule();
 }
 
 internal void
@@ -63,11 +171,15 @@ CompileObjectCode()
 
     llvm::TargetOptions opt;
     auto RM = llvm::Optional<llvm::Reloc::Model>();
-    auto TheTargetMachine = Target->createTargetMachine(TargetTriple, CPU, Features, opt, RM);
+    auto TheTargetMachine = Target->createTargetMachine(TargetTriple, CPU, Features, opt, RM,
+                                                        llvm::None, GetCodeGenOptLevel());
 
     // Target lays out data structures
     TheModule->setDataLayout(TheTargetMachine->createDataLayout());
 
+    // Run the per-module optimizations for the target
+    OptimizeModule(*TheModule, TheTargetMachine);
+
     auto Filename = "output.o";
     std::error_code EC;
     llvm::raw_fd_ostream dest(Filename, EC, llvm::sys::fs::OF_None);
@@ -95,54 +207,147 @@ CompileObjectCode()
     return 0; // NOTE(srp): no errors
 }
 
+/// GetJITTargetMachine - A TargetMachine like the JIT's own, for the pass
+/// pipeline's cost models. They aren't thread safe and modules are optimized
+/// on whichever compile thread picks them up, so each thread makes its own.
+internal llvm::TargetMachine *
+GetJITTargetMachine()
+{
+    local_persist thread_local std::unique_ptr<llvm::TargetMachine> TM;
+    if (!TM)
+    {
+        llvmo::JITTargetMachineBuilder JTMB = TheJIT->getTargetMachineBuilder();
+        TM = ExitOnErr(JTMB.createTargetMachine());
+    }
+    return TM.get();
+}
+
 internal void
 InitializeLLVM()
 {
-    TheJIT = ExitOnErr(llvmo::KaleidoscopeJIT::Create());
-
-    InitializeModule();
-
-    // Add the current debug info version into the module
-    TheModule->addModuleFlag(llvm::Module::Warning, "Debug Info Version", llvm::DEBUG_METADATA_VERSION);
-
-    // Darwin only supports dwarf2
-    if (llvm::Triple(llvm::sys::getProcessTriple()).isOSDarwin())
+    if (!ObjectCacheDir.empty())
     {
-        TheModule->addModuleFlag(llvm::Module::Warning, "Dwarf Version", 2);
+        TheObjectCache = std::make_unique<KaleidoscopeObjectCache>(
+                ObjectCacheDir, GetObjectCacheTag(OptLevel, GetCodeGenOptLevel()));
     }
 
-    // Construct the DIBuilder, we do this here because we need the module.
-    DBuilder = std::make_unique<llvm::DIBuilder>(*TheModule);
-
-    // Create the compile unit for the module.
-    // Currently down as "fib.ks" as a filename since we're redireccting stdin
-    // but we'd like actual source locations.
-    // TODO(srp): Unhardcode this
-    KSDbgInfo.TheCU = DBuilder->createCompileUnit(
-            llvm::dwarf::DW_LANG_C, DBuilder->createFile("fib.ks", "."),
-            "Kaleidoscope Compiler", false, "", 0);
+    TheJIT = ExitOnErr(llvmo::KaleidoscopeJIT::Create(GetCodeGenOptLevel(), LazyJIT, CompileThreads,
+                                                      TheObjectCache.get(), HugePages));
+
+    // Every module handed to the JIT goes through the per-module optimizations
+    // right before it's compiled, unless its object is already cached.
+    TheJIT->getIRTransformLayer().setTransform(
+            [](llvmo::ThreadSafeModule TSM, const llvmo::MaterializationResponsibility &)
+            {
+                TSM.withModuleDo([](llvm::Module &M)
+                {
+                    if (!TheObjectCache || !TheObjectCache->lookup(M))
+                    {
+                        OptimizeModule(M, GetJITTargetMachine());
+                    }
+                });
+                return llvm::Expected<llvmo::ThreadSafeModule>(std::move(TSM));
+            });
+
+    InitializeFunctionOptimizer();
+
+    if (TieredJIT)
+    {
+        StartTiering();
+    }
 
+    InitializeModule();
 }
 
-internal void
+internal int32
 FinalizeLLVM()
 {
     // Finalize the debug info.
     DBuilder->finalize();
 
-    // Print out all of the generated code.
-    TheModule->print(llvm::errs(), nullptr);
+    switch (TheMode)
+    {
+        case Mode_JIT:
+            // Everything was already handed to the JIT as it was parsed.
+            StopTiering();
+            return 0;
+        case Mode_EmitIR:
+            OptimizeModule(*TheModule, GetJITTargetMachine());
+
+            // Print out all of the generated code.
+            TheModule->print(llvm::errs(), nullptr);
+            return 0;
+        case Mode_EmitObject:
+            return CompileObjectCode();
+    }
+
+    return 0;
+}
+
+/// ShutdownLLVM - Throw away everything InitializeLLVM built, after which it
+/// can be called again for a fresh program.
+[[maybe_unused]] internal void
+ShutdownLLVM()
+{
+    DBuilder.reset();
+    Builder.reset();
+    TheModule.reset();
+    TheContext.reset();
+    ModuleFunctions.clear();
+
+    // The tier bookkeeping holds resource trackers, drop it before the JIT.
+    TieredFunctions.clear();
+    IncrementalFunctions.clear();
+    TheJIT.reset();
+    TheObjectCache.reset();
+    TheTierUpObjectCache.reset();
+
+    TheFPM.reset();
+    FunctionProtos.clear();
+    NamedValues.clear();
+    TheOperators.Bodies.clear();
 }
 
 internal void
 HandleDefinition()
 {
-    if (auto FnAST = ParseDefinition())
+    std::unique_ptr<FunctionAST> FnAST;
+    {
+        PhaseTimer Timer(Phase_Parse);
+        FnAST = ParseDefinition();
+    }
+
+    if (FnAST)
     {
-        if (!FnAST->codegen())
+        // The same def again, what's compiled already is it.
+        bool32 Incremental = (TheMode == Mode_JIT && IncrementalJIT);
+        if (Incremental && IsUnchanged(*FnAST))
+        {
+            return;
+        }
+
+        llvm::Function *F;
+        {
+            PhaseTimer Timer(Phase_Codegen);
+            F = FnAST->codegen();
+        }
+
+        if (!F)
         {
             fprintf(stderr, "Error reading function definition:");
         }
+        else if (Incremental)
+        {
+            HandOffIncrementalModule(F, *FnAST);
+        }
+        else if (TheMode == Mode_JIT && TieredJIT)
+        {
+            HandOffTieredModule(F);
+        }
+        else if (TheMode == Mode_JIT)
+        {
+            HandOffModule();
+        }
     }
     else
     {
@@ -155,16 +360,27 @@ HandleDefinition()
 internal void
 HandleExtern()
 {
-    if (auto ProtoAST = ParseExtern())
+    std::unique_ptr<PrototypeAST> ProtoAST;
+    {
+        PhaseTimer Timer(Phase_Parse);
+        ProtoAST = ParseExtern();
+    }
+
+    if (ProtoAST)
     {
+        PhaseTimer Timer(Phase_Codegen);
         if (!ProtoAST->codegen())
         {
             fprintf(stderr, "Error reading extern");
         }
         else
         {
-            //FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
-            FunctionProtos.insert({ ProtoAST->getName(), std::move(ProtoAST) });
+            // NOTE(srp): Like map insert, an existing prototype wins.
+            std::unique_ptr<PrototypeAST> &Slot = FunctionProtos[ProtoAST->getName()];
+            if (!Slot)
+            {
+                Slot = std::move(ProtoAST);
+            }
         }
     }
     else
@@ -177,13 +393,61 @@ HandleExtern()
 internal void
 HandleTopLevelExpression()
 {
+    // When JITting, name the expression so it can't clash with the host's main.
+    local_persist Symbol AnonExprName = Intern(llvm::StringRef("__anon_expr"));
+    local_persist Symbol MainName = Intern(llvm::StringRef("main"));
+    Symbol ExprName = (TheMode == Mode_JIT) ? AnonExprName : MainName;
+
     // Evaluate a top-level expression into an anonymous function.
-    if (auto FnAST = ParseTopLevelExpr())
+    std::unique_ptr<FunctionAST> FnAST;
     {
-        if (!FnAST->codegen())
+        PhaseTimer Timer(Phase_Parse);
+        FnAST = ParseTopLevelExpr(ExprName);
+    }
+
+    if (FnAST)
+    {
+        llvm::Function *F;
+        {
+            PhaseTimer Timer(Phase_Codegen);
+            F = FnAST->codegen();
+        }
+
+        if (!F)
         {
             fprintf(stderr, "Error generating code for top level expr");
         }
+        else if (TheMode == Mode_JIT)
+        {
+            // Create a ResourceTracker to track JIT'd memory allocated to our
+            // anonymous expression, that way we can free it after executing.
+            // It runs right away, so don't bother putting it behind a lazy stub.
+            auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+            HandOffModule(RT, true);
+
+            // Search the JIT for the expression symbol and call it as a
+            // native function: no arguments, returns a double. The lookup is
+            // what makes the JIT compile it and everything it calls.
+            llvm::JITEvaluatedSymbol ExprSymbol;
+            {
+                PhaseTimer Timer(Phase_JIT);
+                ExprSymbol = ExitOnErr(TheJIT->lookup(SymbolName(ExprName)));
+            }
+
+            real64 (*FP)() = (real64 (*)())(intptr_t)ExprSymbol.getAddress();
+            real64 Result;
+            {
+                PhaseTimer Timer(Phase_Execute);
+                Result = FP();
+            }
+            fprintf(stderr, "Evaluated to %f\n", Result);
+
+            // Delete the anonymous expression module from the JIT, and its
+            // prototype so the next expression can reuse the name.
+            PhaseTimer Timer(Phase_JIT);
+            ExitOnErr(RT->remove());
+            FunctionProtos.erase(ExprName);
+        }
     }
     else
     {
@@ -214,6 +478,360 @@ MainLoop()
                 HandleTopLevelExpression();
                 break;
         }
+
+        // The item's been generated or thrown away, its nodes can go.
+        ResetArena(&ASTArena);
+        ResetFlatAST();
+    }
+}
+
+
+// NOTE(srp): Parallel front-end (--jobs N). A file is pre-scanned for where its
+// items start and cut into up to N chunks of about the same size. Every chunk
+// gets a worker thread, which parses it and, once everybody's prototypes are
+// known, generates code for it into a module of its own. The modules are then
+// handed to the JIT together, or linked into TheModule when emitting code.
+
+/// FrontEndJobs - Worker threads per file, 0 to go through MainLoop instead.
+global_variable uint32 FrontEndJobs = 0;
+
+/// ExpressionCount - Names top-level expressions so they never clash, they
+/// all stay in the JIT.
+global_variable std::atomic<uint32> ExpressionCount;
+
+/// ChunkItem - One parsed top-level item. Exactly one of the pointers is set
+/// until the merge, which takes the extern and drops bad definitions.
+struct ChunkItem
+{
+    std::unique_ptr<FunctionAST> Function;
+    std::unique_ptr<PrototypeAST> Extern;
+    bool32 IsExpression;
+};
+
+struct FileChunk
+{
+    SourceSplit Start;
+    const char *End;
+    std::map<char, int32> Precedence; // BinopPrecedence where the chunk starts
+
+    std::vector<ChunkItem> Items;
+    std::vector<Symbol> Expressions; // The ones that made it through codegen
+
+    std::unique_ptr<llvm::LLVMContext> Context;
+    std::unique_ptr<llvm::Module> Module;
+};
+
+/// FrontEndSync - The workers wait here between parsing and codegen, until the
+/// main thread has merged the prototypes.
+struct FrontEndSync
+{
+    std::mutex Mutex;
+    std::condition_variable Wake;
+    uint32 Parsed;
+    bool32 Merged;
+};
+
+internal void
+ParseChunk(const MappedFile &File, FileChunk *Chunk)
+{
+    local_persist Symbol MainName = Intern(llvm::StringRef("main"));
+
+    PhaseTimer Timer(Phase_Parse);
+
+    BinopPrecedence = Chunk->Precedence;
+    BeginSourceRange(File, Chunk->Start.At, Chunk->End, Chunk->Start.Line, Chunk->Start.LineStart);
+    getNextToken();
+
+    while (CurTok != tok_eof)
+    {
+        ChunkItem Item = {};
+        switch (CurTok)
+        {
+            case ';': // ignore top-level semicolons.
+                getNextToken();
+                continue;
+            case tok_def:
+            {
+                Item.Function = ParseDefinition();
+
+                // Later chunks got the operator from the pre-scan, the rest of
+                // this one needs it now.
+                if (Item.Function && Item.Function->getProto().isBinaryOp())
+                {
+                    const PrototypeAST &P = Item.Function->getProto();
+                    BinopPrecedence[P.getOperatorName()] = P.getBinaryPrecedence();
+                }
+                break;
+            }
+            case tok_extern:
+                Item.Extern = ParseExtern();
+                break;
+            default:
+            {
+                Symbol ExprName = MainName;
+                if (TheMode == Mode_JIT)
+                {
+                    ExprName = Intern(llvm::StringRef("__anon_expr." + std::to_string(ExpressionCount++)));
+                }
+                Item.Function = ParseTopLevelExpr(ExprName);
+                Item.IsExpression = true;
+                break;
+            }
+        }
+
+        if (!Item.Function && !Item.Extern)
+        {
+            // Skip token for error recovery.
+            getNextToken();
+            continue;
+        }
+        Chunk->Items.push_back(std::move(Item));
+    }
+}
+
+/// MergePrototypes - Install every chunk's prototypes in source order, the same
+/// way MainLoop would have, so codegen can find any function in the file.
+internal void
+MergePrototypes(std::vector<FileChunk> &Chunks)
+{
+    SymbolMap<bool32> Defined;
+    for (FileChunk &Chunk : Chunks)
+    {
+        for (ChunkItem &Item : Chunk.Items)
+        {
+            if (Item.Extern)
+            {
+                // Like HandleExtern, an existing prototype wins.
+                std::unique_ptr<PrototypeAST> &Slot = FunctionProtos[Item.Extern->getName()];
+                if (!Slot)
+                {
+                    Slot = std::move(Item.Extern);
+                }
+                Item.Extern.reset();
+                continue;
+            }
+
+            Symbol Name = Item.Function->getName();
+            if (Defined.find(Name))
+            {
+                // All of the file goes into one module, as if it were emitted.
+                LogError("Function cannot be redefined in the same module");
+                fprintf(stderr, Item.IsExpression ? "Error generating code for top level expr"
+                                                  : "Error reading function definition:");
+                Item.Function.reset();
+                continue;
+            }
+            Defined[Name] = true;
+            Item.Function->installPrototype();
+        }
+    }
+}
+
+internal void
+CodegenChunk(FileChunk *Chunk)
+{
+    InitializeModule();
+    InitializeFunctionOptimizer();
+
+    {
+        PhaseTimer Timer(Phase_Codegen);
+        for (ChunkItem &Item : Chunk->Items)
+        {
+            if (!Item.Function)
+            {
+                continue;
+            }
+
+            if (!Item.Function->codegen())
+            {
+                fprintf(stderr, Item.IsExpression ? "Error generating code for top level expr"
+                                                  : "Error reading function definition:");
+            }
+            else if (Item.IsExpression)
+            {
+                Chunk->Expressions.push_back(Item.Function->getName());
+            }
+        }
+    }
+
+    DBuilder->finalize();
+    Chunk->Module = std::move(TheModule);
+    Chunk->Context = std::move(TheContext);
+
+    // The thread is about to go, leave nothing behind that points into the
+    // chunk's context.
+    DBuilder.reset();
+    Builder.reset();
+    TheFPM.reset();
+    NamedValues.clear();
+    ModuleFunctions.clear();
+
+    Chunk->Items.clear();
+    ResetArena(&ASTArena);
+    ResetFlatAST();
+}
+
+/// LinkChunkModule - Move M into TheModule. They're in different contexts, so
+/// it goes through bitcode.
+internal void
+LinkChunkModule(std::unique_ptr<llvm::Module> M)
+{
+    llvm::SmallVector<char, 0> Bitcode;
+    llvm::raw_svector_ostream OS(Bitcode);
+    llvm::WriteBitcodeToFile(*M, OS);
+
+    llvm::MemoryBufferRef Buffer(llvm::StringRef(Bitcode.data(), Bitcode.size()), M->getModuleIdentifier());
+    auto Copy = ExitOnErr(llvm::parseBitcodeFile(Buffer, *TheContext));
+    if (llvm::Linker::linkModules(*TheModule, std::move(Copy)))
+    {
+        fprintf(stderr, "Error: Could not link the chunk modules\n");
+    }
+}
+
+/// ParallelCompileFile - What BeginSourceFile and MainLoop do for a file, on
+/// FrontEndJobs threads.
+internal void
+ParallelCompileFile(const MappedFile &File)
+{
+    PreScan Scan;
+    {
+        PhaseTimer Timer(Phase_Lex);
+        Scan = PreScanSource(File);
+    }
+
+    // Cut where an item starts, as close to an even split as there is.
+    std::vector<FileChunk> Chunks;
+    Chunks.reserve(FrontEndJobs);
+    Chunks.emplace_back();
+    Chunks.back().Start = {File.Contents, 1, File.Contents};
+
+    size_t NextItem = 0;
+    for (uint32 Job = 1; Job < FrontEndJobs; ++Job)
+    {
+        const char *Target = File.Contents + File.Size * Job / FrontEndJobs;
+        while (NextItem < Scan.Items.size() && Scan.Items[NextItem].At < Target)
+        {
+            ++NextItem;
+        }
+        if (NextItem == Scan.Items.size())
+        {
+            break;
+        }
+        if (Scan.Items[NextItem].At > Chunks.back().Start.At)
+        {
+            Chunks.emplace_back();
+            Chunks.back().Start = Scan.Items[NextItem];
+        }
+    }
+
+    size_t NextOperator = 0;
+    for (size_t ChunkIndex = 0; ChunkIndex < Chunks.size(); ++ChunkIndex)
+    {
+        FileChunk &Chunk = Chunks[ChunkIndex];
+        Chunk.End = (ChunkIndex + 1 < Chunks.size()) ? Chunks[ChunkIndex + 1].Start.At : File.Contents + File.Size;
+
+        // Every operator declared before the chunk is in effect when it starts.
+        for (; NextOperator < Scan.Operators.size() && Scan.Operators[NextOperator].At < Chunk.Start.At; ++NextOperator)
+        {
+            BinopPrecedence[Scan.Operators[NextOperator].Op] = Scan.Operators[NextOperator].Precedence;
+        }
+        Chunk.Precedence = BinopPrecedence;
+    }
+    for (; NextOperator < Scan.Operators.size(); ++NextOperator)
+    {
+        BinopPrecedence[Scan.Operators[NextOperator].Op] = Scan.Operators[NextOperator].Precedence;
+    }
+
+    FrontEndSync Sync;
+    Sync.Parsed = 0;
+    Sync.Merged = false;
+
+    std::vector<std::thread> Workers;
+    for (FileChunk &Chunk : Chunks)
+    {
+        Workers.emplace_back([&File, &Chunk, &Sync]
+        {
+            ParseChunk(File, &Chunk);
+
+            std::unique_lock<std::mutex> Lock(Sync.Mutex);
+            ++Sync.Parsed;
+            Sync.Wake.notify_all();
+            Sync.Wake.wait(Lock, [&Sync] { return Sync.Merged; });
+            Lock.unlock();
+
+            CodegenChunk(&Chunk);
+        });
+    }
+
+    {
+        std::unique_lock<std::mutex> Lock(Sync.Mutex);
+        Sync.Wake.wait(Lock, [&] { return Sync.Parsed == Chunks.size(); });
+        MergePrototypes(Chunks);
+        Sync.Merged = true;
+    }
+    Sync.Wake.notify_all();
+
+    for (std::thread &Worker : Workers)
+    {
+        Worker.join();
+    }
+
+    if (TheMode != Mode_JIT)
+    {
+        for (FileChunk &Chunk : Chunks)
+        {
+            LinkChunkModule(std::move(Chunk.Module));
+        }
+
+        // Whatever comes after this file has to find these in TheModule.
+        for (llvm::Function &F : *TheModule)
+        {
+            ModuleFunctions[Intern(F.getName())] = &F;
+        }
+        return;
+    }
+
+    {
+        PhaseTimer Timer(Phase_JIT);
+        for (FileChunk &Chunk : Chunks)
+        {
+            ExitOnErr(TheJIT->addModule(llvmo::ThreadSafeModule(std::move(Chunk.Module), std::move(Chunk.Context))));
+        }
+    }
+
+    // Now run the top-level expressions, in the order they were written.
+    for (FileChunk &Chunk : Chunks)
+    {
+        for (Symbol ExprName : Chunk.Expressions)
+        {
+            llvm::JITEvaluatedSymbol ExprSymbol;
+            {
+                PhaseTimer Timer(Phase_JIT);
+                ExprSymbol = ExitOnErr(TheJIT->lookup(SymbolName(ExprName)));
+            }
+
+            real64 (*FP)() = (real64 (*)())(intptr_t)ExprSymbol.getAddress();
+            real64 Result;
+            {
+                PhaseTimer Timer(Phase_Execute);
+                Result = FP();
+            }
+            fprintf(stderr, "Evaluated to %f\n", Result);
+        }
     }
 }
 
+/// CompileFile - Everything in File, one item at a time or in parallel.
+internal void
+CompileFile(const MappedFile &File)
+{
+    if (FrontEndJobs)
+    {
+        ParallelCompileFile(File);
+        return;
+    }
+
+    BeginSourceFile(File);
+    getNextToken();
+    MainLoop();
+}
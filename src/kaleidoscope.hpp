@@ -6,6 +6,23 @@
 
 // TODO(srp): Services that the platform layer provides to the program.
 
+/// MappedFile - A whole source file mapped read-only into memory. Contents is
+/// null if the file couldn't be mapped.
+struct MappedFile
+{
+    const char *Path;
+    const char *Contents;
+    uint64 Size;
+    uint64 WriteTime; // Last modified, in platform units
+};
+
+internal MappedFile PlatformMapFile(const char *Path);
+internal void PlatformUnmapFile(MappedFile *File);
+
+/// PlatformGetFileWriteTime - Same units as MappedFile::WriteTime, 0 if the
+/// file can't be looked at.
+internal uint64 PlatformGetFileWriteTime(const char *Path);
+
 
 // TODO(srp): Services that the program provides to the platform layer.
 
@@ -1,12 +1,30 @@
 #pragma once
 // NOTE(srp): Still not final platform-independent code
 
+#include <charconv>
 #include <string>
+#include <string_view>
 #include "../platform/typedefs/typedefs.hpp"
 #include "../debugging/debuginfo.cpp"
+#include "./symbols.cpp"
 
-global_variable std::string IdentifierStr; // Filled in if tok_identifier
-global_variable real64 NumVal;             // Filled in if tok_number
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+    #define LEXER_SSE2 1
+#else
+    #define LEXER_SSE2 0
+#endif
+
+// NOTE(srp): The lexer works on the whole source buffer, nothing is copied.
+// IdentifierStr points into the source, so it's only good until the next
+// gettok() (stdin is read a line at a time and the line gets reused).
+// IdentifierSym is the same name interned, that one is good forever. Each
+// thread lexes its own source (see ParallelCompileFile).
+
+global_variable thread_local std::string_view IdentifierStr; // Filled in if tok_identifier
+global_variable thread_local Symbol IdentifierSym;            // Filled in if tok_identifier
+global_variable thread_local real64 NumVal;                   // Filled in if tok_number
+global_variable thread_local bool32 NumIsInteger;             // NumVal was written as an int
 
 // Tokens [0-255] if it's an unknown character, otherwise one of 
 // the following for known things
@@ -34,8 +52,57 @@ enum Token {
 
     // var definition
     tok_var = -13,
+
+    // Malformed token, already reported
+    tok_error = -14,
+
+    // function qualifiers
+    tok_pure = -15,
+    tok_memo = -16,
 };
 
+// Two-character operators lex as one token. They're control characters, so
+// they fit wherever an operator char goes (precedence table, AST nodes), but
+// can't be defined by the user (see IsUserOperator).
+enum OperatorToken {
+    tok_equal = 1,          // ==
+    tok_not_equal = 2,      // !=
+    tok_less_equal = 3,     // <=
+    tok_greater_equal = 4,  // >=
+    tok_and = 5,            // &&
+    tok_or = 6,             // ||
+};
+
+/// OperatorSpelling - How an operator char is written in the source.
+internal std::string
+OperatorSpelling(char Op)
+{
+    switch (Op)
+    {
+        case tok_equal:
+            return "==";
+        case tok_not_equal:
+            return "!=";
+        case tok_less_equal:
+            return "<=";
+        case tok_greater_equal:
+            return ">=";
+        case tok_and:
+            return "&&";
+        case tok_or:
+            return "||";
+    }
+    return std::string(1, Op);
+}
+
+/// IsUserOperator - Whether Tok can be defined with 'def unary' or 'def binary'.
+/// '[' and ']' index arrays.
+internal bool32
+IsUserOperator(int32 Tok)
+{
+    return isascii(Tok) && isprint(Tok) && Tok != '[' && Tok != ']';
+}
+
 internal std::string 
 getTokName(int32 Tok)
 {
@@ -67,128 +134,392 @@ getTokName(int32 Tok)
             return "unary";
         case tok_var:
             return "var";
+        case tok_error:
+            return "error";
+        case tok_pure:
+            return "pure";
+        case tok_memo:
+            return "memo";
     }
-    return std::string(1, (char)Tok);
+    return OperatorSpelling((char)Tok);
 }
 
-// gettok - Return the next token from standard input
-internal int32
-gettok()
+/// Keyword - Identifiers that lex as their own token.
+struct Keyword
 {
-    local_persist int32 LastChar = ' ';
+    std::string_view Name;
+    Token Tok;
+};
+
+inline_variable Keyword Keywords[] = {
+    {"def", tok_def},
+    {"extern", tok_extern},
+    {"if", tok_if},
+    {"then", tok_then},
+    {"else", tok_else},
+    {"for", tok_for},
+    {"in", tok_in},
+    {"binary", tok_binary},
+    {"unary", tok_unary},
+    {"var", tok_var},
+    {"pure", tok_pure},
+    {"memo", tok_memo},
+};
+
+inline_variable uint32 KeywordTableSize = 32;
 
-    // Skip whitespace
-    while (isspace(LastChar)) 
+/// KeywordHash - Only has to be perfect over Keywords, the static_assert below
+/// checks it. When adding a keyword breaks it, try other multipliers.
+constexpr uint32
+KeywordHash(std::string_view Word)
+{
+    return ((uint32)Word.size() + (uint8)Word.front() * 11 + (uint8)Word.back() * 7) & (KeywordTableSize - 1);
+}
+
+struct KeywordTable
+{
+    int8 Slots[KeywordTableSize]; // Index into Keywords, -1 if empty
+};
+
+constexpr KeywordTable
+BuildKeywordTable()
+{
+    KeywordTable Table = {};
+    for (uint32 Slot = 0; Slot < KeywordTableSize; ++Slot)
     {
-        LastChar = advance();
+        Table.Slots[Slot] = -1;
     }
+    for (uint32 Index = 0; Index < sizeof(Keywords) / sizeof(Keywords[0]); ++Index)
+    {
+        Table.Slots[KeywordHash(Keywords[Index].Name)] = (int8)Index;
+    }
+    return Table;
+}
 
-    CurLoc = LexLoc;
-
-    // IDENTIFIERS
-    if (isalpha(LastChar))
+constexpr bool
+KeywordHashIsPerfect()
+{
+    KeywordTable Table = BuildKeywordTable();
+    for (uint32 Index = 0; Index < sizeof(Keywords) / sizeof(Keywords[0]); ++Index)
     {
-        // IdentifierStr: [a-zA-Z][a-zA-Z0-9]*
-        IdentifierStr = LastChar;
-        while (isalnum((LastChar = advance())))
+        if (Table.Slots[KeywordHash(Keywords[Index].Name)] != (int8)Index)
         {
-            IdentifierStr += LastChar;
+            return false;
         }
+    }
+    return true;
+}
 
-        if (IdentifierStr == "def")
-        {
-            return tok_def;
-        }
+static_assert(KeywordHashIsPerfect(), "Two keywords hash to the same slot, change KeywordHash");
 
-        if (IdentifierStr == "extern")
-        {
-            return tok_extern;
-        }
+inline_variable KeywordTable TheKeywordTable = BuildKeywordTable();
+
+/// LookupKeyword - One probe and one compare, Word must not be empty.
+internal int32
+LookupKeyword(std::string_view Word)
+{
+    int8 Index = TheKeywordTable.Slots[KeywordHash(Word)];
+    if (Index >= 0 && Keywords[Index].Name == Word)
+    {
+        return Keywords[Index].Tok;
+    }
+    return tok_identifier;
+}
 
-        if (IdentifierStr == "if")
+// NOTE(srp): Character classes. These are the C locale's isalpha/isalnum/
+// isspace, spelled out so the scalar and SIMD paths agree.
+
+internal inline bool32
+IsAlpha(uint8 C)
+{
+    return (uint8)((C | 0x20) - 'a') < 26;
+}
+
+internal inline bool32
+IsDigit(uint8 C)
+{
+    return (uint8)(C - '0') < 10;
+}
+
+internal inline bool32
+IsSpace(uint8 C)
+{
+    return C == ' ' || (uint8)(C - '\t') < 5; // \t \n \v \f \r
+}
+
+#if LEXER_SSE2
+/// CharsInRange - 0xFF in every byte of Chunk that's within [Lo, Hi]. SSE2 only
+/// has signed compares, so slide the range down to start at -128 first.
+internal inline __m128i
+CharsInRange(__m128i Chunk, uint8 Lo, uint8 Hi)
+{
+    __m128i Shifted = _mm_sub_epi8(Chunk, _mm_set1_epi8((char)(Lo + 128)));
+    return _mm_cmplt_epi8(Shifted, _mm_set1_epi8((char)(Hi - Lo - 127)));
+}
+#endif
+
+// NOTE(srp): The scanners below go 16 bytes at a time while there's that much
+// left and finish byte by byte, so they never read past End. That matters for
+// mapped files that end right at a page boundary.
+
+/// SkipIdentifierChars - First character from At on that can't be part of an
+/// identifier.
+internal const char *
+SkipIdentifierChars(const char *At, const char *End)
+{
+#if LEXER_SSE2
+    while (End - At >= 16)
+    {
+        __m128i Chunk = _mm_loadu_si128((const __m128i*)At);
+        __m128i Lower = _mm_or_si128(Chunk, _mm_set1_epi8(0x20));
+        __m128i IsAlnum = _mm_or_si128(CharsInRange(Lower, 'a', 'z'), CharsInRange(Chunk, '0', '9'));
+
+        uint32 Stop = ~(uint32)_mm_movemask_epi8(IsAlnum) & 0xFFFF;
+        if (Stop)
         {
-            return tok_if;
+            return At + __builtin_ctz(Stop);
         }
+        At += 16;
+    }
+#endif
+
+    while (At < End && (IsAlpha(*At) || IsDigit(*At)))
+    {
+        ++At;
+    }
+    return At;
+}
 
-        if (IdentifierStr == "then")
+/// SkipWhitespace - First non-space character from At on. Counts the lines it
+/// goes past.
+internal const char *
+SkipWhitespace(const char *At, const char *End)
+{
+#if LEXER_SSE2
+    while (End - At >= 16)
+    {
+        __m128i Chunk = _mm_loadu_si128((const __m128i*)At);
+        __m128i Newline = _mm_cmpeq_epi8(Chunk, _mm_set1_epi8('\n'));
+        __m128i Space = _mm_or_si128(_mm_cmpeq_epi8(Chunk, _mm_set1_epi8(' ')), CharsInRange(Chunk, '\t', '\r'));
+
+        uint32 Stop = ~(uint32)_mm_movemask_epi8(Space) & 0xFFFF;
+        uint32 Skipped = Stop ? (Stop & (0 - Stop)) - 1 : 0xFFFF; // Bits below the first stop
+        uint32 Newlines = (uint32)_mm_movemask_epi8(Newline) & Skipped;
+        if (Newlines)
         {
-            return tok_then;
+            LexLoc.Line += __builtin_popcount(Newlines);
+            CurSource.LineStart = At + (31 - __builtin_clz(Newlines)) + 1;
         }
 
-        if (IdentifierStr == "else")
+        if (Stop)
         {
-            return tok_else;
+            return At + __builtin_ctz(Stop);
         }
+        At += 16;
+    }
+#endif
 
-        if (IdentifierStr == "for")
+    while (At < End && IsSpace(*At))
+    {
+        // Only \n ends a line, so \r\n counts once.
+        if (*At == '\n')
         {
-            return tok_for;
+            LexLoc.Line++;
+            CurSource.LineStart = At + 1;
         }
+        ++At;
+    }
+    return At;
+}
 
-        if (IdentifierStr == "in")
+/// SkipToLineEnd - The newline ending the line At is on, or End. The newline
+/// itself is left for SkipWhitespace to count.
+internal const char *
+SkipToLineEnd(const char *At, const char *End)
+{
+#if LEXER_SSE2
+    while (End - At >= 16)
+    {
+        __m128i Chunk = _mm_loadu_si128((const __m128i*)At);
+        uint32 Newlines = (uint32)_mm_movemask_epi8(_mm_cmpeq_epi8(Chunk, _mm_set1_epi8('\n')));
+        if (Newlines)
         {
-            return tok_in;
+            return At + __builtin_ctz(Newlines);
         }
+        At += 16;
+    }
+#endif
+
+    while (At < End && *At != '\n')
+    {
+        ++At;
+    }
+    return At;
+}
 
-        if (IdentifierStr == "binary")
+/// StdinLine - The line of stdin being lexed. Reading a line at a time keeps
+/// the interactive prompt responsive, and no token spans lines.
+global_variable std::string StdinLine;
+
+/// RefillSource - Load the next line of stdin once the current one is lexed.
+/// Returns false at end of input, files are always fully loaded.
+internal bool32
+RefillSource()
+{
+    if (!CurSource.IsStdin)
+    {
+        return false;
+    }
+
+    StdinLine.clear();
+    int32 C;
+    while ((C = getchar()) != EOF)
+    {
+        StdinLine += (char)C;
+        if (C == '\n')
         {
-            return tok_binary;
+            break;
         }
+    }
+
+    CurSource.At = StdinLine.data();
+    CurSource.End = StdinLine.data() + StdinLine.size();
+    CurSource.LineStart = CurSource.At;
+    return !StdinLine.empty();
+}
 
-        if (IdentifierStr == "unary")
+/// BeginSourceRange - Lex [At, End) of File from now on. At is on line Line,
+/// which starts at LineStart, so locations come out as if the whole file was
+/// lexed.
+internal void
+BeginSourceRange(const MappedFile &File, const char *At, const char *End, int32 Line, const char *LineStart)
+{
+    CurSource.Path = File.Path;
+    CurSource.At = At;
+    CurSource.End = End;
+    CurSource.LineStart = LineStart;
+    CurSource.IsStdin = false;
+
+    LexLoc = {Line, 0};
+}
+
+/// BeginSourceFile - Lex from File from now on, starting at its first line.
+internal void
+BeginSourceFile(const MappedFile &File)
+{
+    BeginSourceRange(File, File.Contents, File.Contents + File.Size, 1, File.Contents);
+}
+
+// gettok - Return the next token from the current source
+internal int32
+gettok()
+{
+    const char *At = CurSource.At;
+    const char *End = CurSource.End;
+
+    while (true)
+    {
+        // Skip whitespace
+        At = SkipWhitespace(At, End);
+
+        if (At == End)
         {
-            return tok_unary;
+            // Check for end of file. Don't eat the EOF.
+            CurSource.At = At;
+            if (!RefillSource())
+            {
+                return tok_eof;
+            }
+            At = CurSource.At;
+            End = CurSource.End;
+            continue;
         }
 
-        if (IdentifierStr == "var")
+        // COMMENTS
+        if (*At == '#')
         {
-            return tok_var;
+            // Comment until end of line
+            At = SkipToLineEnd(At, End);
+            continue;
         }
 
-        return tok_identifier;
+        break;
     }
 
-    // NUMBERS
-    if (isdigit(LastChar) || LastChar == '.')
+    CurLoc = {LexLoc.Line, (int32)(At - CurSource.LineStart) + 1};
+    const char *Start = At;
+
+    // IDENTIFIERS
+    if (IsAlpha(*At))
     {
-        // NumStr: [0-9.]+
-        std::string NumStr;
-        do
-        {
-            NumStr += LastChar;
-            LastChar = advance();
-        } while (isdigit(LastChar) || LastChar == '.');
+        // IdentifierStr: [a-zA-Z][a-zA-Z0-9]*
+        At = SkipIdentifierChars(At + 1, End);
+        CurSource.At = At;
 
-        NumVal = strtod(NumStr.c_str(), nullptr);
-        return tok_number;
-        
-        // TODO(srp): This will incorrectly read "1.23.45.67" as "1.23"
+        IdentifierStr = std::string_view(Start, At - Start);
+        int32 Tok = LookupKeyword(IdentifierStr);
+        if (Tok == tok_identifier)
+        {
+            IdentifierSym = Intern(IdentifierStr);
+        }
+        return Tok;
     }
 
-    // COMMENTS
-    if (LastChar == '#')
+    // NUMBERS
+    if (IsDigit(*At) || *At == '.')
     {
-        // Comment until end of line
+        // NumStr: [0-9.]+, and all of it has to parse as one number.
         do
         {
-            LastChar = advance();
-        } while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
+            ++At;
+        } while (At < End && (IsDigit(*At) || *At == '.'));
+        CurSource.At = At;
 
-        if (LastChar != EOF)
+        std::from_chars_result Parsed = std::from_chars(Start, At, NumVal);
+        if (Parsed.ec != std::errc() || Parsed.ptr != At)
         {
-            return gettok();
+            fprintf(stderr, "Error: Malformed number %.*s at line %d\n", (int32)(At - Start), Start, CurLoc.Line);
+            return tok_error;
         }
+
+        // Ints have to fit in a double exactly, NumVal holds them too.
+        NumIsInteger = (memchr(Start, '.', At - Start) == nullptr) && NumVal < 9007199254740992.0;
+        return tok_number;
     }
 
-    // Check for end of file. Don't eat the EOF.
-    if (LastChar == EOF)
+    // Two-character operators
+    if (End - At >= 2)
     {
-        return tok_eof;
+        int32 Tok = 0;
+        switch (At[0])
+        {
+            case '=':
+                Tok = (At[1] == '=') ? tok_equal : 0;
+                break;
+            case '!':
+                Tok = (At[1] == '=') ? tok_not_equal : 0;
+                break;
+            case '<':
+                Tok = (At[1] == '=') ? tok_less_equal : 0;
+                break;
+            case '>':
+                Tok = (At[1] == '=') ? tok_greater_equal : 0;
+                break;
+            case '&':
+                Tok = (At[1] == '&') ? tok_and : 0;
+                break;
+            case '|':
+                Tok = (At[1] == '|') ? tok_or : 0;
+                break;
+        }
+        if (Tok)
+        {
+            CurSource.At = At + 2;
+            return Tok;
+        }
     }
 
     // Otherwise, just return the character as its ascii value
-    int32 ThisChar = LastChar;
-    LastChar = advance();
-    return ThisChar;
+    CurSource.At = At + 1;
+    return (uint8)*At;
 }
-
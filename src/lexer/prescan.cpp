@@ -0,0 +1,114 @@
+#pragma once
+// NOTE(srp): Still not final platform-independent code
+
+#include <string_view>
+#include <vector>
+#include "../platform/typedefs/typedefs.hpp"
+#include "./lexer.cpp"
+
+// NOTE(srp): The pre-scan finds where top-level items start without lexing
+// everything. 'def' and 'extern' can't appear inside an expression, so every
+// one of them starts an item. Words are split exactly like gettok splits
+// them and comments are skipped, so this never finds a keyword the lexer
+// wouldn't.
+
+/// SourceSplit - Where an item starts, and enough to start lexing there.
+struct SourceSplit
+{
+    const char *At;
+    int32 Line;
+    const char *LineStart;
+};
+
+/// OperatorDecl - A 'def binary<Op> <Precedence>' the pre-scan came across.
+/// Items after it have to be parsed with its precedence.
+struct OperatorDecl
+{
+    const char *At;
+    char Op;
+    int32 Precedence;
+};
+
+struct PreScan
+{
+    std::vector<SourceSplit> Items;
+    std::vector<OperatorDecl> Operators;
+};
+
+/// PreScanOperator - Lex the def at Split for real and record it if it
+/// declares a binary operator. Clobbers the lexer state.
+internal void
+PreScanOperator(const MappedFile &File, const SourceSplit &Split, PreScan *Result)
+{
+    BeginSourceRange(File, Split.At, File.Contents + File.Size, Split.Line, Split.LineStart);
+    gettok(); // 'def'
+    int32 Tok = gettok();
+    while (Tok == tok_pure || Tok == tok_memo)
+    {
+        Tok = gettok();
+    }
+    if (Tok != tok_binary)
+    {
+        return;
+    }
+
+    // Same rules as ParsePrototype.
+    int32 Op = gettok();
+    if (!IsUserOperator(Op))
+    {
+        return;
+    }
+
+    int32 Precedence = 30;
+    if (gettok() == tok_number && NumVal >= 1 && NumVal <= 100)
+    {
+        Precedence = (int32)NumVal;
+    }
+    Result->Operators.push_back({Split.At, (char)Op, Precedence});
+}
+
+internal PreScan
+PreScanSource(const MappedFile &File)
+{
+    PreScan Result;
+
+    const char *At = File.Contents;
+    const char *End = File.Contents + File.Size;
+    int32 Line = 1;
+    const char *LineStart = At;
+
+    while (At < End)
+    {
+        uint8 C = (uint8)*At;
+        if (C == '\n')
+        {
+            ++Line;
+            LineStart = ++At;
+        }
+        else if (C == '#')
+        {
+            At = SkipToLineEnd(At, End);
+        }
+        else if (IsAlpha(C))
+        {
+            const char *Word = At;
+            At = SkipIdentifierChars(At + 1, End);
+
+            std::string_view Name(Word, At - Word);
+            if (Name == "def" || Name == "extern")
+            {
+                Result.Items.push_back({Word, Line, LineStart});
+                if (Name == "def")
+                {
+                    PreScanOperator(File, Result.Items.back(), &Result);
+                }
+            }
+        }
+        else
+        {
+            ++At;
+        }
+    }
+
+    return Result;
+}
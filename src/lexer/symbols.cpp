@@ -0,0 +1,171 @@
+#pragma once
+// NOTE(srp): Still not final platform-independent code
+
+#include <algorithm>
+#include <cassert>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "../platform/typedefs/typedefs.hpp"
+
+// NOTE(srp): Every name in the program is interned once, by the lexer or when
+// the compiler makes one up (operators, top-level expressions). After that
+// it's a Symbol: comparing two is comparing integers and every table keyed by
+// name is a plain array.
+
+/// Symbol - Index of an interned name. 0 is never handed out.
+typedef uint32 Symbol;
+
+inline_variable Symbol NoSymbol = 0;
+
+inline_variable uint32 SymbolChunkSize = 1 << 16;
+inline_variable uint32 SymbolChunkCount = 1 << 16;
+
+/// SymbolTable - The interned names. The strings live in the map's entries so
+/// they never move, and the names by symbol are in fixed-size chunks that
+/// never move either, so SymbolName needs no lock. Interning does, worker
+/// threads intern at the same time.
+struct SymbolTable
+{
+    std::mutex Mutex;
+    llvm::StringMap<Symbol> Ids;
+    std::unique_ptr<llvm::StringRef[]> Chunks[SymbolChunkCount];
+    uint32 Count = 1;
+};
+
+global_variable SymbolTable TheSymbols;
+
+/// LocalSymbols - What this thread has interned before, so the lexer only takes
+/// the lock the first time a thread sees a name.
+global_variable thread_local llvm::StringMap<Symbol> LocalSymbols;
+
+internal Symbol
+Intern(llvm::StringRef Name)
+{
+    auto Local = LocalSymbols.find(Name);
+    if (Local != LocalSymbols.end())
+    {
+        return Local->getValue();
+    }
+
+    Symbol Result;
+    {
+        std::lock_guard<std::mutex> Lock(TheSymbols.Mutex);
+        auto Inserted = TheSymbols.Ids.try_emplace(Name, TheSymbols.Count);
+        Result = Inserted.first->getValue();
+        if (Inserted.second)
+        {
+            assert(Result / SymbolChunkSize < SymbolChunkCount && "out of symbols");
+            std::unique_ptr<llvm::StringRef[]> &Chunk = TheSymbols.Chunks[Result / SymbolChunkSize];
+            if (!Chunk)
+            {
+                Chunk = std::make_unique<llvm::StringRef[]>(SymbolChunkSize);
+            }
+            Chunk[Result % SymbolChunkSize] = Inserted.first->getKey();
+            ++TheSymbols.Count;
+        }
+    }
+
+    LocalSymbols.try_emplace(Name, Result);
+    return Result;
+}
+
+internal Symbol
+Intern(std::string_view Name)
+{
+    return Intern(llvm::StringRef(Name.data(), Name.size()));
+}
+
+/// SymbolName - Only for symbols this thread got from Intern, or was handed by
+/// a thread that did.
+internal llvm::StringRef
+SymbolName(Symbol S)
+{
+    return TheSymbols.Chunks[S / SymbolChunkSize][S % SymbolChunkSize];
+}
+
+/// OperatorSymbol - The function name of a user defined operator, '{unary!}'
+/// or '{binary|}'. Cached, codegen asks for these on every use.
+internal Symbol
+OperatorSymbol(bool32 Binary, char Op)
+{
+    local_persist thread_local Symbol Cache[2][256];
+
+    Symbol &S = Cache[Binary ? 1 : 0][(uint8)Op];
+    if (S == NoSymbol)
+    {
+        std::string Name = Binary ? "{binary" : "{unary";
+        Name += Op;
+        Name += '}';
+        S = Intern(llvm::StringRef(Name));
+    }
+    return S;
+}
+
+/// SymbolMap - A table keyed by symbol, stored flat and indexed directly. An
+/// empty (default constructed) value means unbound. clear() only visits the
+/// entries that were bound since the last clear, so it stays cheap no matter
+/// how many names the program has.
+template <typename T>
+struct SymbolMap
+{
+    std::vector<T> Values;
+    std::vector<Symbol> Bound;
+
+    /// find - The value bound to S, or null when there is none.
+    T *
+    find(Symbol S)
+    {
+        return (S < Values.size() && Values[S]) ? &Values[S] : nullptr;
+    }
+
+    /// operator[] - The slot for S, for binding it.
+    T &
+    operator[](Symbol S)
+    {
+        if (S >= Values.size())
+        {
+            Values.resize(S + 1);
+        }
+        if (!Values[S])
+        {
+            Bound.push_back(S);
+        }
+        return Values[S];
+    }
+
+    /// erase - Unbind S. It's usually the last one bound (a REPL expression's
+    /// prototype), so that's checked first.
+    void
+    erase(Symbol S)
+    {
+        if (S >= Values.size() || !Values[S])
+        {
+            return;
+        }
+
+        Values[S] = T();
+        if (Bound.back() == S)
+        {
+            Bound.pop_back();
+        }
+        else
+        {
+            Bound.erase(std::find(Bound.begin(), Bound.end(), S));
+        }
+    }
+
+    void
+    clear()
+    {
+        for (Symbol S : Bound)
+        {
+            Values[S] = T();
+        }
+        Bound.clear();
+    }
+};
@@ -15,27 +15,222 @@
 #include "kaleidoscope.cpp"
 
 #include "platform/externs/linux_extern_table.cpp"
+#include "platform/files/linux_files.cpp"
 
-int main()
+int main(int argc, char **argv)
 {
+    std::vector<MappedFile> Files;
+    bool32 WatchFiles = false;
+
+    for (int32 ArgIndex = 1; ArgIndex < argc; ++ArgIndex)
+    {
+        std::string Arg = argv[ArgIndex];
+        if (Arg == "--emit-ir")
+        {
+            TheMode = Mode_EmitIR;
+        }
+        else if (Arg == "--emit-obj")
+        {
+            TheMode = Mode_EmitObject;
+        }
+        else if (Arg == "--lazy")
+        {
+            LazyJIT = true;
+        }
+        else if (Arg == "--threads" && ArgIndex + 1 < argc)
+        {
+            CompileThreads = (uint32)strtoul(argv[++ArgIndex], nullptr, 10);
+        }
+        else if (Arg == "--cache-dir" && ArgIndex + 1 < argc)
+        {
+            ObjectCacheDir = argv[++ArgIndex];
+        }
+        else if (Arg == "--huge-pages")
+        {
+            HugePages = true;
+        }
+        else if (Arg == "--flat-ast")
+        {
+            FlatASTMode = true;
+        }
+        else if (Arg == "--no-simplify")
+        {
+            SimplifyAST = false;
+        }
+        else if (Arg == "--incremental")
+        {
+            IncrementalJIT = true;
+        }
+        else if (Arg == "--watch")
+        {
+            WatchFiles = true;
+            IncrementalJIT = true;
+        }
+        else if (Arg == "--tiered")
+        {
+            TieredJIT = true;
+        }
+        else if (Arg == "--tier-threshold" && ArgIndex + 1 < argc)
+        {
+            TierUpThreshold = strtoull(argv[++ArgIndex], nullptr, 10);
+        }
+        else if (Arg == "--jobs" && ArgIndex + 1 < argc)
+        {
+            FrontEndJobs = (uint32)strtoul(argv[++ArgIndex], nullptr, 10);
+        }
+        else if (Arg == "--vectorize")
+        {
+            VectorizeRemarks = true;
+        }
+        else if (Arg == "-O0")
+        {
+            OptLevel = llvm::OptimizationLevel::O0;
+        }
+        else if (Arg == "-O1")
+        {
+            OptLevel = llvm::OptimizationLevel::O1;
+        }
+        else if (Arg == "-O2")
+        {
+            OptLevel = llvm::OptimizationLevel::O2;
+        }
+        else if (Arg == "-O3")
+        {
+            OptLevel = llvm::OptimizationLevel::O3;
+        }
+        else if (Arg[0] != '-')
+        {
+            MappedFile File = PlatformMapFile(argv[ArgIndex]);
+            if (!File.Contents)
+            {
+                return 1;
+            }
+            Files.push_back(File);
+        }
+        else
+        {
+            fprintf(stderr, "Unknown option: %s\n", argv[ArgIndex]);
+            fprintf(stderr, "Usage: %s [--emit-ir | --emit-obj] [--lazy | --tiered [--tier-threshold N] | --incremental | --watch] [--threads N] [--jobs N] [--cache-dir DIR] [--huge-pages] [--flat-ast] [--no-simplify] [--vectorize] [-O0..-O3] [file ...]\n", argv[0]);
+            fprintf(stderr, "Reads stdin when no files are given.\n");
+            fprintf(stderr, "--watch runs the files again whenever they change, only changed defs are recompiled.\n");
+            fprintf(stderr, "--jobs parses and generates code for each file on N threads.\n");
+            fprintf(stderr, "--vectorize reports which loops were vectorized and why the others weren't, at -O2 unless -O3 is given.\n");
+            return 1;
+        }
+    }
+
+    if (LazyJIT && TieredJIT)
+    {
+        fprintf(stderr, "--lazy and --tiered can't be combined\n");
+        return 1;
+    }
+
+    // Incremental mode puts its own stub in front of every function.
+    if (IncrementalJIT && (LazyJIT || TieredJIT))
+    {
+        fprintf(stderr, "--incremental can't be combined with --lazy or --tiered\n");
+        return 1;
+    }
+
+    // Whole files are split up front, every item has to be compiled the same way.
+    if (FrontEndJobs && (Files.empty() || IncrementalJIT || TieredJIT))
+    {
+        fprintf(stderr, "--jobs needs files and can't be combined with --incremental, --watch or --tiered\n");
+        return 1;
+    }
+
+    // A redefined operator has to reach its callers through the stub too.
+    if (IncrementalJIT)
+    {
+        InlineOperators = false;
+    }
+
+    if (WatchFiles && (Files.empty() || TheMode != Mode_JIT))
+    {
+        fprintf(stderr, "--watch needs files to watch and can't emit code\n");
+        return 1;
+    }
+
+    // Loops are only vectorized from -O2 on, in the tiered JIT by the tier up.
+    if (VectorizeRemarks && OptLevel.getSpeedupLevel() < 2)
+    {
+        OptLevel = llvm::OptimizationLevel::O2;
+    }
+
+    // The baseline tier is always -O0, hot code goes to TierUpOptLevel.
+    if (TieredJIT)
+    {
+        OptLevel = llvm::OptimizationLevel::O0;
+    }
+
     // Initialize the compile target
     InitializeTarget();
 
     // Install standard binary operators.
     InstallStandardBinaryOperators();
 
-    // Prime the first token
-    getNextToken();
+    // The compile unit is named after the first file, or stdin if there are
+    // none.
+    if (!Files.empty())
+    {
+        BeginSourceFile(Files[0]);
+    }
 
     // Make the module, which holds all the code.
     InitializeLLVM();
 
-    // Run the main "interpreter loop" now
-    MainLoop();
-
-    FinalizeLLVM();
-
-    return 0;
+    if (Files.empty())
+    {
+        // Prime the first token and run the main "interpreter loop" now
+        getNextToken();
+        MainLoop();
+    }
+
+    // The files share the JIT (or the output module), so each one can call
+    // what the ones before it defined.
+    for (MappedFile &File : Files)
+    {
+        CompileFile(File);
+    }
+
+    // Run a file again every time it's saved, until we're killed. Defs that
+    // didn't change are skipped, so this costs what the edit touched.
+    while (WatchFiles)
+    {
+        usleep(100 * 1000);
+
+        for (MappedFile &File : Files)
+        {
+            if (PlatformGetFileWriteTime(File.Path) == File.WriteTime)
+            {
+                continue;
+            }
+
+            const char *Path = File.Path;
+            PlatformUnmapFile(&File);
+            File = PlatformMapFile(Path);
+            if (!File.Contents)
+            {
+                // Probably caught mid-save, the next change will retry.
+                continue;
+            }
+
+            uint64 Start = GetNanoseconds();
+            BeginSourceFile(File);
+            getNextToken();
+            MainLoop();
+            fprintf(stderr, "Reran %s in %.2f ms\n", Path, (real64)(GetNanoseconds() - Start) / 1e6);
+        }
+    }
+
+    int32 Result = FinalizeLLVM();
+
+    for (MappedFile &File : Files)
+    {
+        PlatformUnmapFile(&File);
+    }
+
+    return Result;
 }
 
 
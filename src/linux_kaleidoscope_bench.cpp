@@ -0,0 +1,319 @@
+// NOTE(srp): THIS IS NOT A FINAL PLATFORM LAYER
+// Benchmark driver: runs whole programs through the JIT and reports where the
+// time went, phase by phase, as JSON.
+
+#include <string>
+#include <cctype>
+#include <memory>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+#define PLATFORM_LINUX 1
+#define MESSED_UP_FUNCTION_H 1
+
+#include "kaleidoscope.cpp"
+
+#include "platform/externs/linux_extern_table.cpp"
+#include "platform/files/linux_files.cpp"
+
+/// BenchWorkload - A program to time. The play programs are mapped from Path,
+/// generated ones keep their source text in Generated.
+struct BenchWorkload
+{
+    std::string Name;
+    std::string Path;
+    std::string Generated;
+    MappedFile Source;
+};
+
+/// BenchResult - The fastest of the runs of a workload.
+struct BenchResult
+{
+    uint64 TotalNanoseconds;
+    uint64 PhaseNanoseconds[Phase_Count];
+};
+
+/// GenerateFunctions - Count small functions, each calling the one before in
+/// chains of 100, with a top-level call at the end of every chain so that
+/// all of them get JIT'd and run.
+internal std::string
+GenerateFunctions(uint32 Count)
+{
+    std::string Source;
+    for (uint32 Index = 0; Index < Count; ++Index)
+    {
+        std::string Name = "f" + std::to_string(Index);
+        std::string Number = std::to_string(Index);
+        if (Index % 100 == 0)
+        {
+            Source += "def " + Name + "(x) x * 0.5 + " + Number + ";\n";
+        }
+        else
+        {
+            std::string Prev = "f" + std::to_string(Index - 1);
+            Source += "def " + Name + "(x) if x < " + std::to_string(Index % 7) +
+                      " then " + Prev + "(x) + " + Number +
+                      " else " + Prev + "(x - 1) * 0.5;\n";
+        }
+
+        if (Index % 100 == 99 || Index + 1 == Count)
+        {
+            Source += Name + "(3);\n";
+        }
+    }
+    return Source;
+}
+
+/// GenerateDeepExpression - A function whose body is nested Depth parentheses
+/// deep, with x at the bottom so the simplifier can't fold it away, and a call
+/// to it. The operators alternate.
+internal std::string
+GenerateDeepExpression(uint32 Depth)
+{
+    const char Ops[] = {'+', '*', '-'};
+    std::string Source = "def deep(x) ";
+    for (uint32 Level = 0; Level < Depth; ++Level)
+    {
+        Source += "(";
+        Source += std::to_string(Level % 10);
+        Source += Ops[Level % 3];
+    }
+    Source += "x";
+    Source.append(Depth, ')');
+    Source += ";\ndeep(1);\n";
+    return Source;
+}
+
+/// GenerateLongExpression - A function whose body is a flat chain of Terms
+/// additions and multiplications, every product with x in it so none of them
+/// fold, and a call to it.
+internal std::string
+GenerateLongExpression(uint32 Terms)
+{
+    std::string Source = "def long(x) 0";
+    for (uint32 Term = 1; Term < Terms; ++Term)
+    {
+        Source += (Term % 2) ? " + x" : " * ";
+        if (!(Term % 2))
+        {
+            Source += std::to_string(Term % 10);
+        }
+    }
+    Source += ";\nlong(1);\n";
+    return Source;
+}
+
+/// RunWorkload - Time one complete compile-and-run of Source from a fresh JIT.
+internal BenchResult
+RunWorkload(const MappedFile &Source)
+{
+    BenchResult Result = {};
+
+    // Lex on its own first. The full run lexes token by token as it parses, so
+    // this is taken back out of the parse time below.
+    ResetPhaseTimes();
+    BeginSourceFile(Source);
+    {
+        PhaseTimer Timer(Phase_Lex);
+        while (gettok() != tok_eof)
+        {
+        }
+    }
+    uint64 LexNanoseconds = PhaseNanoseconds[Phase_Lex];
+
+    ResetPhaseTimes();
+    uint64 Start = GetNanoseconds();
+    {
+        BeginSourceFile(Source);
+
+        {
+            PhaseTimer Timer(Phase_JIT);
+            InitializeLLVM();
+        }
+
+        CompileFile(Source);
+
+        PhaseTimer Timer(Phase_JIT);
+        FinalizeLLVM();
+        ShutdownLLVM();
+    }
+    Result.TotalNanoseconds = GetNanoseconds() - Start;
+
+    for (uint32 Phase = 0; Phase < Phase_Count; ++Phase)
+    {
+        Result.PhaseNanoseconds[Phase] = PhaseNanoseconds[Phase];
+    }
+    Result.PhaseNanoseconds[Phase_Lex] = LexNanoseconds;
+    uint64 ParseAndLex = Result.PhaseNanoseconds[Phase_Parse];
+    Result.PhaseNanoseconds[Phase_Parse] = (ParseAndLex > LexNanoseconds) ? ParseAndLex - LexNanoseconds : 0;
+
+    return Result;
+}
+
+internal void
+PrintResult(FILE *Out, const BenchWorkload &Workload, const BenchResult &Result, bool32 Last)
+{
+    fprintf(Out, "    {\n");
+    fprintf(Out, "      \"name\": \"%s\",\n", Workload.Name.c_str());
+    fprintf(Out, "      \"bytes\": %llu,\n", (unsigned long long)Workload.Source.Size);
+    fprintf(Out, "      \"total_ms\": %.3f,\n", Result.TotalNanoseconds / 1e6);
+    fprintf(Out, "      \"phases_ms\": {");
+    for (uint32 Phase = 0; Phase < Phase_Count; ++Phase)
+    {
+        fprintf(Out, "%s\"%s\": %.3f", Phase ? ", " : "",
+                GetPhaseName((CompilerPhase)Phase), Result.PhaseNanoseconds[Phase] / 1e6);
+    }
+    fprintf(Out, "}\n");
+    fprintf(Out, "    }%s\n", Last ? "" : ",");
+}
+
+int main(int argc, char **argv)
+{
+    uint32 Runs = 3;
+    bool32 Quick = false;
+    std::string PlayDir = "play";
+    const char *OutPath = nullptr;
+
+    for (int32 ArgIndex = 1; ArgIndex < argc; ++ArgIndex)
+    {
+        std::string Arg = argv[ArgIndex];
+        if (Arg == "--runs" && ArgIndex + 1 < argc)
+        {
+            Runs = std::max(1u, (uint32)strtoul(argv[++ArgIndex], nullptr, 10));
+        }
+        else if (Arg == "--out" && ArgIndex + 1 < argc)
+        {
+            OutPath = argv[++ArgIndex];
+        }
+        else if (Arg == "--play-dir" && ArgIndex + 1 < argc)
+        {
+            PlayDir = argv[++ArgIndex];
+        }
+        else if (Arg == "--flat-ast")
+        {
+            FlatASTMode = true;
+        }
+        else if (Arg == "--no-simplify")
+        {
+            SimplifyAST = false;
+        }
+        else if (Arg == "--jobs" && ArgIndex + 1 < argc)
+        {
+            FrontEndJobs = (uint32)strtoul(argv[++ArgIndex], nullptr, 10);
+        }
+        else if (Arg == "--quick")
+        {
+            Quick = true;
+        }
+        else if (Arg == "-O0")
+        {
+            OptLevel = llvm::OptimizationLevel::O0;
+        }
+        else if (Arg == "-O1")
+        {
+            OptLevel = llvm::OptimizationLevel::O1;
+        }
+        else if (Arg == "-O2")
+        {
+            OptLevel = llvm::OptimizationLevel::O2;
+        }
+        else if (Arg == "-O3")
+        {
+            OptLevel = llvm::OptimizationLevel::O3;
+        }
+        else
+        {
+            fprintf(stderr, "Unknown option: %s\n", argv[ArgIndex]);
+            fprintf(stderr, "Usage: %s [--runs N] [--out FILE] [--play-dir DIR] [--quick] [--flat-ast] [--no-simplify] [--jobs N] [-O0..-O3]\n", argv[0]);
+            fprintf(stderr, "JSON goes to stdout unless --out is given. Programs print to stderr.\n");
+            fprintf(stderr, "--quick skips the 100k function program.\n");
+            return 1;
+        }
+    }
+
+    std::vector<BenchWorkload> Workloads;
+    Workloads.push_back({"fib", PlayDir + "/fib/fib.kal", "", {}});
+    Workloads.push_back({"mandelbrot", PlayDir + "/mandelbrot/mandelbrot.kal", "", {}});
+    Workloads.push_back({"functions_10", "", GenerateFunctions(10), {}});
+    Workloads.push_back({"functions_1000", "", GenerateFunctions(1000), {}});
+    if (!Quick)
+    {
+        Workloads.push_back({"functions_100000", "", GenerateFunctions(100000), {}});
+    }
+    Workloads.push_back({"deep_expression_1000", "", GenerateDeepExpression(1000), {}});
+    Workloads.push_back({"long_expression_10000", "", GenerateLongExpression(10000), {}});
+
+    // Only point into the strings once the vector is done moving them around.
+    for (BenchWorkload &Workload : Workloads)
+    {
+        if (!Workload.Path.empty())
+        {
+            Workload.Source = PlatformMapFile(Workload.Path.c_str());
+            if (!Workload.Source.Contents)
+            {
+                return 1;
+            }
+        }
+        else
+        {
+            Workload.Source.Path = Workload.Name.c_str();
+            Workload.Source.Contents = Workload.Generated.data();
+            Workload.Source.Size = Workload.Generated.size();
+        }
+    }
+
+    FILE *Out = OutPath ? fopen(OutPath, "w") : stdout;
+    if (!Out)
+    {
+        fprintf(stderr, "Could not open %s\n", OutPath);
+        return 1;
+    }
+
+    InitializeTarget();
+    InstallStandardBinaryOperators();
+
+    fprintf(Out, "{\n");
+    fprintf(Out, "  \"opt_level\": %u,\n", OptLevel.getSpeedupLevel());
+    fprintf(Out, "  \"flat_ast\": %s,\n", FlatASTMode ? "true" : "false");
+    fprintf(Out, "  \"simplify\": %s,\n", SimplifyAST ? "true" : "false");
+    fprintf(Out, "  \"jobs\": %u,\n", FrontEndJobs);
+    fprintf(Out, "  \"runs\": %u,\n", Runs);
+    fprintf(Out, "  \"workloads\": [\n");
+
+    for (size_t WorkloadIndex = 0; WorkloadIndex < Workloads.size(); ++WorkloadIndex)
+    {
+        BenchWorkload &Workload = Workloads[WorkloadIndex];
+        fprintf(stderr, "Running %s\n", Workload.Name.c_str());
+
+        BenchResult Best = {};
+        for (uint32 Run = 0; Run < Runs; ++Run)
+        {
+            BenchResult Result = RunWorkload(Workload.Source);
+            if (Run == 0 || Result.TotalNanoseconds < Best.TotalNanoseconds)
+            {
+                Best = Result;
+            }
+        }
+
+        PrintResult(Out, Workload, Best, WorkloadIndex + 1 == Workloads.size());
+        fflush(Out);
+    }
+
+    fprintf(Out, "  ]\n");
+    fprintf(Out, "}\n");
+
+    for (BenchWorkload &Workload : Workloads)
+    {
+        if (!Workload.Path.empty())
+        {
+            PlatformUnmapFile(&Workload.Source);
+        }
+    }
+
+    if (OutPath)
+    {
+        fclose(Out);
+    }
+    return 0;
+}
@@ -7,7 +7,7 @@
 #include "../ast/ast.cpp"
 
 /// LogError* - These are little helper functions for error handling.
-internal std::unique_ptr<ExprAST>
+internal ExprAST *
 LogError(const char *Str)
 {
     fprintf(stderr, "Error: %s\n", Str);
@@ -0,0 +1,106 @@
+#pragma once
+// NOTE(srp): Still not final platform-independent code
+
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "../platform/typedefs/typedefs.hpp"
+
+/// MemoryArena - Bump allocator for objects that all die together. Blocks are
+/// kept across resets, so once an arena has grown to fit the biggest thing put
+/// in it, filling it up again never calls malloc.
+struct MemoryArena
+{
+    struct Block
+    {
+        std::unique_ptr<uint8[]> Base;
+        size_t Size;
+    };
+
+    /// Cleanup - An object in the arena with a destructor to run on reset.
+    struct Cleanup
+    {
+        void *Object;
+        void (*Destroy)(void *Object);
+    };
+
+    std::vector<Block> Blocks;
+    size_t BlockIndex = 0; // The block being filled
+    size_t Used = 0;       // Bytes used in it
+    std::vector<Cleanup> Cleanups;
+};
+
+inline_variable size_t ArenaBlockSize = 64 * 1024;
+
+/// PushSize - Size bytes aligned to Align, which must be a power of two.
+internal void *
+PushSize(MemoryArena *Arena, size_t Size, size_t Align)
+{
+    while (Arena->BlockIndex < Arena->Blocks.size())
+    {
+        MemoryArena::Block &Block = Arena->Blocks[Arena->BlockIndex];
+        uintptr_t Base = (uintptr_t)Block.Base.get();
+        uintptr_t At = (Base + Arena->Used + (Align - 1)) & ~(uintptr_t)(Align - 1);
+        if (At + Size <= Base + Block.Size)
+        {
+            Arena->Used = (At + Size) - Base;
+            return (void *)At;
+        }
+
+        // Doesn't fit, move on to the next block.
+        ++Arena->BlockIndex;
+        Arena->Used = 0;
+    }
+
+    // Out of blocks. Anything bigger than a block gets a block of its own.
+    size_t BlockSize = (Size + Align > ArenaBlockSize) ? Size + Align : ArenaBlockSize;
+    Arena->Blocks.push_back({std::unique_ptr<uint8[]>(new uint8[BlockSize]), BlockSize});
+    Arena->BlockIndex = Arena->Blocks.size() - 1;
+    Arena->Used = 0;
+    return PushSize(Arena, Size, Align);
+}
+
+/// PushNew - Construct a T in the arena. Its destructor runs on ResetArena.
+template <typename T, typename... ArgTypes>
+internal T *
+PushNew(MemoryArena *Arena, ArgTypes&&... Args)
+{
+    T *Result = new (PushSize(Arena, sizeof(T), alignof(T))) T(std::forward<ArgTypes>(Args)...);
+    if (!std::is_trivially_destructible<T>::value)
+    {
+        Arena->Cleanups.push_back({Result, [](void *Object) { ((T *)Object)->~T(); }});
+    }
+    return Result;
+}
+
+/// PushArray - Copy Count trivially copyable elements into the arena.
+template <typename T>
+internal T *
+PushArray(MemoryArena *Arena, const T *Source, size_t Count)
+{
+    static_assert(std::is_trivially_copyable<T>::value, "PushArray doesn't run constructors or destructors");
+    T *Result = (T *)PushSize(Arena, sizeof(T) * Count, alignof(T));
+    for (size_t Index = 0; Index < Count; ++Index)
+    {
+        Result[Index] = Source[Index];
+    }
+    return Result;
+}
+
+/// ResetArena - Destroy everything in the arena, newest first, and start
+/// filling it from the beginning again.
+internal void
+ResetArena(MemoryArena *Arena)
+{
+    for (size_t Index = Arena->Cleanups.size(); Index > 0; --Index)
+    {
+        MemoryArena::Cleanup &Cleanup = Arena->Cleanups[Index - 1];
+        Cleanup.Destroy(Cleanup.Object);
+    }
+    Arena->Cleanups.clear();
+
+    Arena->BlockIndex = 0;
+    Arena->Used = 0;
+}
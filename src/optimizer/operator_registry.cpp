@@ -0,0 +1,155 @@
+#pragma once
+// NOTE(srp): Still not final platform-independent code
+
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "../platform/typedefs/typedefs.hpp"
+#include "../platform/llvm/llvm_include.hpp"
+#include "../lexer/symbols.cpp"
+
+// NOTE(srp): User defined operators are functions, and every use of one used to
+// be a call. They are tiny (mandelbrot's '|' is an if), so the call is most of
+// the cost. Operator definitions are marked always-inline and their bodies are
+// kept here as bitcode. A module that uses an operator defined in another
+// module (every module, in the JIT) gets an available_externally copy, which
+// the module pipeline inlines even at -O0 and then drops. If it somehow isn't
+// inlined, the call still goes to the real definition.
+
+/// OperatorBody - A module holding just the operator's definition, everything
+/// it calls is declared.
+struct OperatorBody
+{
+    llvm::SmallVector<char, 0> Bitcode;
+};
+
+/// OperatorRegistry - Bodies by operator symbol ('{binary|}'). Worker threads
+/// define and use operators at the same time (--jobs).
+struct OperatorRegistry
+{
+    std::mutex Mutex;
+    SymbolMap<std::shared_ptr<const OperatorBody>> Bodies;
+};
+
+global_variable OperatorRegistry TheOperators;
+
+llvm::Function *getFunction(Symbol Name);
+
+/// InlineOperators - Off in --incremental mode, where redefining an operator
+/// has to reach every caller through its stub.
+global_variable bool32 InlineOperators = true;
+
+internal std::shared_ptr<const OperatorBody>
+FindOperatorBody(Symbol Name)
+{
+    std::lock_guard<std::mutex> Lock(TheOperators.Mutex);
+    std::shared_ptr<const OperatorBody> *Body = TheOperators.Bodies.find(Name);
+    return Body ? *Body : nullptr;
+}
+
+/// RegisterOperator - F is the verified, optimized definition of operator Name.
+internal void
+RegisterOperator(Symbol Name, llvm::Function *F)
+{
+    F->addFnAttr(llvm::Attribute::AlwaysInline);
+    if (!InlineOperators)
+    {
+        return;
+    }
+
+    llvm::ValueToValueMapTy VMap;
+    std::unique_ptr<llvm::Module> M = llvm::CloneModule(
+            *F->getParent(), VMap, [F](const llvm::GlobalValue *GV) { return GV == F; });
+
+    auto Body = std::make_shared<OperatorBody>();
+    llvm::raw_svector_ostream OS(Body->Bitcode);
+    llvm::WriteBitcodeToFile(*M, OS);
+
+    std::lock_guard<std::mutex> Lock(TheOperators.Mutex);
+    TheOperators.Bodies[Name] = std::move(Body);
+}
+
+/// ImportOperator - Link an available_externally copy of Name into TheModule,
+/// along with the operators it uses in turn, so they all inline. Returns null
+/// if there's no body for it.
+internal llvm::Function *
+ImportOperator(Symbol Name)
+{
+    std::vector<Symbol> Pending = {Name};
+    while (!Pending.empty())
+    {
+        Symbol Next = Pending.back();
+        Pending.pop_back();
+
+        llvm::Function **Existing = ModuleFunctions.find(Next);
+        if (Existing && !(*Existing)->isDeclaration())
+        {
+            continue;
+        }
+
+        std::shared_ptr<const OperatorBody> Body = FindOperatorBody(Next);
+        if (!Body)
+        {
+            continue;
+        }
+
+        llvm::MemoryBufferRef Buffer(llvm::StringRef(Body->Bitcode.data(), Body->Bitcode.size()), SymbolName(Next));
+        std::unique_ptr<llvm::Module> M = ExitOnErr(llvm::parseBitcodeFile(Buffer, *TheContext));
+
+        std::vector<std::string> Linked;
+        for (llvm::Function &F : *M)
+        {
+            Linked.push_back(F.getName().str());
+        }
+
+        if (llvm::Linker::linkModules(*TheModule, std::move(M)))
+        {
+            fprintf(stderr, "Error: Could not import operator %s\n", SymbolName(Next).str().c_str());
+            continue;
+        }
+
+        // The linker added declarations for everything the body calls, codegen
+        // has to find those instead of making its own. Unused ones are skipped.
+        for (const std::string &LinkedName : Linked)
+        {
+            llvm::Function *F = TheModule->getFunction(LinkedName);
+            if (!F)
+            {
+                continue;
+            }
+
+            Symbol S = Intern(llvm::StringRef(LinkedName));
+            ModuleFunctions[S] = F;
+            if (S == Next)
+            {
+                F->setLinkage(llvm::GlobalValue::AvailableExternallyLinkage);
+            }
+            else if (F->isDeclaration())
+            {
+                Pending.push_back(S);
+            }
+        }
+    }
+
+    llvm::Function **F = ModuleFunctions.find(Name);
+    return (F && !(*F)->isDeclaration()) ? *F : nullptr;
+}
+
+/// getOperatorFunction - The function for a user defined operator, its body
+/// imported when there is one.
+internal llvm::Function *
+getOperatorFunction(bool32 Binary, char Op)
+{
+    Symbol Name = OperatorSymbol(Binary, Op);
+    llvm::Function **F = ModuleFunctions.find(Name);
+    if (F && !(*F)->isDeclaration())
+    {
+        return *F;
+    }
+
+    if (llvm::Function *Imported = ImportOperator(Name))
+    {
+        return Imported;
+    }
+    return getFunction(Name);
+}
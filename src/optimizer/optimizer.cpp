@@ -0,0 +1,246 @@
+#pragma once
+// NOTE(srp): Still not final platform-independent code
+
+#include <memory>
+#include "../platform/typedefs/typedefs.hpp"
+#include "../platform/llvm/llvm_include.hpp"
+#include "../debugging/phase_timing.cpp"
+
+/// OptLevel - Selected with -O0..-O3, used by both the per-function stage (run
+/// right after a function is emitted) and the per-module stage (run before the
+/// module is JIT'd or written out).
+global_variable llvm::OptimizationLevel OptLevel = llvm::OptimizationLevel::O0;
+
+/// VectorizeRemarks - Report on stderr which loops the vectorizer did and
+/// didn't vectorize, and why not (--vectorize).
+global_variable bool32 VectorizeRemarks = false;
+
+/// VectorizeRemarkHandler - Lets through the loop vectorizer's remarks and
+/// prints them with the loop's source location, everything else is dropped.
+struct VectorizeRemarkHandler : llvm::DiagnosticHandler
+{
+    bool isAnalysisRemarkEnabled(llvm::StringRef PassName) const override
+    {
+        return PassName == "loop-vectorize";
+    }
+
+    bool isMissedOptRemarkEnabled(llvm::StringRef PassName) const override
+    {
+        return PassName == "loop-vectorize";
+    }
+
+    bool isPassedOptRemarkEnabled(llvm::StringRef PassName) const override
+    {
+        return PassName == "loop-vectorize";
+    }
+
+    bool isAnyRemarkEnabled() const override
+    {
+        return true;
+    }
+
+    bool handleDiagnostics(const llvm::DiagnosticInfo &DI) override
+    {
+        const llvm::DiagnosticInfoOptimizationBase *Remark =
+            llvm::dyn_cast<llvm::DiagnosticInfoOptimizationBase>(&DI);
+        if (!Remark)
+        {
+            return false;
+        }
+
+        if (Remark->isEnabled())
+        {
+            std::string Message = Remark->getLocationStr() + ": " + Remark->getMsg() + "\n";
+            fputs(Message.c_str(), stderr);
+        }
+        return true;
+    }
+};
+
+/// EnableVectorizeRemarks - With --vectorize, have the optimizer report on the
+/// loops in modules made in Context.
+internal void
+EnableVectorizeRemarks(llvm::LLVMContext &Context)
+{
+    if (VectorizeRemarks)
+    {
+        Context.setDiagnosticHandler(std::make_unique<VectorizeRemarkHandler>());
+    }
+}
+
+/// FunctionOptimizer - The per-function cleanup pipeline and the analysis
+/// managers it needs. Kept around so we don't rebuild it for every function.
+struct FunctionOptimizer
+{
+    llvm::LoopAnalysisManager LAM;
+    llvm::FunctionAnalysisManager FAM;
+    llvm::CGSCCAnalysisManager CGAM;
+    llvm::ModuleAnalysisManager MAM;
+    llvm::FunctionPassManager FPM;
+};
+
+global_variable thread_local std::unique_ptr<FunctionOptimizer> TheFPM;
+
+internal llvm::CodeGenOpt::Level
+GetCodeGenOptLevel()
+{
+    if (OptLevel == llvm::OptimizationLevel::O0)
+    {
+        return llvm::CodeGenOpt::None;
+    }
+    if (OptLevel == llvm::OptimizationLevel::O1)
+    {
+        return llvm::CodeGenOpt::Less;
+    }
+    if (OptLevel == llvm::OptimizationLevel::O2)
+    {
+        return llvm::CodeGenOpt::Default;
+    }
+    return llvm::CodeGenOpt::Aggressive;
+}
+
+/// PromoteSingleStorePass - mem2reg for the -O0 stage (and so the tiered JIT's
+/// baseline), limited to the allocas that are stored to once: arguments,
+/// most vars and the arguments of inlined operators. Each load of those
+/// just becomes the stored value, no phis needed. Full mem2reg would also
+/// take the loop variables, but the fast register allocator spills every
+/// phi at the end of every block, which ends up costing more stack traffic
+/// in a loop than the alloca did.
+struct PromoteSingleStorePass : llvm::PassInfoMixin<PromoteSingleStorePass>
+{
+    llvm::PreservedAnalyses run(llvm::Function &F, llvm::FunctionAnalysisManager &FAM)
+    {
+        std::vector<llvm::AllocaInst*> Allocas;
+        for (llvm::Instruction &I : F.getEntryBlock())
+        {
+            llvm::AllocaInst *Alloca = llvm::dyn_cast<llvm::AllocaInst>(&I);
+            if (!Alloca || !llvm::isAllocaPromotable(Alloca))
+            {
+                continue;
+            }
+
+            uint32 Stores = 0;
+            for (llvm::User *U : Alloca->users())
+            {
+                Stores += llvm::isa<llvm::StoreInst>(U);
+            }
+            if (Stores == 1)
+            {
+                Allocas.push_back(Alloca);
+            }
+        }
+
+        if (Allocas.empty())
+        {
+            return llvm::PreservedAnalyses::all();
+        }
+
+        llvm::PromoteMemToReg(Allocas, FAM.getResult<llvm::DominatorTreeAnalysis>(F),
+                              &FAM.getResult<llvm::AssumptionAnalysis>(F));
+
+        llvm::PreservedAnalyses PA;
+        PA.preserveSet<llvm::CFGAnalyses>();
+        return PA;
+    }
+};
+
+internal void
+InitializeFunctionOptimizer()
+{
+    TheFPM = std::make_unique<FunctionOptimizer>();
+
+    llvm::PassBuilder PB;
+    PB.registerModuleAnalyses(TheFPM->MAM);
+    PB.registerCGSCCAnalyses(TheFPM->CGAM);
+    PB.registerFunctionAnalyses(TheFPM->FAM);
+    PB.registerLoopAnalyses(TheFPM->LAM);
+    PB.crossRegisterProxies(TheFPM->LAM, TheFPM->FAM, TheFPM->CGAM, TheFPM->MAM);
+
+    // Self-recursive tail calls become loops at every level, see MarkTailCalls.
+    // At -O0 that and promoting the variables that are never reassigned is
+    // all that happens to the emitted code.
+    if (OptLevel == llvm::OptimizationLevel::O0)
+    {
+        TheFPM->FPM.addPass(PromoteSingleStorePass());
+        TheFPM->FPM.addPass(llvm::TailCallElimPass());
+        return;
+    }
+
+    // Promote allocas to registers.
+    TheFPM->FPM.addPass(llvm::PromotePass());
+
+    // Do simple "peephole" optimizations and bit-twiddling optzns.
+    TheFPM->FPM.addPass(llvm::InstCombinePass());
+
+    if (OptLevel != llvm::OptimizationLevel::O1)
+    {
+        // Reassociate expressions.
+        TheFPM->FPM.addPass(llvm::ReassociatePass());
+        // Eliminate Common SubExpressions.
+        TheFPM->FPM.addPass(llvm::GVNPass());
+    }
+
+    // Turn self-recursive tail calls into loops.
+    TheFPM->FPM.addPass(llvm::TailCallElimPass());
+
+    // Simplify the control flow graph (deleting unreachable blocks, etc).
+    TheFPM->FPM.addPass(llvm::SimplifyCFGPass());
+}
+
+/// OptimizeFunction - Per-function stage, called once the function verifies.
+internal void
+OptimizeFunction(llvm::Function &F)
+{
+    if (!TheFPM)
+    {
+        return;
+    }
+
+    PhaseTimer Timer(Phase_Optimize);
+    TheFPM->FPM.run(F, TheFPM->FAM);
+
+    // Functions can be erased and their memory reused, don't keep stale results.
+    TheFPM->FAM.clear();
+}
+
+/// OptimizeModule - Per-module stage, the standard pipeline for Level. TM is
+/// optional, without it target specific cost models fall back to defaults.
+internal void
+OptimizeModule(llvm::Module &M, llvm::TargetMachine *TM = nullptr,
+               llvm::OptimizationLevel Level = OptLevel)
+{
+    PhaseTimer Timer(Phase_Optimize);
+
+    llvm::LoopAnalysisManager LAM;
+    llvm::FunctionAnalysisManager FAM;
+    llvm::CGSCCAnalysisManager CGAM;
+    llvm::ModuleAnalysisManager MAM;
+
+    // Loops are unrolled from -O1 on, vectorized from -O2 on. The vectorizer's
+    // cost model only sees real vector registers when the caller passes TM.
+    llvm::PipelineTuningOptions PTO;
+    bool32 Vectorize = (Level.getSpeedupLevel() >= 2);
+    PTO.LoopUnrolling = true;
+    PTO.LoopVectorization = Vectorize;
+    PTO.LoopInterleaving = Vectorize;
+    PTO.SLPVectorization = Vectorize;
+
+    llvm::PassBuilder PB(TM, PTO);
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    llvm::ModulePassManager MPM;
+    if (Level == llvm::OptimizationLevel::O0)
+    {
+        MPM = PB.buildO0DefaultPipeline(Level);
+    }
+    else
+    {
+        MPM = PB.buildPerModuleDefaultPipeline(Level);
+    }
+
+    MPM.run(M, MAM);
+}
@@ -3,41 +3,82 @@
 
 #include <map>
 #include <memory>
+#include <vector>
 #include "../platform/typedefs/typedefs.hpp"
 
 #include "../lexer/lexer.cpp"
+#include "../ast/ast_builder.cpp"
 #include "../logging/parser_err.cpp"
 
 /// CurTok/getNextToken - Provide a simple token buffer. CurTok is the current
 /// token the parser is looking at. genNextToken reads another token from the
 /// lexer and updates CurTok with its results.
-global_variable int32 CurTok;
+global_variable thread_local int32 CurTok;
+
+/// ItemHash - Hash of every token consumed since the current definition
+/// started. Only what the tokens are goes in, not where they are, so moving or
+/// reformatting a def leaves it alone.
+global_variable thread_local llvm::hash_code ItemHash;
+
+/// ItemCallees - Names called by the current definition, with repeats.
+global_variable thread_local std::vector<Symbol> ItemCallees;
 
 internal int32
 getNextToken()
 {
+    ItemHash = llvm::hash_combine(ItemHash, CurTok);
+    if (CurTok == tok_identifier)
+    {
+        ItemHash = llvm::hash_combine(ItemHash, IdentifierSym);
+    }
+    else if (CurTok == tok_number)
+    {
+        uint64 Bits;
+        memcpy(&Bits, &NumVal, sizeof(Bits));
+        ItemHash = llvm::hash_combine(ItemHash, Bits, NumIsInteger);
+    }
+
     return CurTok = gettok();
 }
 
 /// BinopPrecedence - This holds precedence for each binary operator that is defined.
-global_variable std::map<char, int32> BinopPrecedence;
+global_variable thread_local std::map<char, int32> BinopPrecedence;
 
 // NOTE(srp): Recursive descent parsing here
 
-internal std::unique_ptr<ExprAST> ParseExpression();
+internal ExprRef ParseExpression();
 
 /// numberexpr ::= number
 /// To be called when the current token is a tok_number token.
-internal std::unique_ptr<ExprAST>
+internal ExprRef
 ParseNumberExpr()
 {
-    auto Result = std::make_unique<NumberExprAST>(NumVal);
+    auto Result = MakeNumberExpr({NumVal, NumIsInteger});
     getNextToken(); // consume the number
-    return std::move(Result);
+    return Result;
+}
+
+/// typeannotation ::= ':' ('int' | 'double' | 'vec4' | 'vec8' | 'array')
+/// Returns Type_Inferred, after logging the error, if ':' isn't followed by a
+/// type.
+internal ValueType
+ParseTypeAnnotation()
+{
+    getNextToken(); // eat ':'
+
+    ValueType Type = (CurTok == tok_identifier) ? LookupTypeName(IdentifierSym) : Type_Inferred;
+    if (Type == Type_Inferred)
+    {
+        LogError("expected a type after ':'");
+        return Type_Inferred;
+    }
+
+    getNextToken(); // eat the type
+    return Type;
 }
 
 /// parenexpr ::= '(' expression ')'
-internal std::unique_ptr<ExprAST>
+internal ExprRef
 ParseParenExpr()
 {
     // NOTE(srp): Parenthesis do not create AST nodes, they just guide the
@@ -62,32 +103,51 @@ ParseParenExpr()
 
 /// identifierexpr
 ///     ::= identifier
+///     ::= identifier '[' expression ']'
 ///     ::= identifier '(' expression* ')'
-internal std::unique_ptr<ExprAST>
+internal ExprRef
 ParseIdentifierExpr()
 {
     /// To be called when the current token is a tok_identifier token.
-    std::string IdName = IdentifierStr;
+    Symbol IdName = IdentifierSym;
 
     SourceLocation LitLoc = CurLoc;
 
     getNextToken(); // eat identifier.
 
+    if (CurTok == '[') // Array element.
+    {
+        getNextToken(); // eat '['
+        auto Index = ParseExpression();
+        if (!Index)
+        {
+            return nullptr;
+        }
+
+        if (CurTok != ']')
+        {
+            return LogError("expected ']'");
+        }
+
+        getNextToken(); // eat ']'
+        return MakeIndexExpr(LitLoc, IdName, Index);
+    }
+
     if (CurTok != '(') // Simple variable ref.
     {
-        return std::make_unique<VariableExprAST>(LitLoc, IdName);
+        return MakeVariableExpr(LitLoc, IdName);
     } // else: function call expression
 
     // Call.
     getNextToken(); // eat '('
-    std::vector<std::unique_ptr<ExprAST>> Args;
+    llvm::SmallVector<ExprRef, 8> Args;
     if (CurTok != ')')
     {
         while(true)
         {
             if (auto Arg = ParseExpression())
             {
-                Args.push_back(std::move(Arg));
+                Args.push_back(Arg);
             }
             else
             {
@@ -111,11 +171,12 @@ ParseIdentifierExpr()
     // Eat the ')'
     getNextToken();
 
-    return std::make_unique<CallExprAST>(LitLoc, IdName, std::move(Args));
+    ItemCallees.push_back(IdName);
+    return MakeCallExpr(LitLoc, IdName, Args);
 }
 
 /// ifexpr ::= 'if' expression 'then' expression 'else' expression
-internal std::unique_ptr<ExprAST>
+internal ExprRef
 ParseIfExpr()
 {
     SourceLocation IfLoc = CurLoc;
@@ -156,13 +217,15 @@ ParseIfExpr()
         return nullptr;
     }
 
-    return std::make_unique<IfExprAST>(IfLoc, std::move(Cond), std::move(Then), std::move(Else));
+    return MakeIfExpr(IfLoc, Cond, Then, Else);
 }
 
 /// forexpr ::= 'for' identifier '=' expr ',' expr (',' expr)? 'in' expression
-internal std::unique_ptr<ExprAST>
+internal ExprRef
 ParseForExpr()
 {
+    SourceLocation ForLoc = CurLoc;
+
     getNextToken(); // eat the 'for'
 
     if (CurTok != tok_identifier)
@@ -170,7 +233,7 @@ ParseForExpr()
         return LogError("expected identifier after 'for'");
     }
 
-    std::string IdName = IdentifierStr;
+    Symbol IdName = IdentifierSym;
     getNextToken(); // eat identifier
 
     if (CurTok != '=')
@@ -200,7 +263,7 @@ ParseForExpr()
     }
 
     // The step value is optional
-    std::unique_ptr<ExprAST> Step;
+    ExprRef Step;
     if (CurTok == ',')
     {
         getNextToken(); // eat ','
@@ -224,17 +287,17 @@ ParseForExpr()
         return nullptr;
     }
 
-    return std::make_unique<ForExprAST>(IdName, std::move(Start), std::move(End), std::move(Step), std::move(Body));
+    return MakeForExpr(ForLoc, IdName, Start, End, Step, Body);
 }
 
-/// varexpr ::= 'var' identifier ('=' expression)?
-//                    (',' identifier ('=' expression)?)* 'in' expression
-internal std::unique_ptr<ExprAST> 
+/// varexpr ::= 'var' identifier typeannotation? ('=' expression)?
+//                    (',' identifier typeannotation? ('=' expression)?)* 'in' expression
+internal ExprRef
 ParseVarExpr()
 {
     getNextToken(); // eat 'var'
 
-    std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
+    std::vector<ParsedVar> VarNames;
 
     // At least one variable name is required.
     if (CurTok != tok_identifier)
@@ -245,11 +308,22 @@ ParseVarExpr()
     // Variable list
     while (true)
     {
-        std::string Name = IdentifierStr;
+        Symbol Name = IdentifierSym;
         getNextToken(); // eat identifier
 
+        // Without a type, it gets the initializer's
+        ValueType Type = Type_Inferred;
+        if (CurTok == ':')
+        {
+            Type = ParseTypeAnnotation();
+            if (Type == Type_Inferred)
+            {
+                return nullptr;
+            }
+        }
+
         // Read the optional initializer
-        std::unique_ptr<ExprAST> Init;
+        ExprRef Init;
         if (CurTok == '=')
         {
             getNextToken(); // eat '='
@@ -261,7 +335,7 @@ ParseVarExpr()
             }
         }
 
-        VarNames.push_back(std::make_pair(Name, std::move(Init)));
+        VarNames.push_back({Name, Type, Init});
 
         // End of var list, exit loop
         if (CurTok != ',')
@@ -291,7 +365,7 @@ ParseVarExpr()
         return nullptr;
     }
 
-    return std::make_unique<VarExprAST>(std::move(VarNames), std::move(Body));
+    return MakeVarExpr(std::move(VarNames), Body);
 }
 
 /// primary
@@ -302,7 +376,7 @@ ParseVarExpr()
 ///     ::= forexpr
 ///     ::= varexpr
 /// Works as entry point for "primary" expressions
-internal std::unique_ptr<ExprAST>
+internal ExprRef
 ParsePrimary()
 {
     // That's why in the following functions we can assume CurTok's state
@@ -329,7 +403,7 @@ ParsePrimary()
 /// unary
 ///     ::= primary
 ///     ::= '!' unary
-internal std::unique_ptr<ExprAST>
+internal ExprRef
 ParseUnary()
 {
     // If the current token is not an operator, it must be a primary expr
@@ -343,7 +417,7 @@ ParseUnary()
     getNextToken();
     if (auto Operand = ParseUnary())
     {
-        return std::make_unique<UnaryExprAST>(Opc, std::move(Operand));
+        return MakeUnaryExpr(Opc, Operand);
     }
 
     return nullptr;
@@ -373,8 +447,8 @@ GetTokPrecedence()
 
 /// binoprhs
 ///     ::= ('+' primary)*
-internal std::unique_ptr<ExprAST>
-ParseBinOpRHS(int32 ExprPrec, std::unique_ptr<ExprAST> LHS)
+internal ExprRef
+ParseBinOpRHS(int32 ExprPrec, ExprRef LHS)
 {
     // If this is a binop, find its precedence
     while (true)
@@ -408,7 +482,7 @@ ParseBinOpRHS(int32 ExprPrec, std::unique_ptr<ExprAST> LHS)
             // That way we'll join higher precedence RHS'es and 'collapse' them
             // when we find a lower precedence one.
             // e.g: a+b*c+d -> (+: (+: a, (*: b, c)), d)
-            RHS = ParseBinOpRHS(TokPrec + 1, std::move(RHS));
+            RHS = ParseBinOpRHS(TokPrec + 1, RHS);
             if (!RHS)
             {
                 return nullptr;
@@ -416,14 +490,14 @@ ParseBinOpRHS(int32 ExprPrec, std::unique_ptr<ExprAST> LHS)
         }
 
         // Merge LHS/RGS.
-        LHS = std::make_unique<BinaryExprAST>(BinLoc, BinOp, std::move(LHS), std::move(RHS));
+        LHS = MakeBinaryExpr(BinLoc, BinOp, LHS, RHS);
     }
 }
 
 /// expression
 ///     ::= primary binoprhs
 /// NOTE(srp): binoprhs is allowed to be empty
-internal std::unique_ptr<ExprAST>
+internal ExprRef
 ParseExpression()
 {
     auto LHS = ParseUnary();
@@ -432,22 +506,33 @@ ParseExpression()
         return nullptr;
     }
 
-    return ParseBinOpRHS(0, std::move(LHS));
+    return ParseBinOpRHS(0, LHS);
 }
 
 // NOTE(srp): Less interesting parsing here
 
 /// prototype
-///     ::= id '(' id* ')'
-///     ::= binary LETTER number? (id, id)
-///     ::= unary LETTER (id)
+///     ::= qualifier* id '(' arg* ')' typeannotation?
+///     ::= qualifier* binary LETTER number? (arg, arg) typeannotation?
+///     ::= qualifier* unary LETTER (arg) typeannotation?
+/// qualifier ::= 'pure' | 'memo'
+/// arg ::= id typeannotation?
+/// NOTE(srp): A ':' right after the ')' is always the return type, a body
+/// can't start with a binary operator and nobody defines a unary ':'.
 internal std::unique_ptr<PrototypeAST>
 ParsePrototype()
 {
-    std::string FnName;
+    Symbol FnName;
 
     SourceLocation FnLoc = CurLoc;
 
+    uint32 Qualifiers = 0;
+    while (CurTok == tok_pure || CurTok == tok_memo)
+    {
+        Qualifiers |= (CurTok == tok_pure) ? Qualifier_Pure : Qualifier_Memo;
+        getNextToken(); // eat the qualifier
+    }
+
     unsigned Kind = 0; // 0 = identifier, 1 = unary, 2 = binary
     unsigned BinaryPrecedence = 30;
 
@@ -456,31 +541,27 @@ ParsePrototype()
         default:
             return LogErrorP("Expected function name in prototype");
         case tok_identifier:
-            FnName = IdentifierStr;
+            FnName = IdentifierSym;
             Kind = 0;
             getNextToken();
             break;
         case tok_unary:
             getNextToken();
-            if (!isascii(CurTok))
+            if (!IsUserOperator(CurTok))
             {
                 return LogErrorP("Expected unary operator");
             }
-            FnName = "{unary";
-            FnName += (char)CurTok;
-            FnName += "}";
+            FnName = OperatorSymbol(false, (char)CurTok);
             Kind = 1;
             getNextToken();
             break;
         case tok_binary:
             getNextToken();
-            if (!isascii(CurTok))
+            if (!IsUserOperator(CurTok))
             {
                 return LogErrorP("Expected binary operator");
             }
-            FnName = "{binary";
-            FnName += (char)CurTok;
-            FnName += "}";
+            FnName = OperatorSymbol(true, (char)CurTok);
             Kind = 2;
             getNextToken();
 
@@ -502,11 +583,25 @@ ParsePrototype()
         return LogErrorP("Expected '(' in prototype");
     }
 
-    // Read the list of argument names
-    std::vector<std::string> ArgNames;
-    while (getNextToken() == tok_identifier)
+    // Read the list of argument names, and their types if any is annotated
+    std::vector<Symbol> ArgNames;
+    std::vector<ValueType> ArgTypes;
+    getNextToken(); // eat '('
+    while (CurTok == tok_identifier)
     {
-        ArgNames.push_back(IdentifierStr);
+        ArgNames.push_back(IdentifierSym);
+        getNextToken(); // eat identifier
+
+        if (CurTok == ':')
+        {
+            ValueType Type = ParseTypeAnnotation();
+            if (Type == Type_Inferred)
+            {
+                return nullptr;
+            }
+            ArgTypes.resize(ArgNames.size(), Type_Double);
+            ArgTypes.back() = Type;
+        }
     }
     if (CurTok != ')')
     {
@@ -516,19 +611,58 @@ ParsePrototype()
     // success
     getNextToken(); // eat ')'
 
+    ValueType ReturnType = Type_Double;
+    if (CurTok == ':')
+    {
+        ReturnType = ParseTypeAnnotation();
+        if (ReturnType == Type_Inferred)
+        {
+            return nullptr;
+        }
+    }
+    if (!ArgTypes.empty())
+    {
+        ArgTypes.resize(ArgNames.size(), Type_Double);
+    }
+
     // Verify right number of names for operator
     if (Kind && ArgNames.size() != Kind)
     {
         return LogErrorP("Invalid number of operands for operator");
     }
 
-    return std::make_unique<PrototypeAST>(FnLoc, FnName, std::move(ArgNames), Kind != 0, BinaryPrecedence);
+    // An array can't come out of a function without side effects, and the
+    // memo cache is keyed on numbers.
+    if (Qualifiers && ReturnType == Type_Array)
+    {
+        return LogErrorP("A pure function can't return an array");
+    }
+    if (Qualifiers & Qualifier_Memo)
+    {
+        for (ValueType Type : ArgTypes)
+        {
+            if (Type != Type_Double && Type != Type_Int)
+            {
+                return LogErrorP("A memo function only takes numbers");
+            }
+        }
+        if (ReturnType != Type_Double && ReturnType != Type_Int)
+        {
+            return LogErrorP("A memo function only returns numbers");
+        }
+    }
+
+    return std::make_unique<PrototypeAST>(FnLoc, FnName, std::move(ArgNames), Kind != 0, BinaryPrecedence,
+                                          std::move(ArgTypes), ReturnType, Qualifiers);
 }
 
 /// definition ::= 'def' prototype expression
 internal std::unique_ptr<FunctionAST>
 ParseDefinition()
 {
+    ItemHash = llvm::hash_code(0);
+    ItemCallees.clear();
+
     getNextToken(); // eat 'def'
     auto Proto = ParsePrototype();
     if (!Proto)
@@ -538,7 +672,7 @@ ParseDefinition()
     
     if (auto E = ParseExpression())
     {
-        return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+        return std::make_unique<FunctionAST>(std::move(Proto), E, (uint64)(size_t)ItemHash, ItemCallees);
     }
 
     return nullptr;
@@ -555,15 +689,15 @@ ParseExtern()
 /// toplevelexpr ::= expression
 /// Anonymous nullary functions to allow arbitrary top-level expressions
 internal std::unique_ptr<FunctionAST>
-ParseTopLevelExpr()
+ParseTopLevelExpr(Symbol ExprName)
 {
     SourceLocation FnLoc = CurLoc;
 
     if (auto E = ParseExpression())
     {
-        // Make thee top level expression be main.
-        auto Proto = std::make_unique<PrototypeAST>(FnLoc, "main", std::vector<std::string>());
-        return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+        // Make thee top level expression be main (or whatever the driver asks).
+        auto Proto = std::make_unique<PrototypeAST>(FnLoc, ExprName, std::vector<Symbol>());
+        return std::make_unique<FunctionAST>(std::move(Proto), E);
     }
     return nullptr;
 }
@@ -573,10 +707,18 @@ InstallStandardBinaryOperators()
 {
     // 1 is lowest precedence
     BinopPrecedence['='] = 2;
+    BinopPrecedence[tok_or] = 5;
+    BinopPrecedence[tok_and] = 6;
+    BinopPrecedence[tok_equal] = 9;
+    BinopPrecedence[tok_not_equal] = 9;
     BinopPrecedence['<'] = 10;
+    BinopPrecedence['>'] = 10;
+    BinopPrecedence[tok_less_equal] = 10;
+    BinopPrecedence[tok_greater_equal] = 10;
     BinopPrecedence['+'] = 20;
     BinopPrecedence['-'] = 20;
-    BinopPrecedence['*'] = 40; // highest
+    BinopPrecedence['*'] = 40;
+    BinopPrecedence['/'] = 40; // highest
 }
 
 
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "../typedefs/typedefs.hpp"
+
+// NOTE(srp): Runtime support for arrays, called by the code EmitIndex and the
+// array builtins generate. An array is a 16 byte header followed by the
+// elements, the length is the 8 bytes right before the first element. Code
+// only ever sees the pointer to the first element, so it stays 16 byte
+// aligned.
+
+/// ks_array_new - n zeroed doubles. Doesn't return if they can't be had.
+extern "C" real64 *
+ks_array_new(int64 Length)
+{
+    if (Length < 0 || Length > (INT64_MAX - 16) / 8)
+    {
+        fprintf(stderr, "Error: can't make an array of %lld elements\n", (long long)Length);
+        _Exit(1);
+    }
+
+    uint8 *Block = (uint8 *)calloc(1, 16 + 8 * Length);
+    if (!Block)
+    {
+        fprintf(stderr, "Error: out of memory making an array of %lld elements\n", (long long)Length);
+        _Exit(1);
+    }
+
+    real64 *Elements = (real64 *)(Block + 16);
+    ((int64 *)Elements)[-1] = Length;
+    return Elements;
+}
+
+/// ks_array_free - Give an array's memory back, returns 0.
+extern "C" real64
+ks_array_free(real64 *Elements)
+{
+    free((uint8 *)Elements - 16);
+    return 0;
+}
+
+/// ks_array_index_error - Where a failed bounds check ends up. The program
+/// can't go on, and other threads may still be compiling, so it leaves without
+/// running any destructors.
+extern "C" void
+ks_array_index_error(int64 Index, int64 Length)
+{
+    fprintf(stderr, "Error: array index %lld is out of bounds for length %lld\n", (long long)Index, (long long)Length);
+    _Exit(1);
+}
@@ -2,3 +2,6 @@
 
 #include "linux_putchard.cpp"
 #include "linux_printd.cpp"
+#include "linux_arrays.cpp"
+#include "linux_memo.cpp"
+#include "linux_incremental.cpp"
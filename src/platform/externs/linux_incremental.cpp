@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "../typedefs/typedefs.hpp"
+
+/// ks_stale_function_error - Run instead of a function that was compiled
+/// against the old signature of one it calls (--incremental). Like a failed
+/// bounds check, the program can't go on.
+extern "C" void
+ks_stale_function_error(const char *Name)
+{
+    fprintf(stderr, "Error: %s must be redefined, a function it calls changed its signature\n", Name);
+    _Exit(1);
+}
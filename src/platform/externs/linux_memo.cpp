@@ -0,0 +1,126 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../typedefs/typedefs.hpp"
+
+// NOTE(srp): Runtime support for memo functions, called by the code
+// EmitMemoLookup generates. Every memo function has a table of its own, the
+// generated code keeps the pointer to it in a global and passes that in. A key
+// is the bits of the arguments, the value the bits of the result, so ints and
+// doubles both go in as int64s. Tables only grow, and JIT'd code runs on one
+// thread, so there's no locking.
+
+/// ks_memo_table - Open addressing with linear probing. An entry is a used
+/// flag, KeyCount words of key and the result.
+struct ks_memo_table
+{
+    int64 KeyCount;
+    int64 Capacity; // A power of two
+    int64 Count;
+    int64 *Entries;
+};
+
+internal uint64
+MemoHash(const int64 *Key, int64 KeyCount)
+{
+    uint64 Hash = 0x9E3779B97F4A7C15ull;
+    for (int64 Word = 0; Word < KeyCount; ++Word)
+    {
+        Hash = (Hash ^ (uint64)Key[Word]) * 0xBF58476D1CE4E5B9ull;
+        Hash ^= Hash >> 31;
+    }
+    return Hash;
+}
+
+/// MemoFind - The entry for Key, or the free one where it would go.
+internal int64 *
+MemoFind(ks_memo_table *Table, const int64 *Key)
+{
+    int64 Stride = Table->KeyCount + 2;
+    uint64 Mask = (uint64)Table->Capacity - 1;
+    for (uint64 Slot = MemoHash(Key, Table->KeyCount) & Mask;; Slot = (Slot + 1) & Mask)
+    {
+        int64 *Entry = Table->Entries + Slot * Stride;
+        if (!Entry[0] || !memcmp(Entry + 1, Key, Table->KeyCount * sizeof(int64)))
+        {
+            return Entry;
+        }
+    }
+}
+
+internal void
+MemoAllocate(ks_memo_table *Table, int64 Capacity)
+{
+    Table->Capacity = Capacity;
+    Table->Entries = (int64 *)calloc(Capacity, (Table->KeyCount + 2) * sizeof(int64));
+    if (!Table->Entries)
+    {
+        fprintf(stderr, "Error: out of memory growing a memo table to %lld entries\n", (long long)Capacity);
+        _Exit(1);
+    }
+}
+
+/// ks_memo_lookup - Whether Key is in *Table, the result goes in *Result if it
+/// is. *Table is null until the first ks_memo_store.
+extern "C" int64
+ks_memo_lookup(ks_memo_table **Table, const int64 *Key, int64 *Result)
+{
+    if (!*Table)
+    {
+        return 0;
+    }
+
+    int64 *Entry = MemoFind(*Table, Key);
+    if (!Entry[0])
+    {
+        return 0;
+    }
+    *Result = Entry[(*Table)->KeyCount + 1];
+    return 1;
+}
+
+/// ks_memo_store - Remember Result for Key, making the table if needed.
+extern "C" void
+ks_memo_store(ks_memo_table **Table, const int64 *Key, int64 KeyCount, int64 Result)
+{
+    if (!*Table)
+    {
+        *Table = (ks_memo_table *)calloc(1, sizeof(ks_memo_table));
+        if (!*Table)
+        {
+            fprintf(stderr, "Error: out of memory making a memo table\n");
+            _Exit(1);
+        }
+        (*Table)->KeyCount = KeyCount;
+        MemoAllocate(*Table, 64);
+    }
+
+    ks_memo_table *T = *Table;
+    if (4 * (T->Count + 1) > 3 * T->Capacity)
+    {
+        int64 Stride = T->KeyCount + 2;
+        int64 *Old = T->Entries;
+        int64 OldCapacity = T->Capacity;
+        MemoAllocate(T, 2 * OldCapacity);
+        for (int64 Slot = 0; Slot < OldCapacity; ++Slot)
+        {
+            int64 *Entry = Old + Slot * Stride;
+            if (Entry[0])
+            {
+                memcpy(MemoFind(T, Entry + 1), Entry, Stride * sizeof(int64));
+            }
+        }
+        free(Old);
+    }
+
+    int64 *Entry = MemoFind(T, Key);
+    if (!Entry[0])
+    {
+        Entry[0] = 1;
+        memcpy(Entry + 1, Key, KeyCount * sizeof(int64));
+        ++T->Count;
+    }
+    Entry[KeyCount + 1] = Result;
+}
@@ -2,4 +2,7 @@
 
 #include "win32_putchard.cpp"
 #include "win32_printd.cpp"
+#include "win32_arrays.cpp"
+#include "win32_memo.cpp"
+#include "win32_incremental.cpp"
 
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../typedefs/typedefs.hpp"
+
+/// StatWriteTime - st_mtim in nanoseconds.
+internal uint64
+StatWriteTime(const struct stat &Stat)
+{
+    return (uint64)Stat.st_mtim.tv_sec * 1000000000ull + (uint64)Stat.st_mtim.tv_nsec;
+}
+
+/// PlatformMapFile - Map a whole file read-only. On failure Contents is null
+/// and an error has been printed.
+internal MappedFile
+PlatformMapFile(const char *Path)
+{
+    MappedFile Result = {};
+    Result.Path = Path;
+
+    int FD = open(Path, O_RDONLY);
+    if (FD < 0)
+    {
+        fprintf(stderr, "Could not open %s\n", Path);
+        return Result;
+    }
+
+    struct stat Stat;
+    if (fstat(FD, &Stat) != 0)
+    {
+        fprintf(stderr, "Could not stat %s\n", Path);
+        close(FD);
+        return Result;
+    }
+
+    Result.Size = (uint64)Stat.st_size;
+    Result.WriteTime = StatWriteTime(Stat);
+    if (Result.Size == 0)
+    {
+        // Nothing to map, but still a valid (empty) source.
+        Result.Contents = "";
+        close(FD);
+        return Result;
+    }
+
+    void *Contents = mmap(nullptr, Result.Size, PROT_READ, MAP_PRIVATE, FD, 0);
+    close(FD);
+    if (Contents == MAP_FAILED)
+    {
+        fprintf(stderr, "Could not map %s\n", Path);
+        Result.Size = 0;
+        return Result;
+    }
+
+    // We read it front to back exactly once.
+    madvise(Contents, Result.Size, MADV_SEQUENTIAL);
+
+    Result.Contents = (const char *)Contents;
+    return Result;
+}
+
+internal void
+PlatformUnmapFile(MappedFile *File)
+{
+    if (File->Contents && File->Size)
+    {
+        munmap((void *)File->Contents, File->Size);
+    }
+    *File = {};
+}
+
+[[maybe_unused]] internal uint64
+PlatformGetFileWriteTime(const char *Path)
+{
+    struct stat Stat;
+    if (stat(Path, &Stat) != 0)
+    {
+        return 0;
+    }
+    return StatWriteTime(Stat);
+}
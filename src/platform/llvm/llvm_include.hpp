@@ -9,6 +9,7 @@
 
 #include "../typedefs/typedefs.hpp"
 #include "../../jit/KaleidoscopeJIT.h"
+#include "../../lexer/symbols.cpp"
 #include <map>
 #include <string>
 
@@ -17,12 +18,20 @@ namespace llvmo = llvm::orc;
 
 class PrototypeAST;
 
-global_variable std::unique_ptr<llvm::LLVMContext> TheContext;
-global_variable std::unique_ptr<llvm::Module> TheModule;
-global_variable std::unique_ptr<llvm::IRBuilder<>> Builder;
-global_variable std::unique_ptr<llvm::DIBuilder> DBuilder;
+// NOTE(srp): What's being generated is per thread, the parallel front-end gives
+// every worker its own context and module. The JIT and the prototypes are
+// shared by everyone.
+
+global_variable thread_local std::unique_ptr<llvm::LLVMContext> TheContext;
+global_variable thread_local std::unique_ptr<llvm::Module> TheModule;
+global_variable thread_local std::unique_ptr<llvm::IRBuilder<>> Builder;
+global_variable thread_local std::unique_ptr<llvm::DIBuilder> DBuilder;
 global_variable llvm::ExitOnError ExitOnErr;
 
-global_variable std::map<std::string, llvm::AllocaInst*> NamedValues;
+global_variable thread_local SymbolMap<llvm::AllocaInst*> NamedValues;
 global_variable std::unique_ptr<llvmo::KaleidoscopeJIT> TheJIT;
-global_variable std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
+global_variable SymbolMap<std::unique_ptr<PrototypeAST>> FunctionProtos;
+
+/// ModuleFunctions - The functions in TheModule by name, so lookups don't go
+/// through the module's string table. Emptied with each new module.
+global_variable thread_local SymbolMap<llvm::Function*> ModuleFunctions;